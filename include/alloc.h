@@ -4,23 +4,36 @@
 #include <stddef.h>
 #include "mm.h"
 #include "uart.h"
+#include "spinlock.h"
 
-struct kmem_cache_entry {
-    struct kmem_cache_entry *prev;
-    struct kmem_cache_entry *next;
-};
+#define KMALLOC_MAX_SIZE    2048    // Larger requests get whole pages from the buddy allocator
+#define KMEM_CACHE_NUM      10
+#define SLAB_NONE           0xFFFF  // End of the free objects of a slab
+#define SLAB_EMPTY_MAX      1       // Empty slabs a cache keeps, the others go back to the buddy allocator
+
+/**
+ * Slab cache
+ *   One per size class. A slab is one page cut into objects of `size` bytes
+ *   with no header in front of them: a free object holds the index of the
+ *   next free one in its first two bytes, and the state of the slab is kept
+ *   in its `PageInfo` (`freelist`, `inuse`, `slab_cache` and the list links).
+ *   Each slab is on the partial, full or empty list of its cache.
+ */
 struct kmem_cache {
-    int cache_size;   // The size of each chunk in this cache
-    struct kmem_cache_entry *free_list;
+    unsigned int size;      // Object size in bytes
+    unsigned int objects;   // Objects per slab
+    unsigned int partial;   // Page numbers of the first slab of each list, `PAGE_NONE` when empty
+    unsigned int full;
+    unsigned int empty;
+    unsigned int nr_slabs;
+    unsigned int nr_empty;
+    unsigned long nr_inuse; // Objects allocated from the cache
+    spinlock_t lock;        // Per size, so different sizes never contend
 };
 
 void* simple_alloc(unsigned int size);
-void kmem_freelist_push(struct kmem_cache_entry *entry, struct kmem_cache *cache);
-void kmem_freelist_pop(struct kmem_cache *cache);
-void print_kmem_freelist();
+void print_slab_stats();
 void kmem_cache_init();
-void request_page(unsigned int order);
-unsigned int get_chunk_order(unsigned int size);
 void* kmalloc(unsigned int size);
 void kfree(void *ptr);
 void* alloc(unsigned int size);
@@ -28,4 +41,4 @@ void free(void *ptr);
 
 void test_alloc();
 
-#endif /* ALLOC_H */
\ No newline at end of file
+#endif /* ALLOC_H */
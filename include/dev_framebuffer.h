@@ -20,6 +20,7 @@ int dev_framebuffer_close(struct file* file);
 int dev_framebuffer_write(struct file* file, const void* buf, size_t len);
 int dev_framebuffer_read(struct file* file, void* buf, size_t len);
 long dev_framebuffer_lseek64(struct file* file, long offset, int whence);
+void* dev_framebuffer_mmap(struct vnode* file_node, size_t offset, int prot);
 int dev_framebuffer_ioctl(struct framebuffer_info* info);
 
 #endif // DEV_FRAMEBUFFER_H
\ No newline at end of file
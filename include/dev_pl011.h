@@ -0,0 +1,15 @@
+#ifndef DEV_PL011_H
+#define DEV_PL011_H
+
+#include "fs_vfs.h"
+#include <stddef.h>
+
+extern struct file_operations pl011_f_ops;
+
+int dev_pl011_open(struct vnode* file_node, struct file** target);
+int dev_pl011_close(struct file* file);
+int dev_pl011_write(struct file* file, const void* buf, size_t len);
+int dev_pl011_read(struct file* file, void* buf, size_t len);
+long dev_pl011_lseek64(struct file* file, long offset, int whence);
+
+#endif // DEV_PL011_H
\ No newline at end of file
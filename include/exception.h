@@ -19,8 +19,7 @@
 #define DISABLE_BASIC_IRQS  ((volatile unsigned int*)(IRQ_BASE + 0x224))
 
 #define CORE0_IRQ_SOURCE    ((volatile unsigned int *)0x40000060)
-#define TIMER_IRQ           (1 << 1)
-#define GPU_IRQ             (1 << 8)  // mini UART IRQ bit
+#define CORE_IRQ_SOURCE(cpu) ((volatile unsigned int *)(0x40000060UL + 4 * (cpu)))  // Decoded by `handle_irq`, see irq.h
 
 struct TrapFrame {
     unsigned long x[31];    // x0-x30
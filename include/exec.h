@@ -1,13 +1,14 @@
 #ifndef EXEC_H
 #define EXEC_H
 
-#define PROGRAM_STACK_SIZE 4096
-
 #include "uart.h"
 #include "cpio.h"
 #include "alloc.h"
 #include "sched.h"
+#include "mmu.h"
+
+struct TrapFrame;
 
-void _exec(char* filename);
+int _exec(char* filename, struct TrapFrame *trapframe);
 
 #endif /* EXEC_H */
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "fs_vfs.h"
 #include "cpio.h"
+#include "vm.h"
 
 #define MAX_FILE_NAME 64
 #define MAX_CHILDREN 16
@@ -46,6 +47,7 @@ int initramfs_close(struct file* file);
 int initramfs_write(struct file* file, const void* buf, size_t len);
 int initramfs_read(struct file* file, void* buf, size_t len);
 long initramfs_lseek64(struct file* file, long offset, int whence);
+void* initramfs_mmap(struct vnode* file_node, size_t offset, int prot);
 
 
 
@@ -5,11 +5,13 @@
 #include "alloc.h"
 #include "string.h"
 #include "uart.h"
+#include "spinlock.h"
 #include <stddef.h>
 
 #define MAX_FILE_NAME 64
 #define MAX_CHILDREN 16
 #define DEFAULT_FILE_SIZE 4096 
+#define TMPFS_BOUNCE_SIZE PAGE_SIZE  // Chunk copied to or from user memory per lock hold
 
 // Enum to distinguish between file and directory
 typedef enum {
@@ -21,6 +23,7 @@ struct tmpfs_node {
     char name[MAX_FILE_NAME];
     tmpfs_node_type_t type;
     struct tmpfs_node* parent; // Pointer to parent directory node
+    rwlock_t lock;             // Guards `children` of a directory, `data` and `size` of a file
 
     // For files
     char* data;      // File content
@@ -50,5 +53,6 @@ int tmpfs_close(struct file* file);
 int tmpfs_write(struct file* file, const void* buf, size_t len);
 int tmpfs_read(struct file* file, void* buf, size_t len);
 long tmpfs_lseek64(struct file* file, long offset, int whence);
+void* tmpfs_mmap(struct vnode* file_node, size_t offset, int prot);
 
 #endif // FS_TMPFS_H
\ No newline at end of file
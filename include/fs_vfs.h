@@ -3,9 +3,11 @@
 
 #include <stddef.h>
 #include "string.h"
+#include "spinlock.h"
 #include "fs_tmpfs.h"
 #include "fs_initramfs.h"
 #include "dev_uart.h"
+#include "dev_pl011.h"
 #include "dev_framebuffer.h"
 
 // Placeholder for O_CREAT flag, typically from <fcntl.h>
@@ -43,6 +45,7 @@ struct vnode {
     void* internal;
     struct vnode* parent;
     int parent_is_mount; // Indicates if the parent vnode is a mount point
+    atomic_t map_count;  // Number of memory areas mapping this file, its pages must not move while non-zero
 };
 
 // file handle
@@ -69,6 +72,7 @@ struct file_operations {
     int (*open)(struct vnode* file_node, struct file** target);
     int (*close)(struct file* file);
     long (*lseek64)(struct file* file, long offset, int whence); // Corrected syntax
+    void* (*mmap)(struct vnode* file_node, size_t offset, int prot); // Page backing `offset`, NULL if it cannot be mapped with `prot`
 };
 
 struct vnode_operations {
@@ -89,6 +93,7 @@ int vfs_close(struct file* file);
 int vfs_write(struct file* file, const void* buf, size_t len);
 int vfs_read(struct file* file, void* buf, size_t len);
 int vfs_lseek64(struct file* file, long offset, int whence);
+void* vfs_mmap(struct vnode* vnode, size_t offset, int prot);
 
 int vfs_mkdir(const char* pathname);
 int vfs_mknod(const char* pathname, struct file_operations* f_ops);
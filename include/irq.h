@@ -0,0 +1,49 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include "smp.h"
+#include "spinlock.h"
+
+/**
+ * IRQ numbers
+ *   0  - 63: GPU peripherals, bit n of IRQ pending 1 (n < 32) or 2 (n - 32)
+ *   64 - 71: ARM basic IRQs, bits 0 - 7 of the basic pending register
+ *   72 - 83: Per-core sources of the ARM local peripherals, bit n of
+ *            CORE_IRQ_SOURCE. Bit 8 is the GPU cascade and has no descriptor.
+ */
+#define NR_GPU_IRQS         64
+#define NR_BASIC_IRQS       8
+#define NR_LOCAL_IRQS       12
+#define IRQ_BASIC_BASE      NR_GPU_IRQS
+#define IRQ_LOCAL_BASE      (IRQ_BASIC_BASE + NR_BASIC_IRQS)
+#define NR_IRQS             (IRQ_LOCAL_BASE + NR_LOCAL_IRQS)
+
+#define IRQ_AUX             29                          // Mini UART (and the SPI1/2 of the AUX block)
+#define IRQ_UART0           57                          // PL011
+#define IRQ_LOCAL_CNTPNS    (IRQ_LOCAL_BASE + 1)        // Non-secure physical timer
+#define IRQ_LOCAL_MBOX0     (IRQ_LOCAL_BASE + 4)        // Mailbox 0, used for IPIs
+
+#define LOCAL_GPU_BIT       8                           // CORE_IRQ_SOURCE: a GPU/basic IRQ is pending
+#define BASIC_PENDING_GPU   (~0xffU)                    // Basic pending: bits that mean a GPU IRQ is pending
+
+typedef void (*irq_handler_t)(unsigned int irq, void *dev);
+
+/**
+ * Descriptor of an IRQ line
+ *   `count` is per core so that the hot path never writes a shared line.
+ */
+struct IrqDesc {
+    irq_handler_t handler;          // NULL while the line is free
+    void *dev;                      // Passed back to `handler`
+    const char *name;
+    unsigned long count[NR_CPUS];   // Times the IRQ was taken on each core
+};
+
+int request_irq(unsigned int irq, irq_handler_t handler, const char *name, void *dev);
+void free_irq(unsigned int irq, void *dev);
+void irq_enable(unsigned int irq);
+void irq_disable(unsigned int irq);
+void handle_irq();
+void print_irq_stats();
+
+#endif /* IRQ_H */
@@ -0,0 +1,62 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "smp.h"
+
+/**
+ * Kernel log
+ *   Messages go into a ring of the calling core instead of straight to the
+ *   UART, the `klogd` thread formats and prints them later at low priority.
+ *   A record keeps the format string and the raw arguments, `%s` arguments
+ *   are copied into the record as they may not live until it is printed.
+ *   Logging never waits: a record that finds the ring full is dropped and
+ *   counted.
+ *
+ *   The format is the one of `kprintf`, at most `KLOG_MAX_ARGS` arguments
+ *   are kept.
+ *
+ *   Levels above `KLOG_LEVEL` are compiled out, e.g. build with
+ *   `-DKLOG_LEVEL=KLOG_DEBUG` to get the debug messages.
+ *
+ *   Must not be called with a run queue lock held, the first record after
+ *   `klogd` went idle wakes it up.
+ */
+#define KLOG_ERR        0
+#define KLOG_WARN       1
+#define KLOG_INFO       2
+#define KLOG_DEBUG      3
+
+#ifndef KLOG_LEVEL
+#define KLOG_LEVEL      KLOG_INFO
+#endif
+
+#define KLOG_MAX_ARGS   6
+#define KLOG_TEXT_SIZE  56
+#define KLOG_RING_SIZE  128         // Records per core, a power of 2
+#define KLOG_FLUSH_SHIFT 6          // `klogd` batches for freq >> 6 ticks (about 16ms) while busy
+
+struct KlogRecord {
+    unsigned long long tick;
+    const char *fmt;
+    unsigned long args[KLOG_MAX_ARGS];  // `%s` arguments point into `text`
+    unsigned short cpu;
+    unsigned char level;
+    unsigned char nargs;
+    unsigned char text_len;
+    char text[KLOG_TEXT_SIZE];
+};
+
+#define klog(level, fmt, ...) do {                          \
+    if ((level) <= KLOG_LEVEL)                              \
+        klog_event((level), (fmt), ##__VA_ARGS__);          \
+} while (0)
+
+#define klog_err(fmt, ...)      klog(KLOG_ERR, fmt, ##__VA_ARGS__)
+#define klog_warn(fmt, ...)     klog(KLOG_WARN, fmt, ##__VA_ARGS__)
+#define klog_info(fmt, ...)     klog(KLOG_INFO, fmt, ##__VA_ARGS__)
+#define klog_debug(fmt, ...)    klog(KLOG_DEBUG, fmt, ##__VA_ARGS__)
+
+void klog_init();
+void klog_event(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* KLOG_H */
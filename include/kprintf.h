@@ -0,0 +1,29 @@
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/**
+ * Formatted output
+ *   Supports %d %i %u %x %X %p %s %c %%, the flags `-` and `0`, a field
+ *   width and the length modifiers `l`, `ll` and `z`. %p prints the full
+ *   64-bit address in hex.
+ *
+ *   The `ksnprintf` family works like snprintf: the output is always
+ *   terminated when `size` is not 0, and the return value is the length the
+ *   whole output would have had.
+ *
+ *   `kprintf` formats into a buffer on the stack, then writes it to the
+ *   console in one go under a lock, sending a bare `\n` as `\r\n`. Lines
+ *   from different cores or from interrupts do not interleave. Output past
+ *   `KPRINTF_BUF_SIZE` is cut.
+ */
+#define KPRINTF_BUF_SIZE    256
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+int kbsnprintf(char *buf, size_t size, const char *fmt, const unsigned long *args, int nargs);
+int kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif /* KPRINTF_H */
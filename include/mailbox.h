@@ -25,6 +25,7 @@
 #define TAG_REQUEST_CODE    0x00000000
 #define END_TAG             0x00000000
 #define MBOX_CH_PROP        8
+#define MBOX_BUF_WORDS      64  // Largest request `sys_mbox_call` copies in
 
 unsigned int mailbox_call(volatile unsigned int *mbox, unsigned char channel);
 
@@ -4,6 +4,7 @@
 #include "uart.h"
 #include "alloc.h"
 #include "utils.h"
+#include "spinlock.h"
 
 #define MAX_ORDER       14
 #define PAGE_SIZE       4096
@@ -19,15 +20,41 @@
 //     struct Block *next;
 // };
 
+#define PAGE_NONE       0xFFFFFFFFu  // End of a free list
+#define MAX_BLOCK_NUM   (PAGE_NUM / MAX_BLOCK_SIZE)  // Number of max-order blocks
+
+// Page flags
+#define PG_PCP          0x1  // Free, cached in the page list of a core (see `pcp_lists`)
+
+/**
+ * Page descriptor
+ *   One per page frame, the index of a descriptor in `page_list` is the page
+ *   number. Free list links are page numbers too, which keeps it at 16 bytes.
+ *   Whether a block is free is kept in the per-order bitmaps of `mm.c`, not
+ *   here, so checking a buddy does not touch its descriptor.
+ *
+ *   Only the descriptor at the head of each max-order block is set up by
+ *   `mm_init`, the rest of the block is initialised when it is first split
+ *   or handed out.
+ */
 struct PageInfo {
-    int idx;
-    int order;  // Use for `mm`, represent the order of the page
-    int cache_order;  // Use for `kmem`, represent the order of the cache. -1 if not in cache
-    struct PageInfo *entry_in_list; // Pointer to the entry in the free list
-    struct PageInfo *prev;  // Pointer to the previous page in the free list
-    struct PageInfo *next;  // Pointer to the next page in the free list
+    unsigned int prev;  // Previous block in the free list, `PAGE_NONE` at the front
+    unsigned int next;  // Next block in the free list, `PAGE_NONE` at the end
+    union {
+        atomic_t refcount;  // Number of users of an allocated page, shared copy-on-write pages have more than one
+        struct {            // Slab pages, which are never mapped to user space, see `alloc.c`
+            unsigned short freelist;  // Index of the first free object, `SLAB_NONE` when the slab is full
+            unsigned short inuse;     // Number of allocated objects
+        };
+    };
+    signed char order;  // Use for `mm`, the order of the block starting at this page, -1 inside a block
+    signed char slab_cache;  // Use for `kmem`, index of the cache the slab belongs to. -1 if not a slab
+    unsigned char flags;  // PG_*
+    unsigned char reserved;
 };
 
+_Static_assert(sizeof(struct PageInfo) <= 16, "struct PageInfo grew past 16 bytes");
+
 // Utility functions
 int round(int size);
 int get_order(int size);
@@ -39,6 +66,7 @@ void print_rm_msg(int idx, int order);
 void print_alloc_page_msg(void* addr, int idx, int order);
 void print_free_page_msg(void* addr, int idx, int curr_idx, int order);
 void print_free_list();
+void print_buddy_stats();
 
 // Memory management functions
 void add_to_free_list(struct PageInfo *entry, int order);
@@ -47,4 +75,9 @@ void* _alloc(unsigned int size);
 void _free(void *ptr);
 void reserve(void *start, void *end);
 
+// Page reference counting
+void get_page(void *ptr);
+void put_page(void *ptr);
+int page_ref_count(void *ptr);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,159 @@
+#ifndef MMU_H
+#define MMU_H
+
+#define PAGE_SHIFT          12
+#define TABLE_SHIFT         9
+#define SECTION_SHIFT       (PAGE_SHIFT + TABLE_SHIFT)  // 2MB block
+#define PTRS_PER_TABLE      (1 << TABLE_SHIFT)
+#define SECTION_SIZE        (1UL << SECTION_SHIFT)
+
+#define PGD_SHIFT           (PAGE_SHIFT + 3 * TABLE_SHIFT)
+#define PUD_SHIFT           (PAGE_SHIFT + 2 * TABLE_SHIFT)
+#define PMD_SHIFT           (PAGE_SHIFT + 1 * TABLE_SHIFT)
+
+/**
+ * Physical memory layout of the Raspberry Pi 3 (identity mapped)
+ *   0x00000000 - 0x3C000000: Normal RAM (write-back cacheable)
+ *   0x3C000000 - 0x3F000000: GPU memory, framebuffer lives here (normal non-cacheable)
+ *   0x3F000000 - 0x40000000: Peripherals (device-nGnRnE)
+ *   0x40000000 - 0x80000000: ARM local peripherals (device-nGnRnE)
+ */
+#define RAM_END             0x3C000000
+#define GPU_MEM_END         0x3F000000
+#define PERIPHERAL_END      0x40000000
+#define LOCAL_PERIPHERAL_END 0x80000000
+
+/* MAIR_EL1, Memory Attribute Indirection Register: D13.2.97 */
+#define MAIR_DEVICE_nGnRnE      0x00
+#define MAIR_NORMAL_NOCACHE     0x44
+#define MAIR_NORMAL_WB          0xff
+#define MAIR_IDX_DEVICE_nGnRnE  0
+#define MAIR_IDX_NORMAL_NOCACHE 1
+#define MAIR_IDX_NORMAL_WB      2
+#define MAIR_VALUE  ((MAIR_DEVICE_nGnRnE << (MAIR_IDX_DEVICE_nGnRnE * 8)) | \
+                     (MAIR_NORMAL_NOCACHE << (MAIR_IDX_NORMAL_NOCACHE * 8)) | \
+                     (MAIR_NORMAL_WB << (MAIR_IDX_NORMAL_WB * 8)))
+
+/**
+ * TCR_EL1, Translation Control Register: D13.2.120
+ *   [5:0]  : T0SZ. 48-bit VA for TTBR0
+ *   [9:8]  : IRGN0. Inner write-back write-allocate table walks
+ *   [11:10]: ORGN0. Outer write-back write-allocate table walks
+ *   [13:12]: SH0. Inner shareable table walks
+ *   [15:14]: TG0. 4KB granule
+ *   [23]   : EPD1. Disable TTBR1 walks, the kernel only lives in TTBR0
+ *   [36]   : AS. 16-bit ASID, set by `mmu_init` when the core supports it
+ */
+#define TCR_T0SZ            (64 - 48)
+#define TCR_IRGN0_WBWA      (1UL << 8)
+#define TCR_ORGN0_WBWA      (1UL << 10)
+#define TCR_SH0_INNER       (3UL << 12)
+#define TCR_TG0_4K          (0UL << 14)
+#define TCR_EPD1            (1UL << 23)
+#define TCR_AS              (1UL << 36)
+#define TCR_VALUE   (TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER | TCR_TG0_4K | TCR_EPD1)
+
+/**
+ * SCTLR_EL1, System Control Register: D13.2.113
+ *   [0] : M. MMU enable
+ *   [2] : C. Data cache enable
+ *   [12]: I. Instruction cache enable
+ *   [26]: UCI. Allow cache maintenance by VA at EL0 (the shell calls `mailbox_call`)
+ */
+#define SCTLR_RES1          ((1UL << 29) | (1UL << 28) | (1UL << 23) | (1UL << 22) | (1UL << 20) | (1UL << 11))
+#define SCTLR_MMU_EN        (1UL << 0)
+#define SCTLR_DCACHE_EN     (1UL << 2)
+#define SCTLR_ICACHE_EN     (1UL << 12)
+#define SCTLR_UCI           (1UL << 26)
+#define SCTLR_VALUE         (SCTLR_RES1 | SCTLR_MMU_EN | SCTLR_DCACHE_EN | SCTLR_ICACHE_EN | SCTLR_UCI)
+
+/* Translation table descriptors: D5.3 */
+#define PD_TABLE            0b11
+#define PD_BLOCK            0b01
+#define PD_PAGE             0b11
+#define PD_ATTR(idx)        ((unsigned long)(idx) << 2)
+#define PD_AP_RW_EL1        (0UL << 6)  // EL1 RW, EL0 none
+#define PD_AP_RW_EL0        (1UL << 6)  // EL1 RW, EL0 RW (implicitly PXN)
+#define PD_AP_RO_EL1        (2UL << 6)  // EL1 RO, EL0 none
+#define PD_AP_RO_EL0        (3UL << 6)  // EL1 RO, EL0 RO
+#define PD_AP_RO            (1UL << 7)  // AP[2], read-only at every level
+#define PD_SH_INNER         (3UL << 8)
+#define PD_ACCESS           (1UL << 10)
+#define PD_NG               (1UL << 11)
+#define PD_PXN              (1UL << 53)
+#define PD_UXN              (1UL << 54)
+#define PD_COW              (1UL << 55)  // Software bit: write-protected copy-on-write page
+#define PD_SHARED           (1UL << 56)  // Software bit: stays shared (not copy-on-write) across `fork`
+#define PD_NOREF            (1UL << 57)  // Software bit: page owned by someone else (a file), not refcounted
+#define PD_ADDR_MASK        0x0000fffffffff000UL
+#define PD_VALID            1UL
+
+/**
+ * The kernel identity map is shared into every user address space, so only
+ * text/rodata stay readable from EL0 (signal handlers return through
+ * `sighander_user_wrapper`). Everything else is EL1 only.
+ */
+#define PD_KERNEL_TEXT      (PD_ACCESS | PD_SH_INNER | PD_ATTR(MAIR_IDX_NORMAL_WB) | PD_AP_RO_EL0)
+#define PD_KERNEL_DATA      (PD_ACCESS | PD_SH_INNER | PD_ATTR(MAIR_IDX_NORMAL_WB) | PD_AP_RW_EL1 | PD_PXN | PD_UXN)
+#define PD_KERNEL_NOCACHE   (PD_ACCESS | PD_ATTR(MAIR_IDX_NORMAL_NOCACHE) | PD_AP_RW_EL1 | PD_PXN | PD_UXN)
+#define PD_KERNEL_DEVICE    (PD_ACCESS | PD_ATTR(MAIR_IDX_DEVICE_nGnRnE) | PD_AP_RW_EL1 | PD_PXN | PD_UXN)
+
+/* User mappings are non-global so that they are tagged with the ASID of the process */
+#define PD_USER_RWX         (PD_ACCESS | PD_SH_INNER | PD_ATTR(MAIR_IDX_NORMAL_WB) | PD_AP_RW_EL0 | PD_NG | PD_PXN)
+#define PD_USER_RW          (PD_USER_RWX | PD_UXN)
+
+/**
+ * Per-process address space
+ *   PGD[0] is shared by every process and points to the kernel identity map,
+ *   user mappings start from PGD[1].
+ */
+#define USER_SPACE_START    (1UL << PGD_SHIFT)
+#define USER_CODE_BASE      USER_SPACE_START
+#define USER_STACK_TOP      0x0000fffffffff000UL
+#define USER_STACK_MAX_SIZE (8UL << 20)   // Reserved for the stack, populated on demand
+#define USER_HEAP_MAX_SIZE  (1UL << 30)   // Upper bound of `brk` above the start of the heap
+
+/* ASID allocator, the generation lives above the largest ASID width */
+#define TTBR_ASID_SHIFT     48
+#define ASID_MAX_BITS       16
+#define ASID_MASK           ((1UL << ASID_MAX_BITS) - 1)
+
+#define CACHE_LINE_SIZE     64
+
+/* ESR_EL1 of an instruction/data abort: D13.2.37 */
+#define ESR_EC_SHIFT        26
+#define ESR_EC_DABT_LOW     0x24  // Data abort from EL0
+#define ESR_EC_DABT_CUR     0x25  // Data abort from EL1 (e.g. the kernel writing a user buffer)
+#define ESR_ISS_WNR         (1UL << 6)
+#define ESR_ISS_DFSC_MASK   0x3f
+#define ESR_EC_IABT_LOW     0x20  // Instruction abort from EL0
+#define DFSC_TRANS_FAULT    0x04  // Translation fault, the low 2 bits are the level
+#define DFSC_PERM_FAULT     0x0c  // Permission fault, the low 2 bits are the level
+
+#ifndef __ASSEMBLER__
+extern unsigned long kernel_pgd[PTRS_PER_TABLE];
+
+void mmu_init();
+void mmu_init_secondary();
+void dcache_clean_inval_range(void *start, unsigned long size);
+
+/* Page table management */
+unsigned long* pgd_alloc();
+void pgd_free(unsigned long *pgd);
+unsigned long* walk(unsigned long *pgd, unsigned long va, int create);
+int map_page(unsigned long *pgd, unsigned long va, unsigned long pa, unsigned long prot);
+int map_pages(unsigned long *pgd, unsigned long va, unsigned long pa, unsigned long size, unsigned long prot);
+void unmap_pages(unsigned long *pgd, unsigned long va, unsigned long size, unsigned long asid);
+int copy_user_space(unsigned long *dst, unsigned long *src);
+int cow_fault(unsigned long *pgd, unsigned long va, unsigned long asid);
+
+/* TLB maintenance */
+void tlb_flush_asid(unsigned long asid);
+void tlb_flush_page(unsigned long va, unsigned long asid);
+
+/* ASID management */
+unsigned long get_ttbr0(unsigned long *pgd, unsigned long *asid);
+void set_ttbr0(unsigned long ttbr0);
+#endif
+
+#endif /* MMU_H */
@@ -0,0 +1,68 @@
+#ifndef PL011_H
+#define PL011_H
+
+#include "gpio.h"
+
+/**
+ * PL011 UART (UART0)
+ *   A second serial port for bulk output such as logs and traces, so that the
+ *   mini UART console does not become the bottleneck. Unlike the mini UART it
+ *   has 16-deep FIFOs with programmable interrupt levels and an RX timeout
+ *   interrupt, and its baud rate divides a fixed UART clock instead of the
+ *   core clock.
+ *
+ *   GPIO14/15 stay with the mini UART console. The firmware wires UART0 to
+ *   GPIO32/33 (the Bluetooth module on the Pi 3), QEMU connects it to the
+ *   first `-serial` backend.
+ */
+#define PL011_BASE      (MMIO_BASE + 0x00201000)
+#define PL011_DR        ((volatile unsigned int*)(PL011_BASE + 0x00))
+#define PL011_FR        ((volatile unsigned int*)(PL011_BASE + 0x18))
+#define PL011_IBRD      ((volatile unsigned int*)(PL011_BASE + 0x24))
+#define PL011_FBRD      ((volatile unsigned int*)(PL011_BASE + 0x28))
+#define PL011_LCRH      ((volatile unsigned int*)(PL011_BASE + 0x2c))
+#define PL011_CR        ((volatile unsigned int*)(PL011_BASE + 0x30))
+#define PL011_IFLS      ((volatile unsigned int*)(PL011_BASE + 0x34))
+#define PL011_IMSC      ((volatile unsigned int*)(PL011_BASE + 0x38))
+#define PL011_MIS       ((volatile unsigned int*)(PL011_BASE + 0x40))
+#define PL011_ICR       ((volatile unsigned int*)(PL011_BASE + 0x44))
+
+/* FR */
+#define PL011_FR_BUSY   (1 << 3)
+#define PL011_FR_RXFE   (1 << 4)
+#define PL011_FR_TXFF   (1 << 5)
+
+/* LCRH */
+#define PL011_LCRH_FEN      (1 << 4)   // Enable the FIFOs
+#define PL011_LCRH_WLEN8    (3 << 5)   // 8 data bits
+
+/* CR */
+#define PL011_CR_UARTEN (1 << 0)
+#define PL011_CR_TXE    (1 << 8)
+#define PL011_CR_RXE    (1 << 9)
+
+/* IFLS, the FIFO level an interrupt fires at: 0 = 1/8, 1 = 1/4, 2 = 1/2, 3 = 3/4, 4 = 7/8 */
+#define PL011_IFLS_TX(level)    ((level) << 0)
+#define PL011_IFLS_RX(level)    ((level) << 3)
+
+/* IMSC, MIS and ICR */
+#define PL011_INT_RX    (1 << 4)   // RX FIFO reached its level
+#define PL011_INT_TX    (1 << 5)   // TX FIFO drained to its level
+#define PL011_INT_RT    (1 << 6)   // RX FIFO not empty and the line idle for 32 bit periods
+#define PL011_INT_ALL   0x7ff
+
+#define PL011_FIFO_SIZE     16
+#define PL011_CLOCK         48000000   // UARTCLK set by the firmware (`init_uart_clock`)
+#define PL011_DEFAULT_BAUD  115200
+#define PL011_BUFFER_SIZE   4096
+
+void pl011_init();
+int pl011_set_baud(unsigned int baud);
+unsigned int pl011_get_baud();
+void pl011_putc(char ch);
+void pl011_puts(const char *str);
+int pl011_recv(char *buf, unsigned int len);
+int pl011_send(const char *buf, unsigned int len);
+void pl011_irq_handler(unsigned int irq, void *dev);
+
+#endif /* PL011_H */
@@ -8,9 +8,16 @@
 #include "signal.h"
 #include "exception.h"
 #include "fs_vfs.h"
+#include "mmu.h"
+#include "vm.h"
+#include "smp.h"
+#include "spinlock.h"
 
 #define MAX_TASKS 64
+#define SCHED_NR_PRIO 32  // Priorities 0 - 31, higher runs first
 #define DEFAULT_PRIORITY 10
+#define IDLE_PRIORITY 0
+#define PID_HASH_SIZE 64
 #define THREAD_STACK_SIZE 0x1000  // 4KB stack size
 #define TASK_READY 0
 #define TASK_RUNNING 1
@@ -32,11 +39,37 @@ struct cpu_context {
     unsigned long fp;
     unsigned long lr;
     unsigned long sp;
+    unsigned long ttbr0;  // Loaded by `cpu_switch_to`, computed by `schedule`
 };
 
+struct TaskQueue {
+    struct ThreadTask *head;
+    struct ThreadTask *tail;
+};
+
+/**
+ * Tasks sleeping until an event
+ *   A sleeping task is parked on `wait_queue` by `schedule`, the head only
+ *   remembers who to wake. Usage, with `cond` re-checked after every wakeup:
+ *
+ *       while (1) {
+ *           prepare_to_wait(&wq);
+ *           if (cond) break;
+ *           schedule();
+ *       }
+ *       finish_wait(&wq);
+ */
+struct WaitQueueHead {
+    spinlock_t lock;
+    struct ThreadTask *head;  // Chained by `wait_next`
+};
+
+#define WAIT_QUEUE_HEAD_INIT    { SPINLOCK_INIT, NULL }
+
 struct ThreadTask {
     struct cpu_context cpu_context;
     unsigned int id; // Thread ID
+    unsigned int cpu;  // Core whose run queue holds this task, tasks do not migrate
     long state;
     long counter;
     long priority;
@@ -44,6 +77,13 @@ struct ThreadTask {
     void* kernel_stack;
     void* user_stack;
 
+    // Address space, NULL for kernel threads
+    unsigned long* pgd;
+    unsigned long asid;  // Generation | ASID, see `get_ttbr0`
+    struct VMArea* vma_list;  // Areas of the user address space, see `vm.h`
+    unsigned long brk;        // Current end of the heap
+    struct uring* uring;      // Syscall ring registered with `uring_setup`, a user address
+
     // Signal handling
     unsigned int pending_sig;           // A binary mask of pending signals
     sighandler_t sig_handlers[SIG_NUM]; // Signal handlers
@@ -55,6 +95,11 @@ struct ThreadTask {
     
     // Linked list pointers
     struct ThreadTask *next;
+    struct ThreadTask *prev;
+    struct TaskQueue *queue;       // Queue the task is on, NULL if none
+    struct ThreadTask *hash_next;  // Chain of `pid_hash`
+    struct ThreadTask *wait_next;  // Chain of the `WaitQueueHead` the task sleeps on
+    struct WaitQueueHead *wait_head;
 };
 
 #ifndef __ASSEMBLER__
@@ -64,14 +109,46 @@ extern void cpu_switch_to(struct ThreadTask *prev, struct ThreadTask *next);
 extern void ret_from_fork(void);
 #endif
 
-extern struct ThreadTask *ready_queue;
-extern struct ThreadTask *wait_queue;
-extern struct ThreadTask *zombie_queue;
-extern unsigned int thread_cnt;
+/**
+ * Per-core run queue
+ *   Each core only picks tasks from, and reaps zombies of, its own queue.
+ *   Ready tasks wait in one FIFO per priority, bit `p` of `bitmap` is set
+ *   while `queues[p]` is not empty. `curr` is the task running on the core,
+ *   it is in none of the queues.
+ */
+struct RunQueue {
+    spinlock_t lock;
+    unsigned int bitmap;
+    struct TaskQueue queues[SCHED_NR_PRIO];
+    struct TaskQueue zombie_queue;
+    struct ThreadTask *curr;
+};
+
+extern struct RunQueue run_queues[NR_CPUS];
+extern struct TaskQueue wait_queue;
 
 void sched_init();
+void sched_init_secondary(unsigned int cpu);
+unsigned int alloc_pid();
+unsigned int sched_pick_cpu();
+void add_thread_task(struct TaskQueue *queue, struct ThreadTask *task);
+struct ThreadTask* pop_thread_task(struct TaskQueue *queue);
+void rm_thread_task(struct ThreadTask *task);
+void add_ready_task(struct ThreadTask *task);
+void wake_up_task(struct ThreadTask *task);
+void prepare_to_wait(struct WaitQueueHead *wq);
+void finish_wait(struct WaitQueueHead *wq);
+void wake_up(struct WaitQueueHead *wq);
+void set_need_resched();
+void sched_irq_exit();
+void sched_set_priority(struct ThreadTask *task, long priority);
+void pid_hash_add(struct ThreadTask *task);
 struct ThreadTask* thread_create(void (*callback)(void));
-struct ThreadTask* get_thread_task_by_id(int pid);
+struct ThreadTask* thread_create_on(void (*callback)(void), unsigned int cpu);
+int thread_create_user_space(struct ThreadTask *task);
+void switch_mm(struct ThreadTask *task);
+struct ThreadTask* get_thread_task_by_id(int pid, unsigned long *flags);
+void put_thread_task(unsigned long flags);
 void _exit();
 int _kill(unsigned int pid);
 void schedule();
@@ -0,0 +1,38 @@
+#ifndef SMP_H
+#define SMP_H
+
+#define NR_CPUS             4
+#define CPU_STACK_SHIFT     14  // 16KB boot/exception stack per secondary core
+#define CPU_STACK_SIZE      (1 << CPU_STACK_SHIFT)
+
+/**
+ * Spin table of the Raspberry Pi 3 firmware (armstub8)
+ *   The secondary cores wait in `wfe` and jump to the address stored at
+ *   0xd8 + 8 * cpu once it becomes non-zero. 0xd8 belongs to core 0.
+ */
+#define SPIN_TABLE_BASE     0xd8
+
+/* Inter-processor interrupts, through mailbox 0 of the ARM local peripherals */
+#define CORE_MBOX_IRQ_CTRL(cpu) ((volatile unsigned int *)(0x40000050UL + 4 * (cpu)))
+#define CORE_MBOX0_SET(cpu)     ((volatile unsigned int *)(0x40000080UL + 16 * (cpu)))
+#define CORE_MBOX0_RDCLR(cpu)   ((volatile unsigned int *)(0x400000C0UL + 16 * (cpu)))
+#define IPI_RESCHEDULE      (1 << 0)  // A task was queued on the core
+
+#ifndef __ASSEMBLER__
+extern unsigned char cpu_stacks[NR_CPUS - 1][CPU_STACK_SIZE];  // Core 0 keeps using `__stack_top`
+extern volatile unsigned int nr_cpus_online;
+
+static inline unsigned int get_cpu_id() {
+    unsigned long mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xff;
+}
+
+void smp_init();
+void secondary_main(unsigned long cpu);
+void smp_ipi_init();
+void smp_send_ipi(unsigned int cpu, unsigned int ipi);
+void smp_ipi_handler(unsigned int irq, void *dev);
+#endif
+
+#endif /* SMP_H */
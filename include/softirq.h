@@ -0,0 +1,33 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "smp.h"
+
+/**
+ * Softirqs (bottom halves)
+ *   A hard IRQ handler only silences its device and raises a softirq. The
+ *   softirqs raised on a core run on its way out of the interrupt, with IRQs
+ *   enabled again, lowest number first. If they keep being raised past
+ *   `SOFTIRQ_MAX_RESTART` rounds or the time budget, the rest is handed to
+ *   the `ksoftirqd` thread of the core, which competes with the other tasks.
+ *
+ *   The vectors are fixed, raising one allocates nothing. A softirq runs on
+ *   the core that raised it, and never on two cores at once for the same
+ *   raise, but may run on several cores concurrently.
+ */
+#define SOFTIRQ_TIMER       0   // Expired timers, see `core_timer_handler`
+#define SOFTIRQ_UART        1   // Mini UART RX/TX buffers
+#define SOFTIRQ_PL011       2   // PL011 RX/TX FIFOs
+#define NR_SOFTIRQS         3
+
+#define SOFTIRQ_MAX_RESTART 10
+#define SOFTIRQ_BUDGET_SHIFT 9  // At most freq >> 9 ticks (about 2ms) per interrupt exit
+
+typedef void (*softirq_action_t)(void);
+
+void softirq_init();
+void open_softirq(unsigned int nr, softirq_action_t action);
+void raise_softirq(unsigned int nr);
+void irq_exit();
+
+#endif /* SOFTIRQ_H */
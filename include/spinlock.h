@@ -0,0 +1,291 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+/**
+ * Locking and atomic primitives for data shared between the cores
+ *
+ * All of them are built on exclusive load/store pairs (the Cortex-A53 has no
+ * LSE atomics). Waiters sleep in `wfe` and are woken up by the event that the
+ * releasing store sends when it clears their exclusive monitor. Only usable
+ * once the MMU is on, exclusives do not work on device memory.
+ *
+ * Locks are not recursive. Data that an interrupt handler also touches must
+ * be taken with the `_irqsave` variants, or the handler can spin forever on
+ * the lock its own core holds.
+ */
+
+static inline unsigned long local_irq_save() {
+    unsigned long flags;
+    asm volatile(
+        "mrs %0, daif\n"
+        "msr daifset, #2\n"
+        : "=r"(flags)
+        :
+        : "memory"
+    );
+    return flags;
+}
+
+// Whether IRQs are masked on this core, EL1 only like the rest of this file
+static inline int irqs_disabled() {
+    unsigned long flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    return (flags >> 7) & 1;
+}
+
+static inline void local_irq_restore(unsigned long flags) {
+    asm volatile("msr daif, %0" : : "r"(flags) : "memory");
+}
+
+/**
+ * Ticket spinlock
+ *   Taking the lock draws a ticket from `next`, the holder is the one whose
+ *   ticket equals `owner`. Cores get the lock in the order they asked for it,
+ *   so none of them can starve under contention.
+ */
+typedef struct {
+    unsigned short owner;
+    unsigned short next;
+} spinlock_t;
+
+#define SPINLOCK_INIT   { 0, 0 }
+
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->owner = 0;
+    lock->next = 0;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    unsigned int tmp, newval, lockval;
+    asm volatile(
+        // Draw a ticket: next++
+        "   prfm    pstl1strm, %3\n"
+        "1: ldaxr   %w0, %3\n"
+        "   add     %w1, %w0, %w5\n"
+        "   stxr    %w2, %w1, %3\n"
+        "   cbnz    %w2, 1b\n"
+        // Our ticket is already being served
+        "   eor     %w1, %w0, %w0, ror #16\n"
+        "   cbz     %w1, 3f\n"
+        // Wait until `owner` reaches our ticket
+        "   sevl\n"
+        "2: wfe\n"
+        "   ldaxrh  %w2, %4\n"
+        "   eor     %w1, %w2, %w0, lsr #16\n"
+        "   cbnz    %w1, 2b\n"
+        "3:\n"
+        : "=&r"(lockval), "=&r"(newval), "=&r"(tmp), "+Q"(*lock)
+        : "Q"(lock->owner), "r"(1 << 16)
+        : "memory"
+    );
+}
+
+// Take the lock only if it is free, returns 1 on success
+static inline int spin_trylock(spinlock_t *lock) {
+    unsigned int tmp, lockval;
+    asm volatile(
+        "1: ldaxr   %w0, %2\n"
+        "   eor     %w1, %w0, %w0, ror #16\n"
+        "   cbnz    %w1, 2f\n"
+        "   add     %w0, %w0, %w3\n"
+        "   stxr    %w1, %w0, %2\n"
+        "   cbnz    %w1, 1b\n"
+        "2:\n"
+        : "=&r"(lockval), "=&r"(tmp), "+Q"(*lock)
+        : "r"(1 << 16)
+        : "memory"
+    );
+    return !tmp;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    unsigned int tmp;
+    asm volatile(
+        "ldrh   %w1, %0\n"
+        "add    %w1, %w1, #1\n"
+        "stlrh  %w1, %0\n"
+        : "=Q"(lock->owner), "=&r"(tmp)
+        :
+        : "memory"
+    );
+}
+
+static inline int spin_is_locked(spinlock_t *lock) {
+    spinlock_t val = *(volatile spinlock_t *)lock;
+    return val.owner != val.next;
+}
+
+/* Also mask IRQs on this core, for data that interrupt handlers touch as well */
+static inline unsigned long spin_lock_irqsave(spinlock_t *lock) {
+    unsigned long flags = local_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags) {
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Reader-writer lock
+ *   Bit 31 is set while a writer holds the lock, the lower bits count the
+ *   readers. For data that is looked up far more often than it is changed.
+ *   Readers are not fair to writers, keep the read sections short.
+ */
+typedef struct {
+    volatile unsigned int lock;
+} rwlock_t;
+
+#define RWLOCK_INIT     { 0 }
+
+static inline void rwlock_init(rwlock_t *rw) {
+    rw->lock = 0;
+}
+
+static inline void write_lock(rwlock_t *rw) {
+    unsigned int tmp;
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr   %w0, %1\n"
+        "   cbnz    %w0, 1b\n"
+        "   stxr    %w0, %w2, %1\n"
+        "   cbnz    %w0, 2b\n"
+        : "=&r"(tmp), "+Q"(rw->lock)
+        : "r"(0x80000000)
+        : "memory"
+    );
+}
+
+static inline void write_unlock(rwlock_t *rw) {
+    asm volatile("stlr wzr, %0" : "=Q"(rw->lock) : : "memory");
+}
+
+static inline void read_lock(rwlock_t *rw) {
+    unsigned int tmp, tmp2;
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr   %w0, %2\n"
+        "   add     %w0, %w0, #1\n"
+        "   tbnz    %w0, #31, 1b\n"
+        "   stxr    %w1, %w0, %2\n"
+        "   cbnz    %w1, 2b\n"
+        : "=&r"(tmp), "=&r"(tmp2), "+Q"(rw->lock)
+        :
+        : "memory"
+    );
+}
+
+static inline void read_unlock(rwlock_t *rw) {
+    unsigned int tmp, tmp2;
+    asm volatile(
+        "1: ldxr    %w0, %2\n"
+        "   sub     %w0, %w0, #1\n"
+        "   stlxr   %w1, %w0, %2\n"
+        "   cbnz    %w1, 1b\n"
+        : "=&r"(tmp), "=&r"(tmp2), "+Q"(rw->lock)
+        :
+        : "memory"
+    );
+}
+
+static inline unsigned long read_lock_irqsave(rwlock_t *rw) {
+    unsigned long flags = local_irq_save();
+    read_lock(rw);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *rw, unsigned long flags) {
+    read_unlock(rw);
+    local_irq_restore(flags);
+}
+
+static inline unsigned long write_lock_irqsave(rwlock_t *rw) {
+    unsigned long flags = local_irq_save();
+    write_lock(rw);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *rw, unsigned long flags) {
+    write_unlock(rw);
+    local_irq_restore(flags);
+}
+
+/**
+ * Atomic counter
+ *   The operations returning a value are full barriers, the others are not
+ *   ordered against the surrounding accesses.
+ */
+typedef struct {
+    volatile int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i)  { (i) }
+
+static inline int atomic_read(atomic_t *v) {
+    return v->counter;
+}
+
+static inline void atomic_set(atomic_t *v, int i) {
+    v->counter = i;
+}
+
+static inline void atomic_add(int i, atomic_t *v) {
+    int result;
+    unsigned int tmp;
+    asm volatile(
+        "1: ldxr    %w0, %2\n"
+        "   add     %w0, %w0, %w3\n"
+        "   stxr    %w1, %w0, %2\n"
+        "   cbnz    %w1, 1b\n"
+        : "=&r"(result), "=&r"(tmp), "+Q"(v->counter)
+        : "r"(i)
+    );
+}
+
+static inline int atomic_add_return(int i, atomic_t *v) {
+    int result;
+    unsigned int tmp;
+    asm volatile(
+        "1: ldxr    %w0, %2\n"
+        "   add     %w0, %w0, %w3\n"
+        "   stlxr   %w1, %w0, %2\n"
+        "   cbnz    %w1, 1b\n"
+        "   dmb     ish\n"
+        : "=&r"(result), "=&r"(tmp), "+Q"(v->counter)
+        : "r"(i)
+        : "memory"
+    );
+    return result;
+}
+
+// Set `v` to `new` if it is `old`, returns the value seen before
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new) {
+    int oldval;
+    unsigned int tmp;
+    asm volatile(
+        "1: ldxr    %w0, %2\n"
+        "   cmp     %w0, %w3\n"
+        "   b.ne    2f\n"
+        "   stlxr   %w1, %w4, %2\n"
+        "   cbnz    %w1, 1b\n"
+        "   dmb     ish\n"
+        "2:\n"
+        : "=&r"(oldval), "=&r"(tmp), "+Q"(v->counter)
+        : "r"(old), "r"(new)
+        : "cc", "memory"
+    );
+    return oldval;
+}
+
+#define atomic_sub(i, v)            atomic_add(-(i), (v))
+#define atomic_sub_return(i, v)     atomic_add_return(-(i), (v))
+#define atomic_inc(v)               atomic_add(1, (v))
+#define atomic_dec(v)               atomic_add(-1, (v))
+#define atomic_inc_return(v)        atomic_add_return(1, (v))
+#define atomic_dec_return(v)        atomic_add_return(-1, (v))
+#define atomic_dec_and_test(v)      (atomic_add_return(-1, (v)) == 0)
+
+#endif /* SPINLOCK_H */
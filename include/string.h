@@ -4,11 +4,20 @@
 #include "alloc.h"
 #include <stddef.h>
 
+#define NEON_COPY_MIN   1024    // Below this `memcpy_neon` just calls `memcpy`
+#define NEON_COPY_CHUNK 4096    // Bytes copied per SIMD section, with IRQs masked
+
+/* string_asm.S */
 int strcmp(const char *s1, const char *s2);
+size_t strlen(const char *s);
+void *memset(void *s, int c, size_t n);
+void *memcpy(void *dest, const void *src, size_t n);
+
 char *strtok(char *str, char delim);
-unsigned int strlen(const char *s);
 char *strdup(const char *s);
-void *memset(void *s, int c, unsigned int n);
-void memcpy(void *dest, void *src, unsigned int n);
+void *memcpy_neon(void *dest, const void *src, size_t n);
+
+/* string_neon.c, only between `kernel_neon_begin` and `kernel_neon_end` */
+void __memcpy_neon(void *dest, const void *src, size_t n);
 
-#endif /* STRING_H */
\ No newline at end of file
+#endif /* STRING_H */
@@ -8,6 +8,7 @@
 #include "exec.h"
 #include "signal.h"
 #include "dev_framebuffer.h"
+#include "uring.h"
 
 #define SYS_GETPID_NUM      0
 #define SYS_UART_READ_NUM   1
@@ -29,6 +30,27 @@
 #define SYS_CHDIR_NUM       17
 #define SYS_LSEEK64_NUM     18
 #define SYS_IOCTL_NUM       19
+#define SYS_BRK_NUM         20
+#define SYS_SBRK_NUM        21
+#define SYS_MMAP_NUM        22
+#define SYS_MUNMAP_NUM      23
+#define SYS_URING_SETUP_NUM 24
+#define SYS_URING_ENTER_NUM 25
+#define NR_SYSCALLS         26
+
+#define SYSCALL_HIST_BUCKETS 16  // Bucket `b` counts calls of [2^(b-1), 2^b) counter ticks, the last one is open-ended
+
+typedef void (*syscall_fn_t)(struct TrapFrame *trapframe);
+
+/* Statistics of a syscall on one core */
+struct SyscallStat {
+    unsigned long count;
+    unsigned long long ticks;                   // Total time spent in the handler
+    unsigned long hist[SYSCALL_HIST_BUCKETS];   // Latency histogram, log2 of the ticks
+};
+
+void syscall_entry(struct TrapFrame *trapframe);
+void print_syscall_stats();
 
 void sys_getpid(struct TrapFrame *trapframe);
 void sys_uart_read(struct TrapFrame *trapframe);
@@ -50,6 +72,12 @@ void sys_mount(struct TrapFrame *trapframe);
 void sys_chdir(struct TrapFrame *trapframe);
 void sys_lseek64(struct TrapFrame *trapframe);
 void sys_ioctl(struct TrapFrame *trapframe);
+void sys_brk(struct TrapFrame *trapframe);
+void sys_sbrk(struct TrapFrame *trapframe);
+void sys_mmap(struct TrapFrame *trapframe);
+void sys_munmap(struct TrapFrame *trapframe);
+void sys_uring_setup(struct TrapFrame *trapframe);
+void sys_uring_enter(struct TrapFrame *trapframe);
 
 /* Wrapper function for syscall */
 int get_pid();
@@ -72,5 +100,11 @@ int mount(const char *src, const char *target, const char *filesystem, unsigned
 int chdir(const char *path);
 long lseek64(int fd, long offset, int whence);
 int ioctl(int fd, unsigned long request, void *argp);
+int brk(void *addr);
+void* sbrk(long increment);
+void* mmap(void *addr, unsigned long len, int prot, int flags, int fd, long offset);
+int munmap(void *addr, unsigned long len);
+int uring_setup(struct uring *ring);
+int uring_enter(unsigned int to_submit);
 
 #endif /* SYSCALL_H */
\ No newline at end of file
@@ -9,14 +9,40 @@
 #include <stddef.h>
 
 #define CORE0_TIMER_IRQ_CTRL ((volatile unsigned int *)0x40000040)
+#define CORE_TIMER_IRQ_CTRL(cpu) ((volatile unsigned int *)(0x40000040UL + 4 * (cpu)))
+
+#define SCHED_TICK_SHIFT 8  // Scheduler tick every freq >> 8 ticks (about 4ms)
 
 typedef void (*timer_callback)(char*);
 
+/**
+ * Kernel timer, embedded in the structure of its owner
+ *   Armed with `mod_timer` on the wheel of the calling core, whose callback it
+ *   then runs on. Use `container_of` in the callback to get the owner back.
+ */
+struct TimerBase;
+struct Timer {
+    struct Timer* prev;
+    struct Timer* next;
+    void (*callback)(struct Timer* timer);
+    unsigned long long expiration;  // Unit: tick
+    int slot;                       // Wheel slot, -1 while not pending
+    struct TimerBase* base;         // Wheel the timer is pending on, NULL if none
+};
+
 void timer_enable_irq();
 void timer_disable_irq();
 void set_timer_irq(unsigned long long tick);
 void timer_init();
+void timer_init_secondary();
+void timer_program_next();
+void timer_set_tick(int on);
+void timer_setup(struct Timer* timer, void (*callback)(struct Timer* timer));
+void mod_timer(struct Timer* timer, unsigned long long expiration);
+int del_timer(struct Timer* timer);
+int timer_pending(struct Timer* timer);
 void core_timer_handler();
+void print_timer_list();
 void print_msg(char* msg);
 void print_uptime(char* _);
 unsigned long long get_tick();
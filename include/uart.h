@@ -3,7 +3,6 @@
 
 #include "gpio.h"
 #include "exception.h"
-#include "tasks.h"
 
 // Define the address of the registers
 #define AUXENB          ((volatile unsigned int*)(MMIO_BASE + 0x00215004))
@@ -37,7 +36,10 @@ void uart_enable_tx_irq();
 void uart_disable_irq();
 void uart_disable_rx_irq();
 void uart_disable_tx_irq();
-void uart_irq_handler();
+void uart_irq_init();
+int uart_recv(char *buf, unsigned int len);
+int uart_send(const char *buf, unsigned int len);
+void uart_irq_handler(unsigned int irq, void *dev);
 void uart_irq_rx_handler();
 void uart_irq_tx_handler();
 
@@ -0,0 +1,52 @@
+#ifndef URING_H
+#define URING_H
+
+/**
+ * Asynchronous syscall ring (in the spirit of io_uring)
+ *   A process queues syscalls in the submission queue (SQ) of a ring in its
+ *   own memory, and has the kernel run a whole batch with one `uring_enter`.
+ *   Each consumed entry produces one completion (CQE) with the return
+ *   value, in submission order.
+ *
+ *   The process owns `sq_tail` and `cq_head`, the kernel `sq_head` and
+ *   `cq_tail`. The indices run freely and wrap at 2^32, an entry lives at
+ *   `index % entries`. The producer of a queue writes the entry before it
+ *   publishes the new tail (store-release), and the consumer reads the tail
+ *   with a load-acquire.
+ *
+ * Also included by the user library (user/), keep it free of kernel headers.
+ */
+#define URING_SQ_ENTRIES    64
+#define URING_CQ_ENTRIES    128  // Twice the SQ, so a full SQ always fits
+
+/* Submission: syscall `opcode` (a SYS_*_NUM) with `args` in x0 - x3 */
+struct uring_sqe {
+    unsigned long opcode;
+    unsigned long args[4];
+    unsigned long user_data;    // Copied to the completion
+};
+
+struct uring_cqe {
+    unsigned long user_data;
+    long res;                   // x0 after the syscall, -1 if the opcode is not allowed in a ring
+};
+
+struct uring {
+    volatile unsigned int sq_head;
+    volatile unsigned int sq_tail;
+    volatile unsigned int cq_head;
+    volatile unsigned int cq_tail;
+    struct uring_sqe sqes[URING_SQ_ENTRIES];
+    struct uring_cqe cqes[URING_CQ_ENTRIES];
+};
+
+#ifdef USER_LIB
+int uring_setup(struct uring *ring);
+int uring_enter(unsigned int to_submit);
+struct uring_sqe* uring_get_sqe(struct uring *ring);
+void uring_submit(struct uring *ring);
+struct uring_cqe* uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+#endif
+
+#endif /* URING_H */
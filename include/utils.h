@@ -2,6 +2,10 @@
 #define UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+// Structure embedding `ptr` as its `member`
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
 unsigned int hex_to_uint(char *hex_str, unsigned int len);
 int atoi(char *str);
@@ -0,0 +1,36 @@
+#ifndef VDSO_H
+#define VDSO_H
+
+/**
+ * Clock data page shared with user space
+ *   The kernel maps this page read-only into every address space, so that
+ *   user programs can read the time without a syscall: they read
+ *   `cntpct_el0` themselves (EL0 access is enabled by `timer_init`) and
+ *   convert it with the fields below.
+ *
+ *   `seq` is odd while the kernel updates the page. A reader retries until
+ *   it sees the same even value before and after reading the other fields.
+ *
+ * Also included by the user library (user/), keep it free of kernel headers.
+ */
+#define VDSO_DATA_ADDR      0x0000fffffffff000UL  // Last user page, right above `USER_STACK_TOP`
+
+#define CLOCK_REALTIME      0
+#define CLOCK_MONOTONIC     1
+
+struct VdsoData {
+    volatile unsigned int seq;
+    unsigned int reserved;
+    unsigned long long freq;            // Counter frequency (cntfrq_el0), in Hz
+    unsigned long long boot_tick;       // Counter at boot, CLOCK_MONOTONIC is 0 there
+    unsigned long long realtime_sec;    // CLOCK_REALTIME at `boot_tick`
+    unsigned long long realtime_nsec;
+};
+
+#ifndef USER_LIB
+void vdso_init();
+void vdso_set_realtime(unsigned long long sec, unsigned long long nsec);
+unsigned long vdso_data_page();
+#endif
+
+#endif /* VDSO_H */
@@ -0,0 +1,57 @@
+#ifndef VM_H
+#define VM_H
+
+#include "mmu.h"
+#include "mm.h"
+
+struct ThreadTask;
+struct vnode;
+
+/* Kind of a virtual memory area */
+#define VMA_CODE            (1 << 0)
+#define VMA_HEAP            (1 << 1)  // Grows upwards with `brk`
+#define VMA_STACK           (1 << 2)  // Reserved below `USER_STACK_TOP`, populated on demand
+#define VMA_MMAP            (1 << 3)  // Created by `mmap`, the only kind `munmap` removes
+#define VMA_SHARED          (1 << 4)  // MAP_SHARED: writes are seen by the file and kept across `fork`
+#define VMA_NOACCESS        (1 << 5)  // PROT_NONE
+#define VMA_VDSO            (1 << 6)  // The clock data page of the kernel, see vdso.h
+
+/* mmap */
+#define PROT_NONE           0
+#define PROT_READ           (1 << 0)
+#define PROT_WRITE          (1 << 1)
+#define PROT_EXEC           (1 << 2)
+#define MAP_SHARED          0x01
+#define MAP_PRIVATE         0x02
+#define MAP_FIXED           0x10
+#define MAP_ANONYMOUS       0x20
+#define MAP_FAILED          ((void*)-1)
+
+/**
+ * A range of the user address space that may be backed by memory. Pages of an
+ * area are only allocated when they are first touched, see `do_page_fault`.
+ */
+struct VMArea {
+    unsigned long start;
+    unsigned long end;      // Exclusive, page aligned
+    unsigned long prot;     // Descriptor attributes of the pages, e.g. `PD_USER_RW`
+    int flags;
+    struct vnode *vnode;    // Backing file, NULL for anonymous memory
+    unsigned long offset;   // Offset in `vnode` of `start`
+    struct VMArea *next;
+};
+
+struct VMArea* vma_add(struct VMArea **list, unsigned long start, unsigned long end, unsigned long prot, int flags);
+struct VMArea* vma_find(struct VMArea *list, unsigned long va);
+struct VMArea* vma_find_flags(struct VMArea *list, int flags);
+void vma_set_file(struct VMArea *vma, struct vnode *vnode, unsigned long offset);
+int vma_copy_list(struct VMArea **dst, struct VMArea *src);
+void vma_free_list(struct VMArea **list);
+
+int vm_init_user_space(struct ThreadTask *task, unsigned long heap_start);
+int do_page_fault(unsigned long esr);
+unsigned long vm_brk(struct ThreadTask *task, unsigned long addr);
+unsigned long vm_mmap(struct ThreadTask *task, unsigned long addr, unsigned long len, int prot, int flags, struct vnode *vnode, unsigned long offset);
+int vm_munmap(struct ThreadTask *task, unsigned long addr, unsigned long len);
+
+#endif /* VM_H */
@@ -1,10 +1,5 @@
 #include "alloc.h"
-
-#define MAX_CHUNK_SIZE  128
-#define MIN_CHUNK_SIZE  16
-#define MIN_CACHE_ORDER 4
-#define MAX_CACHE_ORDER 7
-#define CACHE_NUM       4
+#include "kprintf.h"
 
 extern char *__bss_begin;
 extern char *__bss_end;
@@ -28,145 +23,133 @@ void* simple_alloc(unsigned int size) {
 }
 
 /*** Dynamic Memory Allocator (kmalloc) ***/
-struct kmem_cache kmem_caches[CACHE_NUM];
-
-void kmem_freelist_push(struct kmem_cache_entry *entry, struct kmem_cache *cache) {
-    entry->next = cache->free_list;
-    if (cache->free_list != NULL) {
-        cache->free_list->prev = entry;
+static const unsigned short kmem_sizes[KMEM_CACHE_NUM] = { 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048 };
+struct kmem_cache kmem_caches[KMEM_CACHE_NUM];
+
+// Index of the smallest size class that fits `size`, which is at most `KMALLOC_MAX_SIZE`
+static int kmem_size_class(unsigned int size) {
+    if (size <= 192) {
+        // 16, 32, 64, 96, 128, 192 by multiples of 16
+        static const unsigned char small_class[13] = { 0, 0, 1, 2, 2, 3, 3, 4, 4, 5, 5, 5, 5 };
+        return small_class[(size + 15) / 16];
     }
-    cache->free_list = entry;
-    entry->prev = NULL;
+    return (32 - __builtin_clz(size - 1)) - 2;  // 256 and up are powers of 2
 }
 
-void kmem_freelist_pop(struct kmem_cache *cache) {
-    struct kmem_cache_entry *tmp = cache->free_list;
-    cache->free_list = cache->free_list->next;
-    if (cache->free_list != NULL) {
-        cache->free_list->prev = NULL;
-    }
-    tmp->next = NULL;
-    tmp->prev = NULL;
+static void slab_list_add(unsigned int *list, unsigned int idx) {
+    struct PageInfo *page = page_list + idx;
+    page->prev = PAGE_NONE;
+    page->next = *list;
+    if (*list != PAGE_NONE) page_list[*list].prev = idx;
+    *list = idx;
 }
 
-void print_kmem_freelist() {
-    uart_puts("========== kmem Free List ==========\r\n");
-    for (int i=0; i<CACHE_NUM; i++) {
-        struct kmem_cache_entry *entry = kmem_caches[i].free_list;
-        uart_puts("Cache size: ");
-        uart_puts(itoa(kmem_caches[i].cache_size));
-        uart_puts("\r\n");
-        while (entry != NULL) {
-            uart_hex((unsigned long)entry);
-            uart_puts(" -> ");
-            entry = entry->next;
-        }
-        uart_puts("NULL\r\n");
-    }
-    uart_puts("====================================\r\n");
+static void slab_list_del(unsigned int *list, unsigned int idx) {
+    struct PageInfo *page = page_list + idx;
+    if (page->prev != PAGE_NONE) page_list[page->prev].next = page->next;
+    else *list = page->next;
+    if (page->next != PAGE_NONE) page_list[page->next].prev = page->prev;
+    page->prev = PAGE_NONE;
+    page->next = PAGE_NONE;
 }
 
-void kmem_cache_init() {
-    for (int i=0; i<CACHE_NUM; i++) {
-        kmem_caches[i].cache_size = (1 << (i + 4)); // 16, 32, 64, 128
-        kmem_caches[i].free_list = NULL;
+void print_slab_stats() {
+    kprintf("%6s %8s %6s %6s %8s\r\n", "Size", "Objects", "Slabs", "Empty", "In use");
+    for (int i = 0; i < KMEM_CACHE_NUM; i++) {
+        struct kmem_cache *cache = &kmem_caches[i];
+        unsigned long flags = spin_lock_irqsave(&cache->lock);
+        unsigned int slabs = cache->nr_slabs, empty = cache->nr_empty;
+        unsigned long inuse = cache->nr_inuse;
+        spin_unlock_irqrestore(&cache->lock, flags);
+        kprintf("%6u %8u %6u %6u %8lu\r\n", cache->size, cache->objects, slabs, empty, inuse);
     }
+}
 
-    for (int i=0; i<CACHE_NUM; i++) {
-        void *page = _alloc(PAGE_SIZE);
-        if (page == NULL) {
-            uart_puts("Failed to allocate memory for cache!\n");
-            return;
-        }
-
-        int page_idx = (page - memory_start) / PAGE_SIZE;
-        page_list[page_idx].cache_order = i + MIN_CACHE_ORDER;
-
-        int chunk_size = kmem_caches[i].cache_size;
-        int chunk_num = PAGE_SIZE / (chunk_size + sizeof(struct kmem_cache_entry));
-        kmem_caches[i].free_list = NULL;
-
-        // Split chunks and add to the free list
-        for (int j = 0; j < chunk_num; j++) {
-            struct kmem_cache_entry *new_entry = (struct kmem_cache_entry*)page;
-            kmem_freelist_push(new_entry, &kmem_caches[i]);
-            page += chunk_size + sizeof(struct kmem_cache_entry);
-        }
+void kmem_cache_init() {
+    for (int i=0; i<KMEM_CACHE_NUM; i++) {
+        kmem_caches[i].size = kmem_sizes[i];
+        kmem_caches[i].objects = PAGE_SIZE / kmem_sizes[i];
+        kmem_caches[i].partial = PAGE_NONE;
+        kmem_caches[i].full = PAGE_NONE;
+        kmem_caches[i].empty = PAGE_NONE;
+        kmem_caches[i].nr_slabs = 0;
+        kmem_caches[i].nr_empty = 0;
+        kmem_caches[i].nr_inuse = 0;
+        spin_lock_init(&kmem_caches[i].lock);
     }
-
-    // print_free_list();
 }
 
-void request_page(unsigned int order) {
+// Add an empty slab to the cache `class`, called with its lock held
+static int cache_grow(int class) {
+    struct kmem_cache *cache = &kmem_caches[class];
     void *page = _alloc(PAGE_SIZE);
     if (page == NULL) {
         uart_puts("Failed to allocate memory for cache!\n");
-        return;
+        return -1;
     }
 
-    int page_idx = (page - memory_start) / PAGE_SIZE;
-    page_list[page_idx].cache_order = order + MIN_CACHE_ORDER;
+    unsigned int page_idx = (page - memory_start) / PAGE_SIZE;
+    struct PageInfo *slab = page_list + page_idx;
+    slab->slab_cache = class;
+    slab->freelist = 0;
+    slab->inuse = 0;
 
-    int chunk_size = kmem_caches[order].cache_size;
-    int chunk_num = PAGE_SIZE / (chunk_size + sizeof(struct kmem_cache_entry));
-
-    // Split chunks and add to the free list
-    for (int j = 1; j < chunk_num; j++) {
-        struct kmem_cache_entry *new_entry = (struct kmem_cache_entry*)page;
-        kmem_freelist_push(new_entry, &kmem_caches[order]);
-        page += chunk_size + sizeof(struct kmem_cache_entry);
+    // Chain the free objects
+    for (unsigned int i = 0; i < cache->objects; i++) {
+        *(unsigned short*)(page + i * cache->size) = i + 1 < cache->objects ? i + 1 : SLAB_NONE;
     }
-}
 
-// Start from 4 (2^4 = 16) and go up to 7 (2^7 = 128)
-unsigned int get_chunk_order(unsigned int size) {
-    unsigned int order = 4;
-    while ((1 << order) < size) {
-        order++;
-    }
-    return order;
+    slab_list_add(&cache->empty, page_idx);
+    cache->nr_slabs++;
+    cache->nr_empty++;
+    return 0;
 }
 
 /**
  * kmalloc - Allocates memory dynamically
  * 
- * This function handle the small size request for memory. It will request
- * a page using `_alloc` and split it into some common size chunks. If there
- * is no free chunk, request a new page.
+ * This function handle the small size request for memory, up to
+ * `KMALLOC_MAX_SIZE` bytes. The size is rounded up to a size class and the
+ * object is taken from a partial slab of that class, or from an empty one
+ * if there is none. A new slab is requested from `_alloc` when the cache
+ * has no free object left.
  * 
  * @param size: The size of memory to allocate
  * @return Pointer to the allocated memory
  */
 void* kmalloc(unsigned int size) {
-    unsigned int order = get_chunk_order(size);
-    size = (1 << order);  // Round up to the nearest power of 2
-    order -= MIN_CACHE_ORDER;  // Adjust order to match cache level
-
     if (size == 0) return NULL;
-    if (size > MAX_CHUNK_SIZE) {
+    if (size > KMALLOC_MAX_SIZE) {
         uart_puts("The requested size is too large for kmalloc!\n");
         return NULL;
     }
-    if (kmem_caches[order].free_list == NULL) {
-        request_page(order);
-    }
-    struct kmem_cache_entry *entry = kmem_caches[order].free_list;
-    if (entry == NULL) {
-        uart_puts("No free chunk available!\n");
-        return NULL;
+    int class = kmem_size_class(size);
+    struct kmem_cache *cache = &kmem_caches[class];
+
+    unsigned long flags = spin_lock_irqsave(&cache->lock);
+    unsigned int page_idx = cache->partial;
+    if (page_idx == PAGE_NONE) {
+        if (cache->empty == PAGE_NONE && cache_grow(class) != 0) {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            uart_puts("No free chunk available!\n");
+            return NULL;
+        }
+        page_idx = cache->empty;
+        slab_list_del(&cache->empty, page_idx);
+        cache->nr_empty--;
+        slab_list_add(&cache->partial, page_idx);
     }
 
-    // Remove from free list
-    kmem_freelist_pop(&kmem_caches[order]);
-
-    void *ptr = (void*)entry + sizeof(struct kmem_cache_entry);  // Return the memory after the entry
-    // uart_puts("[Chunk] Allocated chunk size ");
-    // uart_puts(itoa(1 << (order + MIN_CACHE_ORDER)));
-    // uart_puts(" at address ");
-    // uart_hex((unsigned long)ptr);
-    // uart_puts(" (header starts at ");
-    // uart_hex((unsigned long)entry);
-    // uart_puts(")\r\n");
+    struct PageInfo *slab = page_list + page_idx;
+    void *ptr = memory_start + (unsigned long)page_idx * PAGE_SIZE + slab->freelist * cache->size;
+    slab->freelist = *(unsigned short*)ptr;
+    slab->inuse++;
+    cache->nr_inuse++;
+    if (slab->freelist == SLAB_NONE) {  // The last free object
+        slab_list_del(&cache->partial, page_idx);
+        slab_list_add(&cache->full, page_idx);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
 
     return ptr;
 }
@@ -175,36 +158,59 @@ void kfree(void *ptr) {
     if (ptr == NULL) return;
     if (ptr >= (void*)&__bss_end && ptr < (void*)&__stack_top) return;  // Out of bounds
 
-    int page_idx = (ptr - memory_start) / PAGE_SIZE;
-    int order = page_list[page_idx].cache_order;
-    if (order < MIN_CACHE_ORDER || order > MAX_CACHE_ORDER) {
+    unsigned long page_idx = (ptr - memory_start) / PAGE_SIZE;
+    if (page_idx >= PAGE_NUM || page_list[page_idx].slab_cache < 0) {
         uart_puts("[!] Invalid pointer to free: not in kmem cache!\n");
         return;
     }
-    struct kmem_cache_entry *entry = (struct kmem_cache_entry*)(ptr - sizeof(struct kmem_cache_entry));
-    kmem_freelist_push(entry, &kmem_caches[order - MIN_CACHE_ORDER]);
+    struct PageInfo *slab = page_list + page_idx;
+    struct kmem_cache *cache = &kmem_caches[slab->slab_cache];
+    void *page = memory_start + page_idx * PAGE_SIZE;
+    unsigned int obj = (ptr - page) / cache->size;
+    if (page + obj * cache->size != ptr || obj >= cache->objects) {
+        uart_puts("[!] Invalid pointer to free: not the start of an object!\n");
+        return;
+    }
 
-    // uart_puts("[Chunk] Freed chunk size ");
-    // uart_puts(itoa(1 << (order)));
-    // uart_puts(" at address ");
-    // uart_hex((unsigned long)ptr);
-    // uart_puts(" (header starts at ");
-    // uart_hex((unsigned long)entry);
-    // uart_puts(")\r\n");
+    unsigned long flags = spin_lock_irqsave(&cache->lock);
+    int was_full = slab->freelist == SLAB_NONE;
+    *(unsigned short*)ptr = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->nr_inuse--;
+
+    void *release = NULL;
+    if (slab->inuse == 0) {
+        slab_list_del(was_full ? &cache->full : &cache->partial, page_idx);
+        if (cache->nr_empty >= SLAB_EMPTY_MAX) {  // Enough spare slabs, give the page back
+            slab->slab_cache = -1;
+            cache->nr_slabs--;
+            release = page;
+        }
+        else {
+            slab_list_add(&cache->empty, page_idx);
+            cache->nr_empty++;
+        }
+    }
+    else if (was_full) {
+        slab_list_del(&cache->full, page_idx);
+        slab_list_add(&cache->partial, page_idx);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
 
-    return;
+    if (release != NULL) _free(release);
 }
 
 void* alloc(unsigned int size) {
     if (size == 0) return NULL;
 
     void *alloc = NULL;
-    if (size > MAX_CHUNK_SIZE) {
+    if (size > KMALLOC_MAX_SIZE) {
         alloc = _alloc(size);
     }
     else {
         alloc = kmalloc(size);
-        // print_kmem_freelit();
+        // print_slab_stats();
     };
 
     if (alloc == NULL) {
@@ -226,9 +232,9 @@ void free(void *ptr) {
         return;
     }
 
-    if (page_list[page_idx].cache_order != -1) {  // This address is in kmem cache
+    if (page_list[page_idx].slab_cache != -1) {  // This address is in kmem cache
         kfree(ptr);
-        // print_kmem_freelit();
+        // print_slab_stats();
     }
     else {
         _free(ptr);
@@ -275,6 +281,15 @@ void test_alloc() {
         free(kmem_ptr[i]);
     }
 
+    // Test the larger classes, the slabs are given back once empty
+    for (int i=0; i<100; i++) {
+        kmem_ptr[i] = (char *)alloc(i % 2 ? 2048 : 200);
+    }
+    for (int i=0; i<100; i++) {
+        free(kmem_ptr[i]);
+    }
+    print_slab_stats();
+
     // Test exceeding the maximum size
     char *kmem_ptr7 = (char *)alloc(MAX_ALLOC_SIZE + 1);
     if (kmem_ptr7 == NULL) {
@@ -285,5 +300,6 @@ void test_alloc() {
         free(kmem_ptr7);
     }
 
-    char *kmem_ptr8 = (char *)alloc(MAX_CHUNK_SIZE + 1);
+    char *kmem_ptr8 = (char *)alloc(KMALLOC_MAX_SIZE + 1);  // Falls through to the buddy allocator
+    free(kmem_ptr8);
 }
\ No newline at end of file
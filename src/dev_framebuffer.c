@@ -2,6 +2,7 @@
 
 unsigned int width, height, pitch, isrgb; /* dimensions and channel order */
 unsigned char *lfb;                       /* raw frame buffer address */
+unsigned int lfb_size;                    /* size of the frame buffer in bytes */
 
 struct file_operations framebuffer_f_ops = {
     .open = dev_framebuffer_open,
@@ -9,6 +10,7 @@ struct file_operations framebuffer_f_ops = {
     .write = dev_framebuffer_write,
     .read = dev_framebuffer_read,
     .lseek64 = dev_framebuffer_lseek64,
+    .mmap = dev_framebuffer_mmap,
 };
 
 int dev_framebuffer_open(struct vnode* file_node, struct file** target) {
@@ -82,6 +84,23 @@ long dev_framebuffer_lseek64(struct file* file, long offset, int whence) {
     return new_pos;  // Return new position
 }
 
+/**
+ * dev_framebuffer_mmap - Get the page of the frame buffer at `offset`
+ *
+ * The frame buffer lives in the GPU memory, above the end of the RAM, so
+ * `do_page_fault` maps it non-cacheable and user programs draw in place.
+ * Only available after the ioctl has allocated the buffer.
+ */
+void* dev_framebuffer_mmap(struct vnode* file_node, size_t offset, int prot) {
+    if (lfb == NULL || (offset & (PAGE_SIZE - 1))) {
+        return NULL;
+    }
+    if (offset >= lfb_size) {
+        return NULL;
+    }
+    return lfb + offset;
+}
+
 int dev_framebuffer_ioctl(struct framebuffer_info* info) {
     if (info == NULL) {
         return EINVAL_VFS;
@@ -143,6 +162,7 @@ int dev_framebuffer_ioctl(struct framebuffer_info* info) {
         pitch = mbox[33];       // get number of bytes per line
         isrgb = mbox[24];       // get the actual channel order
         lfb = (void *)((unsigned long)mbox[28]);
+        lfb_size = mbox[29];    // get the size of the buffer
     }
     else {
         uart_puts("Unable to set screen resolution to 1024x768x32\n");
@@ -0,0 +1,93 @@
+#include "dev_pl011.h"
+#include "pl011.h"
+
+struct file_operations pl011_f_ops = {
+    .open = dev_pl011_open,
+    .close = dev_pl011_close,
+    .write = dev_pl011_write,
+    .read = dev_pl011_read,
+    .lseek64 = dev_pl011_lseek64,
+};
+
+int dev_pl011_open(struct vnode* file_node, struct file** target) {
+    if (file_node == NULL || target == NULL) {
+        return EINVAL_VFS;
+    }
+    
+    *target = (struct file*)alloc(sizeof(struct file));
+    if (*target == NULL) {
+        return ENOMEM_VFS;
+    }
+    
+    (*target)->vnode = file_node;
+    (*target)->f_pos = 0;  // Initial position
+    (*target)->f_ops = &pl011_f_ops;
+
+    return 0;  // Success
+}
+
+int dev_pl011_close(struct file* file) {
+    if (file == NULL) {
+        return EINVAL_VFS;
+    }
+
+    free(file);
+    return 0;  // Success
+}
+
+int dev_pl011_write(struct file* file, const void* buf, size_t len) {
+    if (file == NULL || buf == NULL || len == 0) {
+        return EINVAL_VFS;
+    }
+
+    // Straight into the TX FIFO, the rest queued in the TX ring
+    pl011_send((const char*)buf, len);
+
+    file->f_pos += len;  // Update file position
+    return len;  // Return number of bytes written
+}
+
+int dev_pl011_read(struct file* file, void* buf, size_t len) {
+    if (file == NULL || buf == NULL || len == 0) {
+        return EINVAL_VFS;
+    }
+
+    // Sleeps until input arrives, then returns what is there (at most `len`)
+    int bytes_read = pl011_recv((char*)buf, len);
+    if (bytes_read < 0) {
+        return ENODEV_VFS;  // UART0 is not set up yet
+    }
+
+    file->f_pos += bytes_read;  // Update file position
+    return bytes_read;  // Return number of bytes read
+}
+
+long dev_pl011_lseek64(struct file* file, long offset, int whence) {
+    if (file == NULL) {
+        return EINVAL_VFS;
+    }
+
+    long new_pos = file->f_pos;
+
+    switch (whence) {
+        case SEEK_SET:
+            new_pos = offset;
+            break;
+        case SEEK_CUR:
+            new_pos += offset;
+            break;
+        case SEEK_END:
+            // For the PL011, we can consider the end as the current position
+            new_pos = file->f_pos;  // No real end for the PL011
+            break;
+        default:
+            return EINVAL_VFS;  // Invalid whence
+    }
+
+    if (new_pos < 0) {
+        return EINVAL_VFS;  // Negative position not allowed
+    }
+
+    file->f_pos = new_pos;  // Update file position
+    return new_pos;  // Return new position
+}
\ No newline at end of file
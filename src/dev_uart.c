@@ -39,11 +39,9 @@ int dev_uart_write(struct file* file, const void* buf, size_t len) {
         return EINVAL_VFS;
     }
 
-    // Simulate UART write operation
-    for (size_t i = 0; i < len; i++) {
-        uart_putc(((const char*)buf)[i]);
-    }
-    
+    // Queued in the TX ring, sleeps while it is full
+    uart_send((const char*)buf, len);
+
     file->f_pos += len;  // Update file position
     return len;  // Return number of bytes written
 }
@@ -53,14 +51,8 @@ int dev_uart_read(struct file* file, void* buf, size_t len) {
         return EINVAL_VFS;
     }
 
-    // Simulate UART read operation
-    size_t bytes_read = 0;
-    for (size_t i = 0; i < len; i++) {
-        char ch = uart_getc();  // Read a character from UART
-        if (ch == '\0') break;  // Stop reading on null character
-        ((char*)buf)[i] = ch;
-        bytes_read++;
-    }
+    // Sleeps until input arrives, then returns what is there (at most `len`)
+    size_t bytes_read = uart_recv((char*)buf, len);
 
     file->f_pos += bytes_read;  // Update file position
     return bytes_read;  // Return number of bytes read
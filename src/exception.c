@@ -1,4 +1,7 @@
 #include "exception.h"
+#include "irq.h"
+#include "softirq.h"
+#include "kprintf.h"
 
 void exception_entry() {
     // Print spsr_el1, elr_el1, and esr_el1
@@ -15,44 +18,27 @@ void exception_entry() {
     unsigned long ec = (esr_el1 >> 26) & 0x3f;  // Extract the exception class
     struct ThreadTask *current_task = get_current();
 
-    uart_puts("spsr_el1: ");
-    uart_hex(spsr_el1);
-    uart_puts(" elr_el1: ");
-    uart_hex(elr_el1);
-    uart_puts(" esr_el1: ");
-    uart_hex(esr_el1);
-    uart_puts(" EC: ");
-    uart_hex(ec);
-    uart_puts(" Current Task ID: ");
     if (current_task) {
-        uart_hex(current_task->id);
+        kprintf("spsr_el1: 0x%lx elr_el1: 0x%lx esr_el1: 0x%lx EC: 0x%lx Current Task ID: %u\r\n",
+                spsr_el1, elr_el1, esr_el1, ec, current_task->id);
     } else {
-        uart_puts("None");
+        kprintf("spsr_el1: 0x%lx elr_el1: 0x%lx esr_el1: 0x%lx EC: 0x%lx Current Task ID: None\r\n",
+                spsr_el1, elr_el1, esr_el1, ec);
     }
-    uart_puts("\r\n");
 }
 
 
 /**
  * irq_entry - Interrupt handler entry point
  *
- * This function is called when an interrupt occurs. It checks the
- * pending interrupts and calls the appropriate handler.
- *
- * The function handles the core timer interrupt and the UART interrupt.
+ * This function is called when an interrupt occurs. The pending interrupts
+ * are dispatched to the handlers installed with `request_irq`, the work they
+ * deferred runs in `irq_exit`.
  */
 void irq_entry(unsigned long sp) {
-    unsigned int irq_src = *CORE0_IRQ_SOURCE;
-    unsigned int pending_1 = *IRQ_PENDING_1;
-
     disable_irq_el1();
-    if (irq_src & TIMER_IRQ) {  // Timer interrupt
-        add_task(core_timer_handler, 0);
-        execute_task();
-    }
-    else if ((irq_src & GPU_IRQ) && (pending_1 & (1 << 29))) {  // UART interrupt
-        uart_irq_handler();
-    }
+    handle_irq();
+    irq_exit();
     enable_irq_el1();
 
     struct TrapFrame *trapframe = (struct TrapFrame *)sp;
@@ -67,6 +53,15 @@ void el0_sync_entry(unsigned long sp, unsigned long esr_el1) {
         enable_irq_el1();
         syscall_entry(trapframe);
     }
+    else if (ec == ESR_EC_DABT_LOW || ec == ESR_EC_DABT_CUR || ec == ESR_EC_IABT_LOW) {  // Page fault
+        if (do_page_fault(esr_el1) != 0) {
+            unsigned long far;
+            asm volatile("mrs %0, far_el1" : "=r"(far));
+            kprintf("[WARN] Segmentation fault at 0x%lx, pc 0x%lx\r\n", far, trapframe->elr_el1);
+            _exit();
+        }
+        if (ec == ESR_EC_DABT_CUR) return;  // Resume the interrupted kernel code as is
+    }
     else {
         uart_puts("Unknown exception class\r\n");
         exception_entry();
@@ -76,77 +71,6 @@ void el0_sync_entry(unsigned long sp, unsigned long esr_el1) {
     return;
 }
 
-void syscall_entry(struct TrapFrame *trapframe) {
-    unsigned long syscall_num = trapframe->x[8];  // x8 contains the syscall number
-
-    switch (syscall_num) {
-        case SYS_GETPID_NUM:
-            sys_getpid(trapframe);
-            break;
-        case SYS_UART_READ_NUM:
-            sys_uart_read(trapframe);
-            break;
-        case SYS_UART_WRITE_NUM:
-            sys_uart_write(trapframe);
-            break;
-        case SYS_EXEC_NUM:
-            sys_exec(trapframe);
-            break;
-        case SYS_FORK_NUM:
-            sys_fork(trapframe);
-            break;
-        case SYS_EXIT_NUM:
-            sys_exit(trapframe);
-            break;
-        case SYS_MBOX_CALL_NUM:
-            sys_mbox_call(trapframe);
-            break;
-        case SYS_KILL_NUM:
-            sys_kill(trapframe);
-            break;
-        case SYS_SIGNAL_NUM:
-            sys_signal(trapframe);
-            break;
-        case SYS_SIGKILL_NUM:
-            sys_sigkill(trapframe);
-            break;
-        case SYS_SIGRETURE_NUM:
-            sys_sigreturn(trapframe);
-            break;
-        case SYS_OPEN_NUM:
-            sys_open(trapframe);
-            break;
-        case SYS_CLOSE_NUM:
-            sys_close(trapframe);
-            break;
-        case SYS_WRITE_NUM:
-            sys_write(trapframe);
-            break;
-        case SYS_READ_NUM:
-            sys_read(trapframe);
-            break;
-        case SYS_MKDIR_NUM:
-            sys_mkdir(trapframe);
-            break;
-        case SYS_MOUNT_NUM:
-            sys_mount(trapframe);
-            break;
-        case SYS_CHDIR_NUM:
-            sys_chdir(trapframe);
-            break;
-        case SYS_LSEEK64_NUM:
-            sys_lseek64(trapframe);
-            break;
-        case SYS_IOCTL_NUM:
-            sys_ioctl(trapframe);
-            break;
-        default:
-            uart_puts("Unknown syscall number: ");
-            uart_hex(syscall_num);
-            uart_puts("\r\n");
-    }
-}
-
 void enable_irq_el1() {
     // uart_puts("Enabling IRQ\r\n");
     // uart_puts("Enabling EL1 IRQ @");
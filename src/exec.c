@@ -1,40 +1,81 @@
 #include "exec.h"
+#include "kprintf.h"
 
-void _exec(char* filename) {
+/**
+ * _exec - Replace the address space of the current task with a program from the initramfs
+ *
+ * The raw binary is loaded at `USER_CODE_BASE` and the stack ends at
+ * `USER_STACK_TOP`, so programs do not depend on where the pages are placed
+ * physically. The trapframe is rewritten so that returning from the
+ * exception starts the program at EL0.
+ *
+ * @return 0 on success, -1 if the program cannot be loaded (the caller keeps running)
+ */
+int _exec(char* filename, struct TrapFrame *trapframe) {
     unsigned int exec_size = cpio_get_file_size(filename);
     if (exec_size == 0) {
-        uart_puts(filename);
-        uart_puts(":  File not found\r\n");
-        return;
+        kprintf("%s:  File not found\r\n", filename);
+        return -1;
     }
 
-    uart_puts("File: ");
-    uart_puts(filename);
-    uart_puts(", size: ");
-    uart_puts(itoa(exec_size));
-    uart_puts("\r\n");
+    kprintf("File: %s, size: %u\r\n", filename, exec_size);
 
-    char *exec_addr = alloc(exec_size);
-    if (exec_addr == NULL) return;
-
-    cpio_get_exec(filename, exec_addr);
-    if (exec_addr == NULL) {
+    char *file_addr = cpio_get_exec(filename, NULL);
+    if (file_addr == NULL) {
         uart_puts("Failed to load executable\r\n");
-        return;
+        return -1;
+    }
+
+    unsigned long *pgd = pgd_alloc();
+    if (pgd == NULL) return -1;
+
+    // Copy the program page by page to `USER_CODE_BASE`
+    for (unsigned int offset = 0; offset < exec_size; offset += PAGE_SIZE) {
+        char *page = alloc(PAGE_SIZE);
+        if (page == NULL) {
+            pgd_free(pgd);
+            return -1;
+        }
+        unsigned int len = exec_size - offset < PAGE_SIZE ? exec_size - offset : PAGE_SIZE;
+        memset(page, 0, PAGE_SIZE);
+        memcpy_neon(page, file_addr + offset, len);
+        if (map_page(pgd, USER_CODE_BASE + offset, (unsigned long)page, PD_USER_RWX) != 0) {
+            free(page);
+            pgd_free(pgd);
+            return -1;
+        }
+    }
+
+    // The stack and the heap are populated on demand
+    struct ThreadTask *curr = get_current();
+    struct VMArea *old_vma_list = curr->vma_list;
+    unsigned long old_brk = curr->brk;
+    curr->vma_list = NULL;
+    if (vma_add(&curr->vma_list, USER_CODE_BASE, USER_CODE_BASE + round(exec_size), PD_USER_RWX, VMA_CODE) == NULL ||
+        vm_init_user_space(curr, USER_CODE_BASE + round(exec_size)) != 0) {
+        vma_free_list(&curr->vma_list);
+        curr->vma_list = old_vma_list;
+        curr->brk = old_brk;
+        pgd_free(pgd);
+        return -1;
+    }
+
+    // Nothing can fail from here, drop the old address space
+    unsigned long *old_pgd = curr->pgd;
+    curr->pgd = pgd;
+    curr->asid = 0;  // Take a fresh ASID, the old one may still have TLB entries
+    switch_mm(curr);
+    pgd_free(old_pgd);
+    vma_free_list(&old_vma_list);
+    curr->uring = NULL;  // It was in the old address space
+
+    for (int i = 0; i < SIG_NUM; i++) {
+        if (i == SIGKILL) curr->sig_handlers[i] = default_sigkill_handler;
+        else curr->sig_handlers[i] = default_handler;
     }
 
-    struct ThreadTask* new_thread = thread_create(exec_addr);
-    asm volatile(
-        "msr tpidr_el1, %0\n"
-        "mov x5, 0x0\n"
-        "msr spsr_el1, x5\n"
-        "msr elr_el1, %1\n"
-        "msr sp_el0, %2\n"
-        "mov sp, %3\n"
-        "eret"
-        :
-        : "r"(new_thread), "r"(new_thread->cpu_context.lr), "r"(new_thread->cpu_context.sp), 
-          "r"(new_thread->kernel_stack + THREAD_STACK_SIZE)
-        : "x5"
-    );
+    trapframe->elr_el1 = USER_CODE_BASE;
+    trapframe->sp_el0 = USER_STACK_TOP;
+    trapframe->spsr_el1 = 0;  // EL0t with interrupts enabled
+    return 0;
 }
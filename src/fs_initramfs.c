@@ -8,6 +8,7 @@ struct file_operations initramfs_f_ops = {
     .write = initramfs_write,
     .read = initramfs_read,
     .lseek64 = initramfs_lseek64,
+    .mmap = initramfs_mmap,
 };
 
 struct vnode_operations initramfs_v_ops = {
@@ -49,6 +50,7 @@ int initramfs_setup_mount(struct filesystem* fs, struct mount* mount) {
     mount->root->f_ops = &initramfs_f_ops;
     mount->root->internal = initramfs_root;
     mount->root->parent_is_mount = 1;
+    atomic_set(&mount->root->map_count, 0);
 
     return 0; // Success
 }
@@ -80,9 +82,13 @@ void initramfs_init(struct vnode* rootvnode) {
             new_node->type = INITRAMFS_NODE_FILE;
             new_node->parent = NULL; // Will be set later
             new_node->size = filesize;
-            new_node->data = alloc(filesize);
-            memcpy(new_node->data, (char *)header + align(HEADER_SIZE + filenamesize, 4), filesize);
-            new_node->capacity = filesize;
+            // Keep the content page aligned and zero padded so that it can be mapped by `mmap`
+            new_node->capacity = round(filesize);
+            new_node->data = alloc(new_node->capacity);
+            if (new_node->data != NULL) {
+                memset(new_node->data, 0, new_node->capacity);
+                memcpy_neon(new_node->data, (char *)header + align(HEADER_SIZE + filenamesize, 4), filesize);
+            }
             new_node->num_children = 0;
             for (int i = 0; i < MAX_CHILDREN; ++i) {
                 new_node->children[i] = NULL;
@@ -95,6 +101,7 @@ void initramfs_init(struct vnode* rootvnode) {
             new_vnode->internal = new_node;
             new_vnode->parent = rootvnode;
             new_vnode->parent_is_mount = 0;
+            atomic_set(&new_vnode->map_count, 0);
 
             ((struct initramfs_node*)rootvnode->internal)->children[((struct initramfs_node*)rootvnode->internal)->num_children++] = new_vnode;
 
@@ -223,4 +230,26 @@ long initramfs_lseek64(struct file* file, long offset, int whence) {
 
     file->f_pos = new_pos;
     return new_pos;
-}
\ No newline at end of file
+}
+
+/**
+ * initramfs_mmap - Get the page of the file content at `offset`
+ *
+ * The archive is read-only, so only read-only shared mappings (and private
+ * mappings, which never write back) are allowed.
+ */
+void* initramfs_mmap(struct vnode* file_node, size_t offset, int prot) {
+    if (!file_node || !file_node->internal || (offset & (PAGE_SIZE - 1))) {
+        return NULL;
+    }
+    if (prot & PROT_WRITE) return NULL;  // read-only filesystem
+
+    struct initramfs_node* internal_node = (struct initramfs_node*)file_node->internal;
+    if (internal_node->type != INITRAMFS_NODE_FILE || internal_node->data == NULL) {
+        return NULL;
+    }
+    if (offset >= internal_node->size) {
+        return NULL;
+    }
+    return internal_node->data + offset;
+}
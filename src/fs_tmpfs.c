@@ -12,6 +12,7 @@ struct file_operations tmpfs_f_ops = {
     .write = tmpfs_write,
     .read = tmpfs_read,
     .lseek64 = tmpfs_lseek64,
+    .mmap = tmpfs_mmap,
 };
 
 struct tmpfs_node* tmpfs_create_internal_node(const char* name, tmpfs_node_type_t type, struct tmpfs_node* parent) {
@@ -26,6 +27,7 @@ struct tmpfs_node* tmpfs_create_internal_node(const char* name, tmpfs_node_type_
     new_node->name[name_len] = '\0';
     new_node->type = type;
     new_node->parent = parent;
+    rwlock_init(&new_node->lock);
     new_node->data = NULL;
     new_node->size = 0;
     new_node->capacity = 0;
@@ -41,6 +43,7 @@ struct tmpfs_node* tmpfs_create_internal_node(const char* name, tmpfs_node_type_
             free(new_node);
             return NULL;
         }
+        memset(new_node->data, 0, DEFAULT_FILE_SIZE);  // The whole buffer is visible through `mmap`
         new_node->capacity = DEFAULT_FILE_SIZE;
     }
     return new_node;
@@ -80,6 +83,7 @@ int tmpfs_setup_mount(struct filesystem* fs, struct mount* mount) {
     mount->root->f_ops = &tmpfs_f_ops;
     mount->root->internal = tmpfs_root;
     mount->root->parent_is_mount = 1;
+    atomic_set(&mount->root->map_count, 0);
     
     return 0; // Success
 }
@@ -96,13 +100,16 @@ int tmpfs_lookup(struct vnode* dir_node, struct vnode** target, const char* comp
         return EACCES_VFS; // Cannot lookup in a non-directory
     }
 
+    unsigned long flags = read_lock_irqsave(&parent_internal->lock);
     for (int i = 0; i < parent_internal->num_children; ++i) {
         char *child_name = ((struct tmpfs_node*)(parent_internal->children[i]->internal))->name;
         if (strcmp(child_name, component_name) == 0) {
             *target = parent_internal->children[i];
+            read_unlock_irqrestore(&parent_internal->lock, flags);
             return 0;
         }
     }
+    read_unlock_irqrestore(&parent_internal->lock, flags);
     return ENOENT_VFS;
 }
 
@@ -122,18 +129,7 @@ int tmpfs_create_or_mkdir(struct vnode* dir_node, struct vnode** target, const c
         return EINVAL_VFS; // Name too long
     }
 
-    // Check if name already exists
-    for (int i = 0; i < parent_internal->num_children; ++i) {
-        char *child_name = ((struct tmpfs_node*)(parent_internal->children[i]->internal))->name;
-        if (strcmp(child_name, component_name) == 0) {
-            return EEXIST_VFS;
-        }
-    }
-
-    if (parent_internal->num_children >= MAX_CHILDREN) {
-        return ENOMEM_VFS; // Directory full
-    }
-
+    // Build the node first, the directory is only locked to link it in
     struct tmpfs_node* new_internal = tmpfs_create_internal_node(component_name, type, parent_internal);
     if (!new_internal) {
         return ENOMEM_VFS;
@@ -152,8 +148,35 @@ int tmpfs_create_or_mkdir(struct vnode* dir_node, struct vnode** target, const c
     new_vnode->internal = new_internal;
     new_vnode->parent = dir_node;
     new_vnode->parent_is_mount = 0;
+    atomic_set(&new_vnode->map_count, 0);
+
+    int ret = 0;
+    unsigned long flags = write_lock_irqsave(&parent_internal->lock);
+
+    // Check if name already exists
+    for (int i = 0; i < parent_internal->num_children && ret == 0; ++i) {
+        char *child_name = ((struct tmpfs_node*)(parent_internal->children[i]->internal))->name;
+        if (strcmp(child_name, component_name) == 0) {
+            ret = EEXIST_VFS;
+        }
+    }
+
+    if (ret == 0 && parent_internal->num_children >= MAX_CHILDREN) {
+        ret = ENOMEM_VFS; // Directory full
+    }
+
+    if (ret == 0) {
+        parent_internal->children[parent_internal->num_children++] = new_vnode;
+    }
+    write_unlock_irqrestore(&parent_internal->lock, flags);
+
+    if (ret != 0) {
+        if (new_internal->data) free(new_internal->data);
+        free(new_internal);
+        free(new_vnode);
+        return ret;
+    }
 
-    parent_internal->children[parent_internal->num_children++] = new_vnode;
     *target = new_vnode;
 
     return 0; // Success
@@ -190,6 +213,45 @@ int tmpfs_close(struct file* file) {
     return 0;
 }
 
+/**
+ * tmpfs_reserve - Make room for `required` bytes of content
+ *
+ * Called with the node lock write held. The buffer moves when it grows,
+ * which is refused while the file is mapped.
+ */
+static int tmpfs_reserve(struct vnode* file_node, struct tmpfs_node* internal_node, size_t required) {
+    if (required <= internal_node->capacity) return 0;
+
+    size_t new_capacity = internal_node->capacity > 0 ? internal_node->capacity : DEFAULT_FILE_SIZE;
+    while (new_capacity < required) {
+        new_capacity *= 2; // Double the capacity
+    }
+    if (atomic_read(&file_node->map_count) > 0) {  // Mapped pages must stay where they are
+        return EBUSY_VFS;
+    }
+    char* new_data = (char*)alloc(new_capacity);
+    if (!new_data) {
+        return ENOMEM_VFS;
+    }
+    memset(new_data + internal_node->size, 0, new_capacity - internal_node->size);
+    if (internal_node->data) {
+        memcpy_neon(new_data, internal_node->data, internal_node->size);
+        free(internal_node->data);
+    }
+    internal_node->data = new_data;
+    internal_node->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * tmpfs_write - Write `len` bytes at the file position
+ *
+ * The user buffer is never touched with the node lock held: it may need a
+ * page fault, and faulting in a shared mapping of this same file takes the
+ * lock again in `tmpfs_mmap`. Data goes through a kernel bounce buffer, one
+ * `TMPFS_BOUNCE_SIZE` chunk per lock hold, and the size and capacity are
+ * checked again every time the lock is taken.
+ */
 int tmpfs_write(struct file* file, const void* buf, size_t len) {
     if (!file || !file->vnode || !file->vnode->internal || !buf) {
         return EINVAL_VFS;
@@ -201,33 +263,37 @@ int tmpfs_write(struct file* file, const void* buf, size_t len) {
         return EACCES_VFS; // Cannot write to a directory
     }
 
-    // Check if we need to reallocate buffer
-    if (file->f_pos + len > internal_node->capacity) {
-        size_t required_capacity = file->f_pos + len;
-        size_t new_capacity = internal_node->capacity > 0 ? internal_node->capacity : DEFAULT_FILE_SIZE;
-        while (new_capacity < required_capacity) {
-            new_capacity *= 2; // Double the capacity
+    char *bounce = (char*)alloc(TMPFS_BOUNCE_SIZE);
+    if (!bounce) {
+        return ENOMEM_VFS;
+    }
+
+    size_t done = 0;
+    int ret = 0;
+    while (done < len) {
+        size_t chunk = len - done < TMPFS_BOUNCE_SIZE ? len - done : TMPFS_BOUNCE_SIZE;
+        memcpy(bounce, (const char*)buf + done, chunk);  // May fault, no lock held
+
+        unsigned long flags = write_lock_irqsave(&internal_node->lock);
+        ret = tmpfs_reserve(file->vnode, internal_node, file->f_pos + chunk);
+        if (ret < 0) {
+            write_unlock_irqrestore(&internal_node->lock, flags);
+            break;
         }
-        if (new_capacity > internal_node->capacity) { // only realloc if new_capacity is actually larger
-            char* new_data = (char*)alloc(new_capacity);
-            if (!new_data) return ENOMEM_VFS;
-            if (internal_node->data) {
-                memcpy(new_data, internal_node->data, internal_node->size);
-                free(internal_node->data);
-            }
-            internal_node->data = new_data;
-            internal_node->capacity = new_capacity;
+        memcpy(internal_node->data + file->f_pos, bounce, chunk);
+        file->f_pos += chunk;
+        if (file->f_pos > internal_node->size) {
+            internal_node->size = file->f_pos;
         }
+        write_unlock_irqrestore(&internal_node->lock, flags);
+        done += chunk;
     }
 
-    memcpy(internal_node->data + file->f_pos, buf, len);
-    file->f_pos += len;
-    if (file->f_pos > internal_node->size) {
-        internal_node->size = file->f_pos;
-    }
-    return len;
+    free(bounce);
+    return done > 0 ? (int)done : ret;
 }
 
+// Same as `tmpfs_write`, the user buffer is filled from the bounce buffer after the lock is dropped
 int tmpfs_read(struct file* file, void* buf, size_t len) {
     if (!file || !file->vnode || !file->vnode->internal || !buf) {
         return EINVAL_VFS;
@@ -239,18 +305,32 @@ int tmpfs_read(struct file* file, void* buf, size_t len) {
         return EACCES_VFS; // Cannot read a directory this way
     }
 
-    if (file->f_pos >= internal_node->size) {
-        return 0; // EOF
+    char *bounce = (char*)alloc(TMPFS_BOUNCE_SIZE);
+    if (!bounce) {
+        return ENOMEM_VFS;
     }
 
-    size_t readable_len = len;
-    if (file->f_pos + len > internal_node->size) {
-        readable_len = internal_node->size - file->f_pos;
+    size_t done = 0;
+    while (done < len) {
+        unsigned long flags = read_lock_irqsave(&internal_node->lock);
+        if (file->f_pos >= internal_node->size) {
+            read_unlock_irqrestore(&internal_node->lock, flags);
+            break; // EOF
+        }
+        size_t chunk = len - done < TMPFS_BOUNCE_SIZE ? len - done : TMPFS_BOUNCE_SIZE;
+        if (file->f_pos + chunk > internal_node->size) {
+            chunk = internal_node->size - file->f_pos;
+        }
+        memcpy(bounce, internal_node->data + file->f_pos, chunk);
+        read_unlock_irqrestore(&internal_node->lock, flags);
+
+        memcpy((char*)buf + done, bounce, chunk);  // May fault, no lock held
+        file->f_pos += chunk;
+        done += chunk;
     }
 
-    memcpy(buf, internal_node->data + file->f_pos, readable_len);
-    file->f_pos += readable_len;
-    return readable_len;
+    free(bounce);
+    return done;
 }
 
 long tmpfs_lseek64(struct file* file, long offset, int whence) {
@@ -283,4 +363,28 @@ long tmpfs_lseek64(struct file* file, long offset, int whence) {
 
     file->f_pos = new_pos;
     return new_pos;
-}
\ No newline at end of file
+}
+
+/**
+ * tmpfs_mmap - Get the page of the file content at `offset`
+ *
+ * The content lives in a page-aligned buffer, so it is mapped as is and
+ * writes through a shared mapping go straight to the file. Pages past the
+ * end of the file cannot be mapped.
+ */
+void* tmpfs_mmap(struct vnode* file_node, size_t offset, int prot) {
+    if (!file_node || !file_node->internal || (offset & (PAGE_SIZE - 1))) {
+        return NULL;
+    }
+    struct tmpfs_node* internal_node = (struct tmpfs_node*)file_node->internal;
+    if (internal_node->type != TMPFS_NODE_FILE || internal_node->data == NULL) {
+        return NULL;
+    }
+    void *page = NULL;
+    unsigned long flags = read_lock_irqsave(&internal_node->lock);
+    if (offset < internal_node->size && offset < internal_node->capacity) {
+        page = internal_node->data + offset;
+    }
+    read_unlock_irqrestore(&internal_node->lock, flags);
+    return page;
+}
@@ -1,26 +1,32 @@
 #include "fs_vfs.h"
+#include "klog.h"
 
 #define MAX_FILESYSTEMS 10
 
 struct mount* rootfs = NULL;
 static struct filesystem* filesystems[MAX_FILESYSTEMS];
 static int num_filesystems = 0;
+static rwlock_t filesystems_lock = RWLOCK_INIT;
 
 
 int register_filesystem(struct filesystem* fs) {
     if (fs == NULL || fs->name == NULL) {
       return EINVAL_VFS;
     }
+    int ret = ENOMEM_VFS;
+    unsigned long flags = write_lock_irqsave(&filesystems_lock);
     if (num_filesystems < MAX_FILESYSTEMS) {
+        ret = 0;
         for (int i = 0; i < num_filesystems; i++) {
             if (filesystems[i] != NULL && filesystems[i]->name != NULL && strcmp(filesystems[i]->name, fs->name) == 0) {
-              return EEXIST_VFS;
+              ret = EEXIST_VFS;
+              break;
             }
         }
-        filesystems[num_filesystems++] = fs;
-        return 0; // Success
+        if (ret == 0) filesystems[num_filesystems++] = fs;
     }
-    return ENOMEM_VFS;
+    write_unlock_irqrestore(&filesystems_lock, flags);
+    return ret;
 }
 
 // TODO: refactor
@@ -150,21 +156,25 @@ int vfs_lseek64(struct file* file, long offset, int whence) {
     return ENOSYS_VFS;
 }
 
+// Get the page backing `offset` of a file so that it can be mapped into a user address space
+void* vfs_mmap(struct vnode* vnode, size_t offset, int prot) {
+    if (vnode == NULL) return NULL;
+    if (vnode->f_ops && vnode->f_ops->mmap) {
+        return vnode->f_ops->mmap(vnode, offset, prot);
+    }
+    return NULL;
+}
+
 int vfs_mkdir(const char* pathname) {
     if (pathname == NULL) {
         return EINVAL_VFS;
     }
 
-    uart_puts("[vfs_mkdir] vfs_mkdir called with pathname: ");
-    uart_puts(pathname);
-    uart_puts("\r\n");
+    klog_debug("vfs_mkdir: called with pathname %s", pathname);
     char* path_copy = strdup(pathname);
     if (!path_copy) {
         return ENOMEM_VFS;
     }
-    uart_puts("[vfs_mkdir] Path copy created: ");
-    uart_puts(path_copy);
-    uart_puts("\r\n");
 
     int path_len = strlen(path_copy);
     int last_slash_index = -1;
@@ -176,9 +186,7 @@ int vfs_mkdir(const char* pathname) {
     }
 
     struct vnode* cwd = get_current()->cwd;
-    uart_puts("[vfs_mkdir] Attempting to create directory: ");
-    uart_puts(path_copy);
-    uart_puts("\r\n");
+    klog_debug("vfs_mkdir: attempting to create directory %s", path_copy);
 
     struct vnode* parent_vnode = NULL;
     char* dir_name_to_create;
@@ -186,7 +194,7 @@ int vfs_mkdir(const char* pathname) {
     if (last_slash_index == -1) { // No slash in path, e.g., "dirname"
         // Relative to CWD
         if (!cwd) {
-            uart_puts("[vfs_mkdir] Error: CWD not set for relative path.\r\n");
+            klog_err("vfs_mkdir: CWD not set for relative path");
             free(path_copy);
             return EINTERR_VFS; // Internal error, CWD should be set
         }
@@ -226,11 +234,7 @@ int vfs_mkdir(const char* pathname) {
         }
         else {
             free(path_copy);
-            uart_puts("[vfs_mkdir] Failed to create directory: ");
-            uart_puts(pathname);
-            uart_puts(" - Error code: ");
-            uart_puts(itoa(ret_mkdir));
-            uart_puts("\r\n");
+            klog_warn("vfs_mkdir: failed to create directory %s, error code %d", pathname, ret_mkdir);
             return ret_mkdir; // Return the error code from mkdir operation
         }
         // free(path_copy);
@@ -277,12 +281,14 @@ int vfs_mount(const char* target_pathname, const char* filesystem_name) {
 
     // Find the filesystem
     struct filesystem* fs_to_mount = NULL;
+    unsigned long flags = read_lock_irqsave(&filesystems_lock);
     for (int i = 0; i < num_filesystems; i++) {
         if (strcmp(filesystems[i]->name, filesystem_name) == 0) {
             fs_to_mount = filesystems[i];
             break;
         }
     }
+    read_unlock_irqrestore(&filesystems_lock, flags);
     if (fs_to_mount == NULL) {
         uart_puts("Filesystem type not found: ");
         uart_puts(filesystem_name);
@@ -514,5 +520,6 @@ void vfs_init() {
     uart_puts("Initializing /dev...\n");
     vfs_mkdir("/dev");
     vfs_mknod("/dev/uart", &uart_f_ops);
+    vfs_mknod("/dev/pl011", &pl011_f_ops);
     vfs_mknod("/dev/framebuffer", &framebuffer_f_ops);
 }
@@ -0,0 +1,152 @@
+#include "irq.h"
+#include "exception.h"
+#include "kprintf.h"
+
+static struct IrqDesc irq_descs[NR_IRQS];
+static unsigned int gpu_enabled[2];             // Mirrors ENABLE_IRQS_1/2, the pending registers are masked with it
+static spinlock_t irq_lock = SPINLOCK_INIT;     // Serializes `request_irq`/`free_irq`, dispatch reads without it
+
+/**
+ * request_irq - Install `handler` for `irq` and unmask the line
+ *
+ * The handler runs with IRQs masked on the core that took the interrupt.
+ * Lines of the ARM local peripherals are per core and stay masked here, the
+ * driver enables them in the control register of each core.
+ *
+ * @return 0 on success, -1 if `irq` is invalid or already taken
+ */
+int request_irq(unsigned int irq, irq_handler_t handler, const char *name, void *dev) {
+    if (irq >= NR_IRQS || handler == NULL) return -1;
+
+    unsigned long flags = spin_lock_irqsave(&irq_lock);
+    struct IrqDesc *desc = &irq_descs[irq];
+    if (desc->handler != NULL) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        kprintf("[WARN] request_irq: IRQ %u is already taken by %s\r\n", irq, desc->name);
+        return -1;
+    }
+    desc->dev = dev;
+    desc->name = name;
+    asm volatile("dmb ishst" ::: "memory");  // Publish `dev` before the handler can be seen
+    desc->handler = handler;
+    spin_unlock_irqrestore(&irq_lock, flags);
+
+    irq_enable(irq);
+    return 0;
+}
+
+// Mask `irq` and remove its handler, `dev` must be the one it was requested with
+void free_irq(unsigned int irq, void *dev) {
+    if (irq >= NR_IRQS) return;
+
+    unsigned long flags = spin_lock_irqsave(&irq_lock);
+    struct IrqDesc *desc = &irq_descs[irq];
+    if (desc->handler == NULL || desc->dev != dev) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        kprintf("[WARN] free_irq: IRQ %u is not owned by the caller\r\n", irq);
+        return;
+    }
+    irq_disable(irq);
+    desc->handler = NULL;
+    desc->dev = NULL;
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+// Unmask a GPU or basic IRQ line, the enable registers are write-1-to-set
+void irq_enable(unsigned int irq) {
+    if (irq < NR_GPU_IRQS) {
+        __atomic_or_fetch(&gpu_enabled[irq / 32], 1U << (irq % 32), __ATOMIC_RELAXED);
+        if (irq < 32) *ENABLE_IRQS_1 = 1U << irq;
+        else *ENABLE_IRQS_2 = 1U << (irq - 32);
+    }
+    else if (irq < IRQ_LOCAL_BASE) {
+        *ENABLE_BASIC_IRQS = 1U << (irq - IRQ_BASIC_BASE);
+    }
+}
+
+void irq_disable(unsigned int irq) {
+    if (irq < NR_GPU_IRQS) {
+        if (irq < 32) *DISABLE_IRQS_1 = 1U << irq;
+        else *DISABLE_IRQS_2 = 1U << (irq - 32);
+        __atomic_and_fetch(&gpu_enabled[irq / 32], ~(1U << (irq % 32)), __ATOMIC_RELAXED);
+    }
+    else if (irq < IRQ_LOCAL_BASE) {
+        *DISABLE_BASIC_IRQS = 1U << (irq - IRQ_BASIC_BASE);
+    }
+}
+
+static void generic_handle_irq(unsigned int irq, unsigned int cpu) {
+    struct IrqDesc *desc = &irq_descs[irq];
+    desc->count[cpu]++;
+
+    irq_handler_t handler = desc->handler;
+    if (handler != NULL) {
+        handler(irq, desc->dev);
+        return;
+    }
+
+    // Nobody will acknowledge it, mask it before it storms
+    irq_disable(irq);
+    kprintf("[WARN] Unhandled IRQ %u\r\n", irq);
+}
+
+// Dispatch every set bit of `pending`, highest first, as IRQ `base + bit`
+static void handle_pending(unsigned int pending, unsigned int base, unsigned int cpu) {
+    while (pending != 0) {
+        unsigned int bit = 31 - __builtin_clz(pending);
+        pending &= ~(1U << bit);
+        generic_handle_irq(base + bit, cpu);
+    }
+}
+
+static void handle_gpu_irq(unsigned int cpu) {
+    unsigned int basic = *IRQ_BASIC_PENDING;
+    handle_pending(basic & ((1U << NR_BASIC_IRQS) - 1), IRQ_BASIC_BASE, cpu);
+
+    // Bits 8 and 9 flag the pending registers, bits 10 - 20 are shortcuts into them
+    if (basic & BASIC_PENDING_GPU) {
+        handle_pending(*IRQ_PENDING_1 & gpu_enabled[0], 0, cpu);
+        handle_pending(*IRQ_PENDING_2 & gpu_enabled[1], 32, cpu);
+    }
+}
+
+/**
+ * handle_irq - Decode and dispatch the pending IRQs of this core
+ *
+ * Called by `irq_entry` with IRQs masked. The source registers are walked
+ * with `clz`, so the cost only depends on how many IRQs are pending, not on
+ * how many are installed.
+ */
+void handle_irq() {
+    unsigned int cpu = get_cpu_id();
+    unsigned int src = *CORE_IRQ_SOURCE(cpu) & ((1U << NR_LOCAL_IRQS) - 1);
+
+    while (src != 0) {
+        unsigned int bit = 31 - __builtin_clz(src);
+        src &= ~(1U << bit);
+        if (bit == LOCAL_GPU_BIT) handle_gpu_irq(cpu);
+        else generic_handle_irq(IRQ_LOCAL_BASE + bit, cpu);
+    }
+}
+
+void print_irq_stats() {
+    char line[KPRINTF_BUF_SIZE];
+    int len = ksnprintf(line, sizeof(line), "IRQ");
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        len += ksnprintf(line + len, sizeof(line) - len, "%11s%d", "CPU", cpu);
+    }
+    kprintf("%s\r\n", line);
+
+    for (unsigned int irq = 0; irq < NR_IRQS; irq++) {
+        struct IrqDesc *desc = &irq_descs[irq];
+        unsigned long total = 0;
+        for (int cpu = 0; cpu < NR_CPUS; cpu++) total += desc->count[cpu];
+        if (desc->handler == NULL && total == 0) continue;
+
+        len = ksnprintf(line, sizeof(line), "%3u", irq);
+        for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+            len += ksnprintf(line + len, sizeof(line) - len, " %11lu", desc->count[cpu]);
+        }
+        kprintf("%s  %s\r\n", line, desc->handler != NULL ? desc->name : "-");
+    }
+}
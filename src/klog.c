@@ -0,0 +1,200 @@
+#include "klog.h"
+#include "uart.h"
+#include "sched.h"
+#include "timer.h"
+#include "spinlock.h"
+#include "kprintf.h"
+#include <stdarg.h>
+
+/**
+ * Ring of one core
+ *   Single producer (the core itself, with IRQs masked while it writes a
+ *   record) and single consumer (`klogd`), so no lock is needed. `head` and
+ *   `tail` count records since boot, the slot is the count modulo the size.
+ */
+struct KlogRing {
+    unsigned long head;         // Written by the producer only
+    unsigned long tail;         // Written by the consumer only
+    unsigned long dropped;
+    struct KlogRecord rec[KLOG_RING_SIZE];
+} __attribute__((aligned(64)));
+
+static struct KlogRing klog_rings[NR_CPUS];
+static struct ThreadTask *klogd_task;
+static struct WaitQueueHead klogd_wait = WAIT_QUEUE_HEAD_INIT;
+static struct Timer klogd_timer;
+static volatile int klogd_idle;  // `klogd` sleeps until the next record
+
+static const char *level_prefix[] = {
+    [KLOG_ERR]   = "[ERROR] ",
+    [KLOG_WARN]  = "[WARN] ",
+    [KLOG_INFO]  = "[INFO] ",
+    [KLOG_DEBUG] = "[DEBUG] ",
+};
+
+/**
+ * klog_event - Append a record to the ring of this core
+ *
+ * Only copies the arguments, the formatting is left to `klogd`. Use the
+ * `klog_*` macros instead, they drop the levels filtered out by `KLOG_LEVEL`.
+ */
+void klog_event(int level, const char *fmt, ...) {
+    unsigned long flags = local_irq_save();
+    struct KlogRing *ring = &klog_rings[get_cpu_id()];
+    unsigned long head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= KLOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        local_irq_restore(flags);
+        return;
+    }
+
+    struct KlogRecord *rec = &ring->rec[head & (KLOG_RING_SIZE - 1)];
+    rec->tick = get_tick();
+    rec->fmt = fmt;
+    rec->cpu = get_cpu_id();
+    rec->level = level;
+    rec->text_len = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = 0;
+    for (const char *p = fmt; *p != '\0' && n < KLOG_MAX_ARGS; p++) {
+        if (*p != '%') continue;
+        p++;
+        while (*p == '-' || (*p >= '0' && *p <= '9')) p++;  // Flags and width
+        int lng = 0;
+        while (*p == 'l' || *p == 'z') {
+            lng = 1;
+            p++;
+        }
+        switch (*p) {
+            case 'd': case 'i':
+                rec->args[n++] = lng ? (unsigned long)va_arg(ap, long) : (unsigned long)(long)va_arg(ap, int);
+                break;
+            case 'u': case 'x': case 'X': case 'c':
+                rec->args[n++] = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+                break;
+            case 'p':
+                rec->args[n++] = (unsigned long)va_arg(ap, void*);
+                break;
+            case 's': {
+                const char *s = va_arg(ap, const char*);
+                if (rec->text_len >= KLOG_TEXT_SIZE) {  // Full, points at the last terminator
+                    rec->args[n++] = (unsigned long)&rec->text[KLOG_TEXT_SIZE - 1];
+                    break;
+                }
+                rec->args[n++] = (unsigned long)&rec->text[rec->text_len];
+                if (s == NULL) s = "(null)";
+                while (*s != '\0' && rec->text_len < KLOG_TEXT_SIZE - 1) {
+                    rec->text[rec->text_len++] = *s++;
+                }
+                rec->text[rec->text_len++] = '\0';
+                break;
+            }
+            case '\0':
+                p--;
+                break;
+        }
+    }
+    rec->nargs = n;
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    local_irq_restore(flags);
+
+    // Pairs with the fence in `klogd`: either it sees the record or we see it idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (klogd_idle && __atomic_exchange_n(&klogd_idle, 0, __ATOMIC_RELAXED)) {
+        wake_up(&klogd_wait);
+    }
+}
+
+/**
+ * klog_format - Render a record as one console line
+ *
+ * @return Length of the line, at most `size`
+ */
+static unsigned int klog_format(struct KlogRecord *rec, char *buf, unsigned int size) {
+    unsigned long long freq = get_freq();
+    unsigned int len = ksnprintf(buf, size, "[%llu.%06llu][cpu%u] %s",
+                                 rec->tick / freq, (rec->tick % freq) * 1000000 / freq,
+                                 rec->cpu, level_prefix[rec->level]);
+    if (len < size) len += kbsnprintf(buf + len, size - len, rec->fmt, rec->args, rec->nargs);
+    if (len > size - 2) len = size - 2;  // Cut long lines, the line end always fits
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
+
+// Print the records of all cores, returns how many there were
+static int klog_drain() {
+    char line[160];
+    int count = 0;
+
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct KlogRing *ring = &klog_rings[cpu];
+        unsigned long tail = ring->tail;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped != 0) {
+            kprintf("[WARN] klog: %lu records dropped on cpu%u\r\n", dropped, cpu);
+        }
+
+        for (; tail != head; tail++) {
+            unsigned int len = klog_format(&ring->rec[tail & (KLOG_RING_SIZE - 1)], line, sizeof(line));
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);  // The slot can be reused
+            uart_send(line, len);
+            count++;
+        }
+    }
+    return count;
+}
+
+static int klog_empty() {
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct KlogRing *ring = &klog_rings[cpu];
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) return 0;
+    }
+    return 1;
+}
+
+static void klogd_timer_callback(struct Timer *timer) {
+    wake_up(&klogd_wait);
+}
+
+/**
+ * klogd - Print the kernel log in the background
+ *
+ * While records keep coming it wakes up every freq >> `KLOG_FLUSH_SHIFT`
+ * ticks, so a burst is printed in one go. Once a round finds nothing it
+ * sleeps until `klog_event` wakes it.
+ */
+static void klogd() {
+    while (1) {
+        int count = klog_drain();
+
+        prepare_to_wait(&klogd_wait);
+        if (count > 0) {
+            mod_timer(&klogd_timer, get_tick() + (get_freq() >> KLOG_FLUSH_SHIFT));
+        }
+        else {
+            klogd_idle = 1;
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!klog_empty()) klogd_idle = 0;
+        }
+        if (count > 0 || klogd_idle) schedule();
+        finish_wait(&klogd_wait);
+    }
+}
+
+void klog_init() {
+    timer_setup(&klogd_timer, klogd_timer_callback);
+    klogd_task = thread_create_on(klogd, 0);
+    if (klogd_task == NULL) {
+        uart_puts("[WARN] klog_init: failed to create klogd\r\n");
+        return;
+    }
+    sched_set_priority(klogd_task, IDLE_PRIORITY + 1);
+}
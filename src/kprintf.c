@@ -0,0 +1,200 @@
+#include "kprintf.h"
+#include "uart.h"
+#include "spinlock.h"
+
+static spinlock_t console_lock = SPINLOCK_INIT;
+
+struct FormatOut {
+    char *buf;
+    size_t size;
+    size_t len;     // Length of the whole output, may be past `size`
+};
+
+/**
+ * Source of the arguments
+ *   Either a va_list, or an array of values already widened to 64 bits (the
+ *   records of klog). Every conversion takes one entry of the array.
+ */
+struct FormatArgs {
+    va_list *ap;
+    const unsigned long *vec;
+    int nargs;
+    int next;
+};
+
+static void out_char(struct FormatOut *out, char ch) {
+    if (out->len + 1 < out->size) out->buf[out->len] = ch;
+    out->len++;
+}
+
+static void out_pad(struct FormatOut *out, char ch, int count) {
+    while (count-- > 0) out_char(out, ch);
+}
+
+static unsigned long arg_unsigned(struct FormatArgs *args, int lng) {
+    if (args->vec != NULL) {
+        if (args->next >= args->nargs) return 0;
+        unsigned long val = args->vec[args->next++];
+        return lng ? val : (unsigned int)val;
+    }
+    return lng ? va_arg(*args->ap, unsigned long) : va_arg(*args->ap, unsigned int);
+}
+
+static long arg_signed(struct FormatArgs *args, int lng) {
+    if (args->vec != NULL) {
+        if (args->next >= args->nargs) return 0;
+        unsigned long val = args->vec[args->next++];
+        return lng ? (long)val : (int)val;
+    }
+    return lng ? va_arg(*args->ap, long) : va_arg(*args->ap, int);
+}
+
+static const char* arg_string(struct FormatArgs *args) {
+    if (args->vec != NULL) {
+        if (args->next >= args->nargs) return NULL;
+        return (const char*)args->vec[args->next++];
+    }
+    return va_arg(*args->ap, const char*);
+}
+
+static void out_number(struct FormatOut *out, unsigned long val, unsigned int base, int upper,
+                       int negative, int width, int left, char pad) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = digits[val % base];
+        val /= base;
+    } while (val != 0);
+
+    int len = n + negative;
+    if (!left && pad == ' ') out_pad(out, ' ', width - len);
+    if (negative) out_char(out, '-');
+    if (!left && pad == '0') out_pad(out, '0', width - len);
+    while (n > 0) out_char(out, tmp[--n]);
+    if (left) out_pad(out, ' ', width - len);
+}
+
+static void format(struct FormatOut *out, const char *fmt, struct FormatArgs *args) {
+    for (const char *p = fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            out_char(out, *p);
+            continue;
+        }
+        p++;
+
+        int left = 0;
+        char pad = ' ';
+        for (;; p++) {
+            if (*p == '-') left = 1;
+            else if (*p == '0') pad = '0';
+            else break;
+        }
+        int width = 0;
+        while (*p >= '0' && *p <= '9') width = width * 10 + (*p++ - '0');
+        int lng = 0;
+        while (*p == 'l' || *p == 'z') {
+            lng = 1;
+            p++;
+        }
+        if (left) pad = ' ';
+
+        switch (*p) {
+            case 'd':
+            case 'i': {
+                long val = arg_signed(args, lng);
+                unsigned long mag = val < 0 ? -(unsigned long)val : (unsigned long)val;
+                out_number(out, mag, 10, 0, val < 0, width, left, pad);
+                break;
+            }
+            case 'u':
+                out_number(out, arg_unsigned(args, lng), 10, 0, 0, width, left, pad);
+                break;
+            case 'x':
+            case 'X':
+                out_number(out, arg_unsigned(args, lng), 16, *p == 'X', 0, width, left, pad);
+                break;
+            case 'p':
+                out_char(out, '0');
+                out_char(out, 'x');
+                out_number(out, arg_unsigned(args, 1), 16, 0, 0, width > 2 ? width - 2 : 0, left, pad);
+                break;
+            case 'c': {
+                char ch = (char)arg_unsigned(args, 0);
+                if (!left) out_pad(out, ' ', width - 1);
+                out_char(out, ch);
+                if (left) out_pad(out, ' ', width - 1);
+                break;
+            }
+            case 's': {
+                const char *s = arg_string(args);
+                if (s == NULL) s = "(null)";
+                int len = 0;
+                while (s[len] != '\0') len++;
+                if (!left) out_pad(out, ' ', width - len);
+                while (*s != '\0') out_char(out, *s++);
+                if (left) out_pad(out, ' ', width - len);
+                break;
+            }
+            case '%':
+                out_char(out, '%');
+                break;
+            case '\0':
+                p--;  // Lone '%' at the end
+                break;
+            default:
+                out_char(out, '%');
+                out_char(out, *p);
+                break;
+        }
+    }
+    if (out->size > 0) out->buf[out->len < out->size ? out->len : out->size - 1] = '\0';
+}
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
+    struct FormatOut out = { buf, size, 0 };
+    va_list aq;
+    va_copy(aq, ap);
+    struct FormatArgs args = { &aq, NULL, 0, 0 };
+    format(&out, fmt, &args);
+    va_end(aq);
+    return out.len;
+}
+
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = kvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/**
+ * kbsnprintf - Format with the arguments taken from an array
+ *
+ * Each conversion takes the next of the `nargs` values in `args`, %s
+ * expects a pointer to the string. Used to print records whose arguments
+ * were saved earlier, see klog.
+ */
+int kbsnprintf(char *buf, size_t size, const char *fmt, const unsigned long *args, int nargs) {
+    struct FormatOut out = { buf, size, 0 };
+    struct FormatArgs fa = { NULL, args, nargs, 0 };
+    format(&out, fmt, &fa);
+    return out.len;
+}
+
+int kprintf(const char *fmt, ...) {
+    char buf[KPRINTF_BUF_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = kvsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    unsigned long flags = spin_lock_irqsave(&console_lock);
+    for (char *p = buf; *p != '\0'; p++) {
+        if (*p == '\n' && (p == buf || p[-1] != '\r')) uart_putc('\r');
+        uart_putc(*p);
+    }
+    spin_unlock_irqrestore(&console_lock, flags);
+    return len;
+}
@@ -1,34 +1,32 @@
 #include "mailbox.h"
+#include "mmu.h"
+#include "klog.h"
 
 unsigned int mailbox_call(volatile unsigned int *mbox, unsigned char channel) {
-    uart_puts("[mailbox_call] called with channel: ");
-    uart_hex(channel);
-    uart_puts(" and mbox: ");
-    uart_hex((unsigned long)mbox);
-    uart_puts("\r\n");
+    klog_debug("mailbox_call: channel %u, mbox %p", channel, mbox);
     
     unsigned int msg = ((unsigned int)((unsigned long)mbox) & ~0xF) | (channel & 0xF);
+    // The GPU reads and writes the buffer behind the data cache
+    dcache_clean_inval_range((void*)mbox, mbox[0]);
+
     do { asm volatile("nop"); } while (*MAILBOX_STATUS & MAILBOX_FULL);
     *MAILBOX_WRITE = msg;
 
     do { asm volatile("nop");  } while (*MAILBOX_STATUS & MAILBOX_EMPTY);
     unsigned int res = *MAILBOX_READ;
+    dcache_clean_inval_range((void*)mbox, mbox[0]);
 
     if (msg == res) {
         if (mbox[1] & REQUEST_SUCCEED) {
             return 1;
         }
         else {
-            uart_puts("[Error] Mailbox request failed: ");
-            uart_hex(mbox[1]);
-            uart_puts("\r\n");
+            klog_err("mailbox_call: request failed: 0x%x", mbox[1]);
             return 0;
         }
     }
     else {
-        uart_puts("[Error] Mailbox response mismatch: ");
-        uart_hex(res);
-        uart_puts("\r\n");
+        klog_err("mailbox_call: response mismatch: 0x%x", res);
         return 0;
     }
 }
\ No newline at end of file
@@ -8,6 +8,11 @@
 #include "syscall.h"
 #include "exec.h"
 #include "fs_vfs.h"
+#include "smp.h"
+#include "vdso.h"
+#include "softirq.h"
+#include "pl011.h"
+#include "klog.h"
 
 extern char *__stack_top;
 extern uint32_t cpio_addr;
@@ -126,7 +131,9 @@ void test_syscall() {
     // _exec();
 
     /******** Fork ********/
-    struct ThreadTask* new_thread = thread_create(fork_test);
+    struct ThreadTask* new_thread = thread_create_on(fork_test, get_cpu_id());  // Entered directly below
+    thread_create_user_space(new_thread);
+    switch_mm(new_thread);
 
     asm volatile(
         "msr tpidr_el1, %0\n"
@@ -143,12 +150,26 @@ void test_syscall() {
     );
 }
 
-// Create a shell thread that run in EL0
+/**
+ * create_shell_thread - Start the shell on this core
+ *
+ * The shell runs at EL1 on its kernel stack: its commands call into the
+ * kernel directly (locks, `kprintf`, the allocators, the blocking UART
+ * reads), which read system registers that trap at EL0. It still has a user
+ * address space so that `exec`, a system call, can replace it with a
+ * program running at EL0.
+ */
 void create_shell_thread() {
-    struct ThreadTask* new_thread = thread_create(shell);
+    struct ThreadTask* new_thread = thread_create_on(shell, get_cpu_id());  // Entered directly below
+    if (thread_create_user_space(new_thread) != 0) {
+        uart_puts("Failed to create the address space of the shell!\n");
+        return;
+    }
+    switch_mm(new_thread);
+
     asm volatile(
         "msr tpidr_el1, %0\n"
-        "mov x5, 0x0\n"
+        "mov x5, 0x5\n"           // EL1h with interrupts enabled
         "msr spsr_el1, x5\n"
         "msr elr_el1, %1\n"
         "msr sp_el0, %2\n"
@@ -495,11 +516,18 @@ void main() {
 
     vfs_init();
 
+    uart_irq_init();
     enable_irq_el1();
 
     sched_init();
+    softirq_init();
+    klog_init();
 
     timer_init();
+    vdso_init();
+    pl011_init();
+
+    smp_init();
 
     // run_tmpfs_test_suite();
     // run_mount_tests();
@@ -1,7 +1,48 @@
 #include "mm.h"
+#include "kprintf.h"
+#include "smp.h"
 
-struct PageInfo *free_list[MAX_ORDER];  // An array of double linked lists, where each index corresponds to a different order of blocks
+unsigned int free_list[MAX_ORDER];  // An array of double linked lists of page numbers, where each index corresponds to a different order of blocks
 struct PageInfo page_list[PAGE_NUM]; // Array to store the status of each page
+static unsigned long block_ready[(MAX_BLOCK_NUM + 63) / 64];  // Max-order blocks whose descriptors are all initialised
+static unsigned int free_orders;  // Bit `o` is set while `free_list[o]` is not empty
+static unsigned long free_count[MAX_ORDER];  // Number of free blocks of each order
+
+/**
+ * Free bitmaps
+ *   One per order, bit `idx >> order` is set while the block of that order
+ *   starting at page `idx` is in the free list. A set bit is all `_free`
+ *   needs to know about a buddy, so finding one that cannot be merged costs
+ *   a single word that is shared with the neighbouring blocks.
+ */
+#define FREE_MAP_WORDS  (2 * PAGE_NUM / 64 + MAX_ORDER)  // Enough for the bitmaps of all orders
+static unsigned long free_map_bits[FREE_MAP_WORDS];
+static unsigned long *free_map[MAX_ORDER];
+
+/**
+ * Per-CPU page lists
+ *   Each core keeps a few free order-0 pages of its own, so most single page
+ *   allocations and frees never take `zone_lock`. A list has its own lock,
+ *   which is only contended when a failed higher-order allocation drains
+ *   all the lists back to the buddy allocator (`pcp_drain_all`), and is
+ *   taken before `zone_lock`. Frees push to the front, the hot end
+ *   that allocations pop from; refills from the buddy allocator go to the
+ *   back, the cold end that is drained first. The pages are linked through
+ *   `prev`/`next` like in the free lists and carry `PG_PCP`.
+ */
+#define PCP_HIGH        96  // A free that finds this many pages drains `PCP_BATCH` of them
+#define PCP_LOW         4   // An allocation that finds fewer pages refills `PCP_BATCH`
+#define PCP_BATCH       32
+
+struct PerCpuPages {
+    spinlock_t lock;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int count;
+} __attribute__((aligned(64)));
+
+static struct PerCpuPages pcp_lists[NR_CPUS];
+static spinlock_t zone_lock = SPINLOCK_INIT;  // Guards `free_list` and the order/list fields of `page_list`
 
 void *memory_start = NULL;
 
@@ -27,6 +68,11 @@ int get_buddy(int idx, int order) {
     return idx ^ (1 << order);
 }
 
+static inline int block_is_free(unsigned int idx, int order) {
+    unsigned int bit = idx >> order;
+    return (free_map[order][bit / 64] >> (bit % 64)) & 1;
+}
+
 int get_lsb(int x) {
     int lsb = 0;
     while (x > 1) {
@@ -37,138 +83,302 @@ int get_lsb(int x) {
 }
 
 void print_add_msg(int idx, int order) {
-    uart_puts("[+] Add page ");
-    uart_puts(itoa(idx));
-    uart_puts(" to order ");
-    uart_puts(itoa(order));
-    uart_puts(".\t\tRange of page: [");
-    uart_puts(itoa(idx));
-    uart_puts(", ");
-    uart_puts(itoa(idx + (1 << order) - 1));
-    uart_puts("]\r\n");
+    kprintf("[+] Add page %d to order %d.\t\tRange of page: [%d, %d]\r\n", idx, order, idx, idx + (1 << order) - 1);
 }
 
 void print_rm_msg(int idx, int order) {
-    uart_puts("[-] Remove page ");
-    uart_puts(itoa(idx));
-    uart_puts(" from order ");
-    uart_puts(itoa(order));
-    uart_puts(".\tRange of page: [");
-    uart_puts(itoa(idx));
-    uart_puts(", ");
-    uart_puts(itoa(idx + (1 << order) - 1));
-    uart_puts("]\r\n");
+    kprintf("[-] Remove page %d from order %d.\tRange of page: [%d, %d]\r\n", idx, order, idx, idx + (1 << order) - 1);
 }
 
 void print_alloc_page_msg(void* addr, int idx, int order) {
-    uart_puts("[Page] Allocated page ");
-    uart_puts(itoa(idx));
-    uart_puts(" at address ");
-    uart_hex((unsigned long)addr);
-    uart_puts(" with order ");
-    uart_puts(itoa(order));
-    uart_puts("\r\n\r\n");
+    kprintf("[Page] Allocated page %d at address %p with order %d\r\n\r\n", idx, addr, order);
 }
 
 void print_free_page_msg(void* addr, int idx, int curr_idx, int order) {
-    uart_puts("[Page] Freed page ");
-    uart_puts(itoa(idx));
-    uart_puts(" at address ");
-    uart_hex((unsigned long)addr);
-    uart_puts(". Add back to free list in order ");
-    uart_puts(itoa(order));
     if (curr_idx != -1) {
-        uart_puts(", page ");
-        uart_puts(itoa(curr_idx));
+        kprintf("[Page] Freed page %d at address %p. Add back to free list in order %d, page %d\r\n\r\n", idx, addr, order, curr_idx);
+    }
+    else {
+        kprintf("[Page] Freed page %d at address %p. Add back to free list in order %d\r\n\r\n", idx, addr, order);
     }
-    uart_puts("\r\n\r\n");
 }
 
 void print_free_list() {
     uart_puts("========== Free List ==========\n");
     for (int i = 0; i < MAX_ORDER; i++) {
-        struct PageInfo *entry = free_list[i];
+        unsigned int idx = free_list[i];
         int cnt = 0;
-        uart_puts("Order ");
-        uart_puts(itoa(i));
-        uart_puts(": ");
-        while (entry != NULL) {
+        kprintf("Order %d: ", i);
+        while (idx != PAGE_NONE) {
             cnt++;
-            uart_puts(itoa(entry->idx));
-            uart_puts(" -> ");
-            entry = entry->next;
+            kprintf("%u -> ", idx);
+            idx = page_list[idx].next;
         }
-        uart_puts("NULL\t[");
-        uart_puts(itoa(cnt));
-        uart_puts("]\r\n");
+        kprintf("NULL\t[%d]\r\n", cnt);
     }
     uart_puts("===============================\r\n\r\n");
 }
 
+/**
+ * print_buddy_stats - Print the free blocks per order
+ *
+ * `unusable` is the share of the free memory that sits in blocks too small
+ * for a request of that order, a measure of the external fragmentation.
+ */
+void print_buddy_stats() {
+    unsigned long count[MAX_ORDER];
+    unsigned long free_pages = 0;
+
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    for (int i = 0; i < MAX_ORDER; i++) {
+        count[i] = free_count[i];
+        free_pages += count[i] << i;
+    }
+    spin_unlock_irqrestore(&zone_lock, flags);
+
+    kprintf("Order %10s %10s %9s\r\n", "Blocks", "Pages", "Unusable");
+    unsigned long below = 0;  // Free pages in blocks of a lower order
+    for (int i = 0; i < MAX_ORDER; i++) {
+        unsigned long permille = free_pages ? below * 1000 / free_pages : 0;
+        kprintf("%5d %10lu %10lu %5lu.%lu%%\r\n", i, count[i], count[i] << i, permille / 10, permille % 10);
+        below += count[i] << i;
+    }
+    unsigned long pcp_pages = 0;
+    kprintf("Per-CPU:");
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        kprintf(" cpu%d %u", cpu, pcp_lists[cpu].count);
+        pcp_pages += pcp_lists[cpu].count;
+    }
+    kprintf("\r\nFree: %lu of %d pages\r\n", free_pages + pcp_pages, PAGE_NUM);
+}
+
 // Add the entry to the front of the free list for the given order
 void add_to_free_list(struct PageInfo *entry, int order) {
     if (entry == NULL || order < 0 || order >= MAX_ORDER) return;
-    if (free_list[order] == NULL) {
-        free_list[order] = entry;
-        entry->next = NULL;
-        entry->prev = NULL;
-    }
-    else {
-        free_list[order]->prev = entry;
-        entry->prev = NULL;
-        entry->next = free_list[order];
-        free_list[order] = entry;
+    unsigned int idx = entry - page_list;
+    entry->prev = PAGE_NONE;
+    entry->next = free_list[order];
+    if (free_list[order] != PAGE_NONE) {
+        page_list[free_list[order]].prev = idx;
     }
+    free_list[order] = idx;
+    entry->order = order;
 
-    // print_add_msg(entry->idx, order);
+    unsigned int bit = idx >> order;
+    free_map[order][bit / 64] |= 1UL << (bit % 64);
+    free_orders |= 1U << order;
+    free_count[order]++;
+
+    // print_add_msg(idx, order);
 }
 
 void rm_from_free_list(struct PageInfo *entry, int order) {
     if (entry == NULL || order < 0 || order >= MAX_ORDER) return;
-    if (free_list[order] == entry) {  // At the front
+    unsigned int idx = entry - page_list;
+    if (!block_is_free(idx, order)) return;  // Not in the free list
+    if (entry->prev == PAGE_NONE) {  // At the front
         free_list[order] = entry->next;
-        if (entry->next != NULL) {
-            entry->next->prev = NULL;
-        }
     }
-    else {  // In the middle
-        if (entry->prev != NULL) entry->prev->next = entry->next;
-        if (entry->next != NULL) entry->next->prev = entry->prev;
+    else {
+        page_list[entry->prev].next = entry->next;
     }
+    if (entry->next != PAGE_NONE) {
+        page_list[entry->next].prev = entry->prev;
+    }
+
+    entry->next = PAGE_NONE;
+    entry->prev = PAGE_NONE;
 
-    entry->next = NULL;
-    entry->prev = NULL;
-    // simple_free(buddy_entry);  // TODO: Maybe used a circular linked list to do simple_alloc and simple_free
+    unsigned int bit = idx >> order;
+    free_map[order][bit / 64] &= ~(1UL << (bit % 64));
+    if (free_list[order] == PAGE_NONE) free_orders &= ~(1U << order);
+    free_count[order]--;
 
-    // print_rm_msg(entry->idx, order);
+    // print_rm_msg(idx, order);
+}
+
+/**
+ * init_block - Set up the descriptors of a max-order block before it is used
+ *
+ * Runs when the block is first split, allocated whole or reserved. Until
+ * then only the head descriptor is used, so `mm_init` leaves the rest
+ * alone. The pages inside get `order` -1, which `_free` and `free` reject.
+ * Called with `zone_lock` held, or before the other cores are up.
+ */
+static void init_block(unsigned int idx) {
+    unsigned int blk = idx / MAX_BLOCK_SIZE;
+    if (block_ready[blk / 64] & (1UL << (blk % 64))) return;
+    block_ready[blk / 64] |= 1UL << (blk % 64);
+
+    struct PageInfo *page = page_list + blk * MAX_BLOCK_SIZE;
+    for (int i = 1; i < MAX_BLOCK_SIZE; i++) {
+        page[i].prev = PAGE_NONE;
+        page[i].next = PAGE_NONE;
+        atomic_set(&page[i].refcount, 0);
+        page[i].order = -1;
+        page[i].slab_cache = -1;
+        page[i].flags = 0;
+    }
 }
 
 void mm_init() {
-    // Initialize the free list
+    // Initialize the free list and carve the free bitmaps
+    unsigned long *map = free_map_bits;
     for (int i = 0; i < MAX_ORDER; i++) {
-        free_list[i] = NULL;
+        free_list[i] = PAGE_NONE;
+        free_map[i] = map;
+        map += ((PAGE_NUM >> i) + 63) / 64;
+    }
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        spin_lock_init(&pcp_lists[cpu].lock);
+        pcp_lists[cpu].head = PAGE_NONE;
+        pcp_lists[cpu].tail = PAGE_NONE;
     }
 
-    // Allocate the frame array
     memory_start = 0x00000000;  // TODO: For testing
-    memset(page_list, 0, sizeof(page_list));
 
-    // Initialize the free list and page list
-    for (int i=0; i<PAGE_NUM; i+=MAX_BLOCK_SIZE) {
+    // One max-order block per head, the descriptors inside are set up lazily by `init_block`
+    for (int i = 0; i < PAGE_NUM; i += MAX_BLOCK_SIZE) {
         struct PageInfo *entry = page_list + i;
-        entry->idx = i;
+        atomic_set(&entry->refcount, 0);
+        entry->slab_cache = -1;
+        entry->flags = 0;
         add_to_free_list(entry, MAX_ORDER - 1);  // Add to the free list with the maximum order
-        
-        page_list[i].order = MAX_ORDER - 1;
-        // page_list[i].allocated = 0;  // Mark as free
-        page_list[i].entry_in_list = entry;  // Link to the free list entry
     }
 
-    for (int i=0; i<PAGE_NUM; i++) page_list[i].cache_order = -1;
-
     // print_free_list();
 }
 
+// Take a block of `order` out of the free lists, called with `zone_lock` held
+static unsigned int rmqueue(int order) {
+    // The lowest non-empty order that is big enough
+    unsigned int avail = free_orders & ~((1U << order) - 1);
+    if (avail == 0) return PAGE_NONE;
+    int i = __builtin_ctz(avail);
+
+    unsigned int idx = free_list[i];
+    struct PageInfo *block = page_list + idx;
+    rm_from_free_list(block, i);  // Remove from the free list
+    if (i == MAX_ORDER - 1) init_block(idx);
+
+    // Found a block in higher order, split it into smaller blocks
+    while (i > order) {
+        i--;
+        add_to_free_list(block + (1 << i), i);
+    }
+    block->order = order;
+    return idx;
+}
+
+// Give a block back to the free lists, merging it with its buddies. Called with `zone_lock` held
+static void free_one(unsigned int idx, int order) {
+    // Merge with the buddy block while it is free, its bit is only set if it has the same order
+    while (order < MAX_ORDER - 1) {
+        unsigned int buddy_idx = get_buddy(idx, order);
+        if (!block_is_free(buddy_idx, order)) break;
+
+        rm_from_free_list(page_list + buddy_idx, order);
+
+        page_list[idx > buddy_idx ? idx : buddy_idx].order = -1;
+        idx = idx < buddy_idx ? idx : buddy_idx;
+        order++;
+    }
+    add_to_free_list(page_list + idx, order);
+}
+
+static void pcp_push_back(struct PerCpuPages *pcp, unsigned int idx) {
+    struct PageInfo *page = page_list + idx;
+    page->flags |= PG_PCP;
+    page->next = PAGE_NONE;
+    page->prev = pcp->tail;
+    if (pcp->tail != PAGE_NONE) page_list[pcp->tail].next = idx;
+    else pcp->head = idx;
+    pcp->tail = idx;
+    pcp->count++;
+}
+
+static void pcp_push_front(struct PerCpuPages *pcp, unsigned int idx) {
+    struct PageInfo *page = page_list + idx;
+    page->flags |= PG_PCP;
+    page->prev = PAGE_NONE;
+    page->next = pcp->head;
+    if (pcp->head != PAGE_NONE) page_list[pcp->head].prev = idx;
+    else pcp->tail = idx;
+    pcp->head = idx;
+    pcp->count++;
+}
+
+static void pcp_unlink(struct PerCpuPages *pcp, unsigned int idx) {
+    struct PageInfo *page = page_list + idx;
+    if (page->prev != PAGE_NONE) page_list[page->prev].next = page->next;
+    else pcp->head = page->next;
+    if (page->next != PAGE_NONE) page_list[page->next].prev = page->prev;
+    else pcp->tail = page->prev;
+    page->prev = PAGE_NONE;
+    page->next = PAGE_NONE;
+    page->flags &= ~PG_PCP;
+    pcp->count--;
+}
+
+// Pop a page from the list of this core, refilling it first when it runs low
+static unsigned int pcp_alloc() {
+    unsigned long flags = local_irq_save();
+    struct PerCpuPages *pcp = &pcp_lists[get_cpu_id()];
+    spin_lock(&pcp->lock);
+
+    if (pcp->count < PCP_LOW) {
+        spin_lock(&zone_lock);
+        for (int i = 0; i < PCP_BATCH; i++) {
+            unsigned int idx = rmqueue(0);
+            if (idx == PAGE_NONE) break;
+            pcp_push_back(pcp, idx);
+        }
+        spin_unlock(&zone_lock);
+    }
+
+    unsigned int idx = pcp->head;
+    if (idx != PAGE_NONE) pcp_unlink(pcp, idx);
+    spin_unlock(&pcp->lock);
+    local_irq_restore(flags);
+    return idx;
+}
+
+// Push a page to the list of this core, draining the cold end once it is too long
+static void pcp_free(unsigned int idx) {
+    unsigned long flags = local_irq_save();
+    struct PerCpuPages *pcp = &pcp_lists[get_cpu_id()];
+    spin_lock(&pcp->lock);
+    pcp_push_front(pcp, idx);
+
+    if (pcp->count >= PCP_HIGH) {
+        spin_lock(&zone_lock);
+        for (int i = 0; i < PCP_BATCH; i++) {
+            unsigned int cold = pcp->tail;
+            pcp_unlink(pcp, cold);
+            free_one(cold, 0);
+        }
+        spin_unlock(&zone_lock);
+    }
+    spin_unlock(&pcp->lock);
+    local_irq_restore(flags);
+}
+
+// Give the pages of every core's list back to the buddy allocator, so they can merge again
+static void pcp_drain_all() {
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct PerCpuPages *pcp = &pcp_lists[cpu];
+        unsigned long flags = spin_lock_irqsave(&pcp->lock);
+        spin_lock(&zone_lock);
+        while (pcp->tail != PAGE_NONE) {
+            unsigned int cold = pcp->tail;
+            pcp_unlink(pcp, cold);
+            free_one(cold, 0);
+        }
+        spin_unlock(&zone_lock);
+        spin_unlock_irqrestore(&pcp->lock, flags);
+    }
+}
+
 void* _alloc(unsigned int size) {
     if (size == 0 || size > MAX_ALLOC_SIZE) {
         uart_puts("The requested size is invalid!\n");
@@ -180,35 +390,32 @@ void* _alloc(unsigned int size) {
     // Calculate the order of the block
     int order = get_order(size);
 
-    // Find a free block of the required size
-    for (int i = order; i < MAX_ORDER; i++) {
-        if (free_list[i] != NULL) {
-            struct PageInfo *block = free_list[i];
-            rm_from_free_list(block, i);  // Remove from the free list          
-
-            // Found a block in higher order, split it into smaller blocks
-            while (i > order) {
-                i--;
-                struct PageInfo *new_entry = block + (1 << i);
-                new_entry->idx = block->idx + (1 << i);
-                add_to_free_list(new_entry, i);
-
-                page_list[new_entry->idx].order = i;
-                page_list[new_entry->idx].entry_in_list = new_entry;  // Link to the free list entry
-            }
-
-            // Mark the block as allocated
-            page_list[block->idx].order = order;
-            // page_list[block->idx].allocated = 1;  // Mark as allocated
-            page_list[block->idx].entry_in_list = NULL;  // Unlink from the free list
-            
-            void *addr = memory_start + block->idx * PAGE_SIZE;
-            // print_alloc_page_msg(addr, block->idx, order);
-            // print_free_list();
-            return addr;
+    // Single pages come from the list of this core
+    unsigned int idx;
+    if (order == 0) {
+        idx = pcp_alloc();
+    }
+    else {
+        unsigned long flags = spin_lock_irqsave(&zone_lock);
+        idx = rmqueue(order);
+        spin_unlock_irqrestore(&zone_lock, flags);
+
+        if (idx == PAGE_NONE) {  // Free pages may be stranded on the per-CPU lists, retry once without them
+            pcp_drain_all();
+            flags = spin_lock_irqsave(&zone_lock);
+            idx = rmqueue(order);
+            spin_unlock_irqrestore(&zone_lock, flags);
         }
     }
-    return NULL;  // No suitable block found
+    if (idx == PAGE_NONE) return NULL;  // No suitable block found
+
+    // Mark the block as allocated
+    atomic_set(&page_list[idx].refcount, 1);
+
+    void *addr = memory_start + (unsigned long)idx * PAGE_SIZE;
+    // print_alloc_page_msg(addr, idx, order);
+    // print_free_list();
+    return addr;
 }
 
 void _free(void *ptr) {
@@ -217,86 +424,25 @@ void _free(void *ptr) {
     int original_idx = (ptr - memory_start) / PAGE_SIZE;
 
     // Check if the pointer is valid
-    if (original_idx < 0 || original_idx >= PAGE_NUM || page_list[original_idx].entry_in_list != NULL) {
+    if (original_idx < 0 || original_idx >= PAGE_NUM) return;
+
+    struct PageInfo *page = page_list + original_idx;
+    if (page->order == 0) {
+        if ((page->flags & PG_PCP) || block_is_free(original_idx, 0)) return;  // Already free
+        pcp_free(original_idx);
         return;
     }
 
-    // Merge with the buddy block if it is free
-    int order = page_list[original_idx].order;
-    int curr_idx = original_idx, buddy_idx = get_buddy(original_idx, order);
-    int smaller_idx = -1, bigger_idx = -1;
-    int have_merged = 0;
-    
-    while (order < MAX_ORDER - 1) {
-        struct PageInfo *buddy_entry = page_list[buddy_idx].entry_in_list;
-
-        // uart_puts("[*] buddy idx: ");
-        // if (buddy_entry != NULL) uart_puts(itoa(buddy_entry->idx));
-        // else uart_puts("NULL");
-        // uart_puts(" for page ");
-        // uart_puts(itoa(curr_idx));
-        // uart_puts(" with order ");
-        // uart_puts(itoa(order));
-        // uart_puts("\r\n");
-
-        if (buddy_entry && page_list[buddy_idx].order == page_list[curr_idx].order) {  // Have buddy
-            // uart_puts("[*] Buddy found! buddy idx: ");
-            // uart_puts(itoa(buddy_entry->idx));
-            // uart_puts(" for page ");
-            // uart_puts(itoa(curr_idx));
-            // uart_puts(" with order ");
-            // uart_puts(itoa(order));
-            // uart_puts("\r\n");
-
-            // rm_from_free_list(page_list[curr_idx].entry_in_list, order);
-            rm_from_free_list(buddy_entry, order);
-
-            bigger_idx = curr_idx > buddy_idx ? curr_idx : buddy_idx;
-            smaller_idx = curr_idx < buddy_idx ? curr_idx : buddy_idx;
-
-            order++;
-
-            // Add the merged block to the free list
-            // struct Block *new_entry = (struct Block*)simple_alloc(sizeof(struct Block));
-            // new_entry->idx = smaller_idx;
-            // add_to_free_list(new_entry, order);
-
-            // Update the page list
-            // page_list[smaller_idx].allocated = 0;
-            // page_list[bigger_idx].allocated = 0;
-            page_list[smaller_idx].order = order;
-            page_list[bigger_idx].order = -1;
-            // page_list[smaller_idx].entry_in_list = new_entry;
-            page_list[bigger_idx].entry_in_list = NULL;
-
-            curr_idx = smaller_idx;
-            buddy_idx = get_buddy(curr_idx, order);
-
-            // have_merged = 1;
-        }
-        else {
-            struct PageInfo *new_entry = page_list + curr_idx;
-            new_entry->idx = curr_idx;
-            add_to_free_list(new_entry, order);
-
-            page_list[curr_idx].entry_in_list = new_entry;  // Link to the free list entry
-            page_list[curr_idx].order = order;  // Update the order
-            // page_list[curr_idx].allocated = 0;  // Mark as free
-            break;
-        }
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    int order = page->order;
+    if (order < 0 || block_is_free(original_idx, order)) {  // Not the start of a block, or already free
+        spin_unlock_irqrestore(&zone_lock, flags);
+        return;
     }
+    free_one(original_idx, order);
+    spin_unlock_irqrestore(&zone_lock, flags);
 
-    // if (!have_merged) {
-    //     struct Block *new_entry = (struct Block*)simple_alloc(sizeof(struct Block));
-    //     new_entry->idx = curr_idx;
-    //     add_to_free_list(new_entry, order);
-
-    //     page_list[curr_idx].entry_in_list = new_entry;  // Link to the free list entry
-    //     page_list[curr_idx].order = order;  // Update the order
-    //     page_list[curr_idx].allocated = 0;  // Mark as free
-    // }
-
-    // print_free_page_msg(ptr, original_idx, curr_idx, order);
+    // print_free_page_msg(ptr, original_idx, original_idx, order);
     // print_free_list();
 }
 
@@ -304,20 +450,11 @@ void split(unsigned int idx, unsigned int order) {
     if (order >= MAX_ORDER) return;
     struct PageInfo *entry = page_list + idx;
     rm_from_free_list(entry, order);
-    page_list[idx].entry_in_list = NULL;
+    if (order == MAX_ORDER - 1) init_block(idx);
 
     order--;
-    entry->idx = idx;
-    entry->order = order;
     add_to_free_list(entry, order);
-    page_list[idx].entry_in_list = entry;
-
-    int buddy_idx = get_buddy(idx, order);
-    struct PageInfo *buddy_entry = page_list + buddy_idx;
-    buddy_entry->idx = buddy_idx;
-    buddy_entry->order = order;
-    add_to_free_list(buddy_entry, order);
-    page_list[buddy_idx].entry_in_list = buddy_entry;
+    add_to_free_list(page_list + get_buddy(idx, order), order);
 }
 
 void reserve(void *start, void *end) {
@@ -354,7 +491,7 @@ void reserve(void *start, void *end) {
             // uart_puts(itoa(curr_order));
             // uart_puts("\r\n");
 
-            if (page_list[start_block_idx].order == curr_order) {
+            if (block_is_free(start_block_idx, curr_order)) {
                 split(start_block_idx, curr_order);
             }
         }
@@ -369,10 +506,10 @@ void reserve(void *start, void *end) {
             // uart_puts(itoa(curr_order));
             // uart_puts("\r\n");
 
-            if (page_list[start_block_idx].order == curr_order) {
+            if (block_is_free(start_block_idx, curr_order)) {
                 split(start_block_idx, curr_order);
             }
-            if (page_list[end_block_idx].order == curr_order) {
+            if (block_is_free(end_block_idx, curr_order)) {
                 split(end_block_idx, curr_order);
             }
             // split(start_block_idx, curr_order);
@@ -383,14 +520,52 @@ void reserve(void *start, void *end) {
     // Reserve the page
     for (int i=start_idx; i<=end_idx;) {
         struct PageInfo *entry = page_list + i;
-        if (page_list[i].entry_in_list != NULL) {
-            rm_from_free_list(entry, entry->order);
-            page_list[i].entry_in_list = NULL;
+        if (entry->order < 0) {  // Inside a block that is already in use
+            i++;
+            continue;
         }
+        rm_from_free_list(entry, entry->order);
+        if (entry->order == MAX_ORDER - 1) init_block(i);
         // uart_puts(itoa(entry->order));
         // uart_puts("\r\n");
         i += (1 << entry->order);
     }
 
     // print_free_list();
-}
\ No newline at end of file
+}
+
+// Return the entry of the page that `ptr` points to, or NULL if it is not managed by the buddy system
+static struct PageInfo* get_page_info(void *ptr) {
+    if (ptr < memory_start) return NULL;
+    unsigned long idx = (ptr - memory_start) / PAGE_SIZE;
+    if (idx >= PAGE_NUM) return NULL;
+    return page_list + idx;
+}
+
+/**
+ * get_page - Take another reference to an allocated page
+ *
+ * Used when a page is mapped into one more address space (e.g. shared by
+ * `fork`). Pages outside of the RAM (MMIO, framebuffer) are ignored.
+ */
+void get_page(void *ptr) {
+    struct PageInfo *page = get_page_info(ptr);
+    if (page == NULL) return;
+    atomic_inc(&page->refcount);
+}
+
+// Drop a reference to a page, the page is freed when the last user is gone
+void put_page(void *ptr) {
+    struct PageInfo *page = get_page_info(ptr);
+    if (page == NULL) return;
+    if (atomic_dec_return(&page->refcount) <= 0) {
+        atomic_set(&page->refcount, 0);
+        _free(ptr);
+    }
+}
+
+int page_ref_count(void *ptr) {
+    struct PageInfo *page = get_page_info(ptr);
+    if (page == NULL) return 0;
+    return atomic_read(&page->refcount);
+}
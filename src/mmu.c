@@ -0,0 +1,404 @@
+#include "mmu.h"
+#include "mm.h"
+#include "string.h"
+#include "smp.h"
+#include "spinlock.h"
+
+extern char __rodata_end[];
+
+unsigned long kernel_pgd[PTRS_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));
+static unsigned long kernel_pud[PTRS_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));
+static unsigned long kernel_pmd[PTRS_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));
+static unsigned long kernel_pte[PTRS_PER_TABLE] __attribute__((aligned(PAGE_SIZE)));  // First 2MB, holds the kernel image
+
+static unsigned long asid_bits = 8;
+static unsigned long asid_generation = 1UL << ASID_MAX_BITS;
+static unsigned long next_asid = 1;  // ASID 0 is used by the kernel threads
+static unsigned long active_asids[NR_CPUS];    // ASID each core runs with right now
+static unsigned long reserved_asids[NR_CPUS];  // Active ASIDs when the last generation started
+static unsigned long tlb_flush_pending;        // Cores that must flush their TLB before the next switch
+static spinlock_t asid_lock = SPINLOCK_INIT;
+
+static unsigned long mmu_enable();
+
+/**
+ * mmu_init - Build the identity map of the kernel and turn on the MMU and caches
+ *
+ * Called from `boot.S` after the BSS is cleared and before `main`, so all the
+ * tables are static and nothing here may depend on the allocators.
+ *
+ *   PGD[0] -> PUD[0] -> PMD: 0 - 1GB in 2MB blocks (the first 2MB uses 4KB pages)
+ *          -> PUD[1]       : 1GB block for the ARM local peripherals
+ */
+void mmu_init() {
+    unsigned long addr;
+
+    // First 2MB: 4KB pages so that the kernel text can be mapped read-only and executable
+    for (int i = 0; i < PTRS_PER_TABLE; i++) {
+        addr = (unsigned long)i << PAGE_SHIFT;
+        if (addr >= 0x80000 && addr < (unsigned long)__rodata_end) {
+            kernel_pte[i] = addr | PD_KERNEL_TEXT | PD_PAGE;
+        }
+        else {
+            kernel_pte[i] = addr | PD_KERNEL_DATA | PD_PAGE;
+        }
+    }
+
+    // 0 - 1GB: 2MB blocks
+    kernel_pmd[0] = (unsigned long)kernel_pte | PD_TABLE;
+    for (int i = 1; i < PTRS_PER_TABLE; i++) {
+        addr = (unsigned long)i << PMD_SHIFT;
+        if (addr < RAM_END) {
+            kernel_pmd[i] = addr | PD_KERNEL_DATA | PD_BLOCK;
+        }
+        else if (addr < GPU_MEM_END) {
+            kernel_pmd[i] = addr | PD_KERNEL_NOCACHE | PD_BLOCK;
+        }
+        else {
+            kernel_pmd[i] = addr | PD_KERNEL_DEVICE | PD_BLOCK;
+        }
+    }
+
+    kernel_pud[0] = (unsigned long)kernel_pmd | PD_TABLE;
+    kernel_pud[1] = PERIPHERAL_END | PD_KERNEL_DEVICE | PD_BLOCK;  // 1GB - 2GB
+    kernel_pgd[0] = (unsigned long)kernel_pud | PD_TABLE;
+
+    asid_bits = mmu_enable();
+}
+
+/**
+ * mmu_init_secondary - Turn on the MMU and caches of a secondary core
+ *
+ * Runs on the kernel map that core 0 built in `mmu_init`. Called from
+ * `secondary_start` with the MMU off, so it must not touch any global data.
+ */
+void mmu_init_secondary() {
+    mmu_enable();
+}
+
+// Program the translation registers of this core and enable the MMU, returns the ASID size
+static unsigned long mmu_enable() {
+    // ID_AA64MMFR0_EL1.ASIDBits [7:4]: 0b0010 means 16-bit ASID is supported
+    unsigned long tcr = TCR_VALUE;
+    unsigned long bits = 8;
+    unsigned long mmfr0;
+    asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    if (((mmfr0 >> 4) & 0xf) == 0b0010) {
+        bits = 16;
+        tcr |= TCR_AS;
+    }
+
+    asm volatile(
+        "msr mair_el1, %0\n"
+        "msr tcr_el1, %1\n"
+        "msr ttbr0_el1, %2\n"
+        "dsb ish\n"
+        "tlbi vmalle1\n"
+        "ic iallu\n"
+        "dsb ish\n"
+        "isb\n"
+        :
+        : "r"((unsigned long)MAIR_VALUE), "r"(tcr), "r"(kernel_pgd)
+        : "memory"
+    );
+
+    asm volatile(
+        "msr sctlr_el1, %0\n"
+        "isb\n"
+        :
+        : "r"((unsigned long)SCTLR_VALUE)
+        : "memory"
+    );
+
+    return bits;
+}
+
+/**
+ * dcache_clean_inval_range - Write back and invalidate the data cache lines of a buffer
+ *
+ * Needed around handing a buffer to a non-coherent master (e.g. the VideoCore
+ * through the mailbox), which accesses the memory behind the cache. `dc civac`
+ * is used for both directions because the shell calls this at EL0, where
+ * `dc ivac` is not available.
+ */
+void dcache_clean_inval_range(void *start, unsigned long size) {
+    unsigned long addr = (unsigned long)start & ~(CACHE_LINE_SIZE - 1);
+    unsigned long end = (unsigned long)start + size;
+    for (; addr < end; addr += CACHE_LINE_SIZE) {
+        asm volatile("dc civac, %0" : : "r"(addr) : "memory");
+    }
+    asm volatile("dsb sy" : : : "memory");
+}
+
+// Allocate a zeroed page for a translation table
+static unsigned long* alloc_table() {
+    unsigned long *table = (unsigned long*)alloc(PAGE_SIZE);
+    if (table == NULL) return NULL;
+    memset(table, 0, PAGE_SIZE);
+    return table;
+}
+
+/**
+ * pgd_alloc - Create the root table of a new address space
+ *
+ * The kernel identity map is shared through PGD[0], so only the user part
+ * (PGD[1] and above) is private to the process.
+ */
+unsigned long* pgd_alloc() {
+    unsigned long *pgd = alloc_table();
+    if (pgd == NULL) {
+        uart_puts("[WARN] pgd_alloc: failed to allocate page table\r\n");
+        return NULL;
+    }
+    pgd[0] = kernel_pgd[0];
+    return pgd;
+}
+
+// Free the tables under `table` and drop the pages they map
+static void free_table(unsigned long *table, int level) {
+    for (int i = (level == 0) ? 1 : 0; i < PTRS_PER_TABLE; i++) {
+        if (!(table[i] & PD_VALID)) continue;
+        void *next = (void*)(table[i] & PD_ADDR_MASK);
+        if (level < 3) {
+            free_table((unsigned long*)next, level + 1);
+        }
+        else if (!(table[i] & PD_NOREF)) {
+            put_page(next);  // The page may still be shared copy-on-write
+        }
+        table[i] = 0;
+    }
+    free(table);
+}
+
+void pgd_free(unsigned long *pgd) {
+    if (pgd == NULL) return;
+    free_table(pgd, 0);
+}
+
+/**
+ * walk - Find the last-level descriptor that maps `va`
+ *
+ * @param create: Allocate the missing intermediate tables if non-zero
+ * @return Pointer to the PTE, or NULL if it does not exist (or `va` is not a user address)
+ */
+unsigned long* walk(unsigned long *pgd, unsigned long va, int create) {
+    if (pgd == NULL || va < USER_SPACE_START) return NULL;
+
+    unsigned long *table = pgd;
+    for (int level = 0; level < 3; level++) {
+        int shift = PGD_SHIFT - level * TABLE_SHIFT;
+        unsigned long *entry = &table[(va >> shift) & (PTRS_PER_TABLE - 1)];
+        if (!(*entry & PD_VALID)) {
+            if (!create) return NULL;
+            unsigned long *next = alloc_table();
+            if (next == NULL) return NULL;
+            *entry = (unsigned long)next | PD_TABLE;
+        }
+        table = (unsigned long*)(*entry & PD_ADDR_MASK);
+    }
+    return &table[(va >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1)];
+}
+
+int map_page(unsigned long *pgd, unsigned long va, unsigned long pa, unsigned long prot) {
+    unsigned long *pte = walk(pgd, va, 1);
+    if (pte == NULL) return -1;
+    *pte = (pa & PD_ADDR_MASK) | prot | PD_PAGE;
+    asm volatile("dsb ishst" : : : "memory");  // Make the descriptor visible to the table walker
+    return 0;
+}
+
+int map_pages(unsigned long *pgd, unsigned long va, unsigned long pa, unsigned long size, unsigned long prot) {
+    for (unsigned long off = 0; off < size; off += PAGE_SIZE) {
+        if (map_page(pgd, va + off, pa + off, prot) != 0) return -1;
+    }
+    return 0;
+}
+
+// Remove the mappings of [va, va + size) and drop the pages behind them
+void unmap_pages(unsigned long *pgd, unsigned long va, unsigned long size, unsigned long asid) {
+    for (unsigned long off = 0; off < size; off += PAGE_SIZE) {
+        unsigned long *pte = walk(pgd, va + off, 0);
+        if (pte == NULL || !(*pte & PD_VALID)) continue;
+        unsigned long entry = *pte;
+        *pte = 0;
+        tlb_flush_page(va + off, asid);
+        if (!(entry & PD_NOREF)) put_page((void*)(entry & PD_ADDR_MASK));
+    }
+}
+
+static int copy_table(unsigned long *dst, unsigned long *src, int level, unsigned long va) {
+    int shift = PGD_SHIFT - level * TABLE_SHIFT;
+    for (int i = (level == 0) ? 1 : 0; i < PTRS_PER_TABLE; i++) {
+        if (!(src[i] & PD_VALID)) continue;
+        unsigned long entry_va = va | ((unsigned long)i << shift);
+        if (level < 3) {
+            if (copy_table(dst, (unsigned long*)(src[i] & PD_ADDR_MASK), level + 1, entry_va) != 0) return -1;
+            continue;
+        }
+
+        // Private writable pages become read-only in both address spaces until one side writes
+        if (!(src[i] & PD_AP_RO) && !(src[i] & PD_SHARED)) {
+            src[i] |= PD_AP_RO | PD_COW;
+        }
+        unsigned long pa = src[i] & PD_ADDR_MASK;
+        if (map_page(dst, entry_va, pa, src[i] & ~PD_ADDR_MASK & ~PD_PAGE) != 0) return -1;
+        if (!(src[i] & PD_NOREF)) get_page((void*)pa);
+    }
+    return 0;
+}
+
+/**
+ * copy_user_space - Share every user page of `src` with the (empty) address space `dst`
+ *
+ * No page is copied here: private writable pages are write-protected and
+ * marked `PD_COW` on both sides, and `do_page_fault` copies them on the first
+ * write. `PD_SHARED` pages keep being shared.
+ * The caller has to flush the TLB entries of `src` afterwards, see `tlb_flush_asid`.
+ */
+int copy_user_space(unsigned long *dst, unsigned long *src) {
+    if (dst == NULL || src == NULL) return -1;
+    return copy_table(dst, src, 0, 0);
+}
+
+/**
+ * cow_fault - Give the faulting address space a private, writable copy of a COW page
+ *
+ * The last user of a shared page just takes it back as writable. A page
+ * owned by a file (`PD_NOREF`, private file mapping) is always copied. The
+ * descriptor is replaced break-before-make because the output address changes.
+ *
+ * @return 0 on success, -1 if `va` is not a copy-on-write page
+ */
+int cow_fault(unsigned long *pgd, unsigned long va, unsigned long asid) {
+    unsigned long *pte = walk(pgd, va, 0);
+    if (pte == NULL || !(*pte & PD_VALID) || !(*pte & PD_COW)) return -1;
+
+    void *old_page = (void*)(*pte & PD_ADDR_MASK);
+    int owned = !(*pte & PD_NOREF);
+    unsigned long prot = *pte & ~PD_ADDR_MASK & ~PD_PAGE & ~PD_AP_RO & ~PD_COW & ~PD_NOREF;
+
+    if (owned && page_ref_count(old_page) == 1) {
+        *pte = (unsigned long)old_page | prot | PD_PAGE;
+        tlb_flush_page(va, asid);
+        return 0;
+    }
+
+    void *new_page = alloc(PAGE_SIZE);
+    if (new_page == NULL) return -1;
+    memcpy_neon(new_page, old_page, PAGE_SIZE);
+
+    *pte = 0;
+    tlb_flush_page(va, asid);
+    map_page(pgd, va, (unsigned long)new_page, prot);
+    if (owned) put_page(old_page);
+    return 0;
+}
+
+// Invalidate every TLB entry tagged with `asid` (generation bits are ignored)
+void tlb_flush_asid(unsigned long asid) {
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi aside1is, %0\n"
+        "dsb ish\n"
+        "isb\n"
+        :
+        : "r"((asid & ASID_MASK) << TTBR_ASID_SHIFT)
+        : "memory"
+    );
+}
+
+void tlb_flush_page(unsigned long va, unsigned long asid) {
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi vae1is, %0\n"
+        "dsb ish\n"
+        "isb\n"
+        :
+        : "r"(((asid & ASID_MASK) << TTBR_ASID_SHIFT) | ((va >> PAGE_SHIFT) & 0xfffffffffffUL))
+        : "memory"
+    );
+}
+
+// Start a new generation, the ASIDs running on the cores stay valid in it
+static void new_asid_generation() {
+    asid_generation += (1UL << ASID_MAX_BITS);
+    next_asid = 1;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        reserved_asids[cpu] = active_asids[cpu];
+    }
+    tlb_flush_pending = (1UL << NR_CPUS) - 1;
+}
+
+static int asid_is_reserved(unsigned long asid) {
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        if ((reserved_asids[cpu] & ASID_MASK) == asid) return 1;
+    }
+    return 0;
+}
+
+/**
+ * get_ttbr0 - Get the TTBR0_EL1 value of an address space on this core
+ *
+ * `asid` holds the generation in the upper bits and the ASID in the lower
+ * `ASID_MAX_BITS` bits. A stale generation gets a fresh ASID. When the ASID
+ * space runs out a new generation starts: the tasks running on other cores keep
+ * their ASID (reserved until the next rollover), and every core flushes its
+ * own TLB the next time it switches, so no core has to stop the others.
+ * Kernel threads (`pgd == NULL`) run on the kernel map with ASID 0.
+ */
+unsigned long get_ttbr0(unsigned long *pgd, unsigned long *asid) {
+    unsigned int cpu = get_cpu_id();
+    unsigned long flags = spin_lock_irqsave(&asid_lock);
+
+    if (pgd != NULL && (*asid & ~ASID_MASK) != asid_generation) {
+        unsigned long old = *asid & ASID_MASK;
+        int reserved = -1;
+        for (int i = 0; old != 0 && i < NR_CPUS; i++) {
+            if (reserved_asids[i] == *asid) reserved = i;
+        }
+
+        if (reserved >= 0) {  // Was running during the rollover, keep the ASID
+            *asid = asid_generation | old;
+            reserved_asids[reserved] = *asid;
+        }
+        else {
+            unsigned long new;
+            do {
+                if (next_asid == (1UL << asid_bits)) new_asid_generation();
+                new = next_asid++;
+            } while (asid_is_reserved(new));
+            *asid = asid_generation | new;
+        }
+    }
+
+    if (tlb_flush_pending & (1UL << cpu)) {
+        // Leave every user ASID before the flush so no stale entry can be refilled
+        asm volatile(
+            "msr ttbr0_el1, %0\n"
+            "isb\n"
+            "tlbi vmalle1\n"
+            "dsb nsh\n"
+            "isb\n"
+            :
+            : "r"(kernel_pgd)
+            : "memory"
+        );
+        tlb_flush_pending &= ~(1UL << cpu);
+    }
+    active_asids[cpu] = (pgd == NULL) ? 0 : *asid;
+
+    spin_unlock_irqrestore(&asid_lock, flags);
+
+    if (pgd == NULL) return (unsigned long)kernel_pgd;
+    return (unsigned long)pgd | ((*asid & ASID_MASK) << TTBR_ASID_SHIFT);
+}
+
+void set_ttbr0(unsigned long ttbr0) {
+    asm volatile(
+        "msr ttbr0_el1, %0\n"
+        "isb\n"
+        :
+        : "r"(ttbr0)
+        : "memory"
+    );
+}
@@ -0,0 +1,237 @@
+#include "pl011.h"
+#include "uart.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "softirq.h"
+#include "sched.h"
+
+static char rx_buffer[PL011_BUFFER_SIZE];  // Ring arrays
+static char tx_buffer[PL011_BUFFER_SIZE];
+static unsigned long rx_buffer_head, rx_buffer_tail;
+static unsigned long tx_buffer_head, tx_buffer_tail;
+static spinlock_t rx_lock = SPINLOCK_INIT;
+static spinlock_t tx_lock = SPINLOCK_INIT;   // Also serializes the writes to the TX FIFO
+static spinlock_t imsc_lock = SPINLOCK_INIT; // IMSC is changed by the handler and the tasks
+static volatile unsigned int irq_masked;     // IMSC bits the hard IRQ handler turned off, served by `pl011_softirq`
+static int irq_ready;
+static unsigned int baud_rate;
+static struct WaitQueueHead rx_wait = WAIT_QUEUE_HEAD_INIT;
+static struct WaitQueueHead tx_wait = WAIT_QUEUE_HEAD_INIT;
+
+static void pl011_unmask(unsigned int bits) {
+    unsigned long flags = spin_lock_irqsave(&imsc_lock);
+    *PL011_IMSC |= bits;
+    spin_unlock_irqrestore(&imsc_lock, flags);
+}
+
+static void pl011_mask(unsigned int bits) {
+    unsigned long flags = spin_lock_irqsave(&imsc_lock);
+    *PL011_IMSC &= ~bits;
+    spin_unlock_irqrestore(&imsc_lock, flags);
+}
+
+/**
+ * pl011_set_baud - Program the baud rate divisor
+ *
+ * The divisor is UARTCLK / (16 * baud), kept as a 16-bit integer part and a
+ * 6-bit fraction. The UART is stopped while the divisor is latched, after
+ * the TX FIFO has drained.
+ *
+ * @return 0 on success, -1 if `baud` cannot be reached from `PL011_CLOCK`
+ */
+int pl011_set_baud(unsigned int baud) {
+    if (baud == 0) return -1;
+    unsigned long div = ((unsigned long)PL011_CLOCK * 4 + baud / 2) / baud;  // In 1/64 steps
+    unsigned int ibrd = div >> 6;
+    if (ibrd == 0 || ibrd > 0xffff) return -1;
+
+    unsigned long flags = spin_lock_irqsave(&tx_lock);
+    while (*PL011_FR & PL011_FR_BUSY) asm volatile("nop");
+    unsigned int cr = *PL011_CR;
+    *PL011_CR = 0;
+    *PL011_IBRD = ibrd;
+    *PL011_FBRD = div & 0x3f;
+    *PL011_LCRH = PL011_LCRH_FEN | PL011_LCRH_WLEN8;  // The divisors take effect on this write
+    *PL011_CR = cr;
+    baud_rate = baud;
+    spin_unlock_irqrestore(&tx_lock, flags);
+    return 0;
+}
+
+unsigned int pl011_get_baud() {
+    return baud_rate;
+}
+
+// Move as much of the TX ring into the FIFO as fits, called with `tx_lock` held
+static void pl011_fill_fifo() {
+    while (tx_buffer_head != tx_buffer_tail && !(*PL011_FR & PL011_FR_TXFF)) {
+        *PL011_DR = (unsigned int)tx_buffer[tx_buffer_tail];
+        tx_buffer_tail = (tx_buffer_tail + 1) % PL011_BUFFER_SIZE;
+    }
+}
+
+/**
+ * pl011_irq_handler - Hard IRQ handler of the PL011
+ *
+ * Only masks the interrupts that fired, the FIFOs are served by
+ * `pl011_softirq` once IRQs are enabled again.
+ */
+void pl011_irq_handler(unsigned int irq, void *dev) {
+    unsigned int mis = *PL011_MIS & (PL011_INT_RX | PL011_INT_RT | PL011_INT_TX);
+    if (mis == 0) return;
+
+    spin_lock(&imsc_lock);
+    *PL011_IMSC &= ~mis;
+    spin_unlock(&imsc_lock);
+    __atomic_or_fetch(&irq_masked, mis, __ATOMIC_RELAXED);
+    raise_softirq(SOFTIRQ_PL011);
+}
+
+/**
+ * pl011_irq_rx - PL011 RX bottom half
+ *
+ * Drains the RX FIFO into `rx_buffer` and wakes up the readers. The RX
+ * interrupts stay masked if the ring is full, `pl011_recv` turns them on
+ * again once it made room.
+ */
+static void pl011_irq_rx() {
+    unsigned long flags = spin_lock_irqsave(&rx_lock);
+    while (!(*PL011_FR & PL011_FR_RXFE)) {
+        if ((rx_buffer_head + 1) % PL011_BUFFER_SIZE == rx_buffer_tail) {
+            spin_unlock_irqrestore(&rx_lock, flags);
+            wake_up(&rx_wait);
+            return;
+        }
+        rx_buffer[rx_buffer_head] = (char)(*PL011_DR & 0xff);
+        rx_buffer_head = (rx_buffer_head + 1) % PL011_BUFFER_SIZE;
+    }
+    *PL011_ICR = PL011_INT_RX | PL011_INT_RT;
+    pl011_unmask(PL011_INT_RX | PL011_INT_RT);
+    spin_unlock_irqrestore(&rx_lock, flags);
+    wake_up(&rx_wait);
+}
+
+/**
+ * pl011_irq_tx - PL011 TX bottom half
+ *
+ * Refills the TX FIFO, which has drained to its interrupt level, and keeps
+ * the TX interrupt on while the ring has more to send.
+ */
+static void pl011_irq_tx() {
+    unsigned long flags = spin_lock_irqsave(&tx_lock);
+    pl011_fill_fifo();
+    if (tx_buffer_head != tx_buffer_tail) pl011_unmask(PL011_INT_TX);
+    spin_unlock_irqrestore(&tx_lock, flags);
+    wake_up(&tx_wait);
+}
+
+static void pl011_softirq() {
+    unsigned int masked = __atomic_exchange_n(&irq_masked, 0, __ATOMIC_RELAXED);
+    if (masked & (PL011_INT_RX | PL011_INT_RT)) pl011_irq_rx();
+    if (masked & PL011_INT_TX) pl011_irq_tx();
+}
+
+/**
+ * pl011_init - Bring up UART0 at `PL011_DEFAULT_BAUD`, 8N1, interrupt-driven
+ *
+ * The RX interrupt fires once the FIFO is half full, and the RX timeout
+ * catches the bytes left below that level when the line goes idle. The TX
+ * interrupt fires when the FIFO drained to 1/8, so a refill moves up to 14
+ * bytes per interrupt instead of one.
+ */
+void pl011_init() {
+    *PL011_CR = 0;
+    while (*PL011_FR & PL011_FR_BUSY) asm volatile("nop");
+    *PL011_LCRH = 0;                // Flush the FIFOs
+    *PL011_IMSC = 0;
+    *PL011_ICR = PL011_INT_ALL;
+
+    if (pl011_set_baud(PL011_DEFAULT_BAUD) != 0) {
+        uart_puts("[WARN] pl011_init: cannot set the baud rate\r\n");
+        return;
+    }
+    *PL011_IFLS = PL011_IFLS_TX(0) | PL011_IFLS_RX(2);
+    *PL011_CR = PL011_CR_UARTEN | PL011_CR_TXE | PL011_CR_RXE;
+
+    open_softirq(SOFTIRQ_PL011, pl011_softirq);
+    if (request_irq(IRQ_UART0, pl011_irq_handler, "PL011", NULL) != 0) return;
+    irq_ready = 1;
+    pl011_unmask(PL011_INT_RX | PL011_INT_RT);
+}
+
+// Polling output, for messages from IRQ context or before `pl011_init`
+void pl011_putc(char ch) {
+    while (*PL011_FR & PL011_FR_TXFF) asm volatile("nop");
+    *PL011_DR = (unsigned int)ch;
+}
+
+void pl011_puts(const char *str) {
+    while (*str != '\0') {
+        if (*str == '\n') pl011_putc('\r');
+        pl011_putc(*str);
+        str++;
+    }
+}
+
+/**
+ * pl011_recv - Read up to `len` characters from the RX ring
+ *
+ * Sleeps until at least one character is there, then returns what is
+ * available without waiting for more.
+ *
+ * @return Number of characters read, -1 before `pl011_init`
+ */
+int pl011_recv(char *buf, unsigned int len) {
+    unsigned int n = 0;
+    if (len == 0) return 0;
+    if (!irq_ready) return -1;
+
+    while (1) {
+        prepare_to_wait(&rx_wait);
+        unsigned long flags = spin_lock_irqsave(&rx_lock);
+        while (n < len && rx_buffer_head != rx_buffer_tail) {
+            buf[n++] = rx_buffer[rx_buffer_tail];
+            rx_buffer_tail = (rx_buffer_tail + 1) % PL011_BUFFER_SIZE;
+        }
+        pl011_unmask(PL011_INT_RX | PL011_INT_RT);  // Masked while the ring was full
+        spin_unlock_irqrestore(&rx_lock, flags);
+        if (n > 0) break;
+        schedule();
+    }
+    finish_wait(&rx_wait);
+    return n;
+}
+
+/**
+ * pl011_send - Queue `len` characters for UART0
+ *
+ * The writer fills the TX FIFO itself, so short writes go out without an
+ * interrupt. Whatever does not fit stays in the TX ring for the TX
+ * interrupt, and the writer only sleeps while the ring is full. Polls the
+ * UART before `pl011_init`.
+ *
+ * @return Number of characters written
+ */
+int pl011_send(const char *buf, unsigned int len) {
+    unsigned int n = 0;
+    if (!irq_ready) {
+        for (; n < len; n++) pl011_putc(buf[n]);
+        return n;
+    }
+
+    while (1) {
+        prepare_to_wait(&tx_wait);
+        unsigned long flags = spin_lock_irqsave(&tx_lock);
+        while (n < len && (tx_buffer_head + 1) % PL011_BUFFER_SIZE != tx_buffer_tail) {
+            tx_buffer[tx_buffer_head] = buf[n++];
+            tx_buffer_head = (tx_buffer_head + 1) % PL011_BUFFER_SIZE;
+        }
+        pl011_fill_fifo();
+        if (tx_buffer_head != tx_buffer_tail) pl011_unmask(PL011_INT_TX);
+        spin_unlock_irqrestore(&tx_lock, flags);
+        if (n == len) break;
+        schedule();
+    }
+    finish_wait(&tx_wait);
+    return n;
+}
@@ -1,78 +1,131 @@
 #include "sched.h"
+#include "kprintf.h"
 
-struct ThreadTask *ready_queue = NULL;
-struct ThreadTask *wait_queue = NULL;
-struct ThreadTask *zombie_queue = NULL;
+struct RunQueue run_queues[NR_CPUS];
+struct TaskQueue wait_queue = { NULL, NULL };
+static spinlock_t wait_lock = SPINLOCK_INIT;  // Taken after a run queue lock
+static int need_resched[NR_CPUS];  // Set from interrupt context, only read by the same core
 
-unsigned int thread_cnt = 0;
+static atomic_t next_pid = ATOMIC_INIT(0);
+static atomic_t next_cpu = ATOMIC_INIT(0);
 
-void print_queue(struct ThreadTask *queue) {
-    struct ThreadTask *current = queue;
+// Live tasks by pid, chained through `hash_next`
+static struct ThreadTask *pid_hash[PID_HASH_SIZE];
+static rwlock_t pid_hash_lock = RWLOCK_INIT;
+
+void print_queue(struct TaskQueue *queue) {
+    struct ThreadTask *current = queue->head;
     while (current != NULL) {
-        uart_puts(itoa(current->id));
-        uart_puts("(");
-        uart_hex((unsigned long)current);
-        uart_puts(")");
-        uart_puts(" -> ");
+        kprintf("%u(%p) -> ", current->id, current);
         current = current->next;
     }
     uart_puts("NULL\r\n");
 }
 
-void add_thread_task(struct ThreadTask **queue, struct ThreadTask *task) {
-    // Add the task to the ready queue
-    if (*queue == NULL) {
-        *queue = task;
+// Append the task to the tail of the queue, taking it off the queue it was on first
+void add_thread_task(struct TaskQueue *queue, struct ThreadTask *task) {
+    if (task->queue != NULL) rm_thread_task(task);
+
+    task->next = NULL;
+    task->prev = queue->tail;
+    if (queue->tail == NULL) {
+        queue->head = task;
     }
     else {
-        struct ThreadTask *current = *queue;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        current->next = task;
+        queue->tail->next = task;
     }
-    task->next = NULL;
+    queue->tail = task;
+    task->queue = queue;
 
-    // print_queue(*queue);
+    // print_queue(queue);
 }
 
 // Get the first task from the queue
-struct ThreadTask* pop_thread_task(struct ThreadTask **queue) {
-    if (*queue == NULL) {
-        return NULL;
-    }
-    struct ThreadTask *task = *queue;
-    *queue = (*queue)->next;
+struct ThreadTask* pop_thread_task(struct TaskQueue *queue) {
+    struct ThreadTask *task = queue->head;
+    if (task != NULL) rm_thread_task(task);
     return task;
 }
 
-void rm_thread_task(struct ThreadTask **queue, struct ThreadTask *task) {
-    if (*queue == NULL) {
+// Take the task off the queue it is on, if any
+void rm_thread_task(struct ThreadTask *task) {
+    struct TaskQueue *queue = task->queue;
+    if (queue == NULL) {
         return;
     }
-    struct ThreadTask *current = *queue;
-    struct ThreadTask *prev = NULL;
 
-    while (current != NULL) {
-        if (current == task) {
-            if (prev == NULL) {
-                *queue = current->next;
-            }
-            else {
-                prev->next = current->next;
-            }
-            break;
-        }
-        prev = current;
-        current = current->next;
+    if (task->prev == NULL) queue->head = task->next;
+    else task->prev->next = task->next;
+    if (task->next == NULL) queue->tail = task->prev;
+    else task->next->prev = task->prev;
+
+    task->next = NULL;
+    task->prev = NULL;
+    task->queue = NULL;
+}
+
+/**
+ * Ready queues
+ *   One FIFO per priority and a bitmap of the non-empty ones, the highest
+ *   set bit (found with `clz`) is the queue to run from. All O(1).
+ */
+static void enqueue_ready(struct RunQueue *rq, struct ThreadTask *task) {
+    if (task->priority < 0) task->priority = 0;
+    if (task->priority >= SCHED_NR_PRIO) task->priority = SCHED_NR_PRIO - 1;
+    add_thread_task(&rq->queues[task->priority], task);
+    rq->bitmap |= 1U << task->priority;
+}
+
+// Take the task off a ready queue of `rq` or the wait queue, called with both locks held
+static void dequeue_task(struct RunQueue *rq, struct ThreadTask *task) {
+    struct TaskQueue *queue = task->queue;
+    if (queue == NULL) return;
+
+    rm_thread_task(task);
+    if (queue >= rq->queues && queue < rq->queues + SCHED_NR_PRIO && queue->head == NULL) {
+        rq->bitmap &= ~(1U << (queue - rq->queues));
     }
 }
 
+// The scheduler tick is only needed while a ready task could preempt `running`
+static void update_tick(struct RunQueue *rq, struct ThreadTask *running) {
+    timer_set_tick((rq->bitmap >> running->priority) != 0);
+}
+
+static struct ThreadTask* pick_next_ready(struct RunQueue *rq) {
+    if (rq->bitmap == 0) return NULL;
+
+    unsigned long lz;
+    asm volatile("clz %w0, %w1" : "=r"(lz) : "r"(rq->bitmap));
+    return rq->queues[31 - lz].head;
+}
+
+void pid_hash_add(struct ThreadTask *task) {
+    unsigned long flags = write_lock_irqsave(&pid_hash_lock);
+    struct ThreadTask **bucket = &pid_hash[task->id % PID_HASH_SIZE];
+    task->hash_next = *bucket;
+    *bucket = task;
+    write_unlock_irqrestore(&pid_hash_lock, flags);
+}
+
+static void pid_hash_del(struct ThreadTask *task) {
+    unsigned long flags = write_lock_irqsave(&pid_hash_lock);
+    struct ThreadTask **link = &pid_hash[task->id % PID_HASH_SIZE];
+    while (*link != NULL && *link != task) {
+        link = &(*link)->hash_next;
+    }
+    if (*link != NULL) *link = task->hash_next;
+    write_unlock_irqrestore(&pid_hash_lock, flags);
+}
+
 void sched_init() {
-    ready_queue = NULL;
-    wait_queue = NULL;
-    zombie_queue = NULL;
-    thread_cnt = 0;
+    memset(run_queues, 0, sizeof(run_queues));
+    for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+        spin_lock_init(&run_queues[cpu].lock);
+    }
+    wait_queue.head = NULL;
+    wait_queue.tail = NULL;
+    atomic_set(&next_pid, 0);
 
     // Create a task for "idle"
     struct ThreadTask *idle_task = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
@@ -80,22 +133,193 @@ void sched_init() {
         uart_puts("Failed to allocate memory for idle task!\n");
         return;
     }
+    memset(idle_task, 0, sizeof(struct ThreadTask));
 
-    thread_create(idle);
+    struct ThreadTask *idle_thread = thread_create_on(idle, 0);
+    if (idle_thread != NULL) sched_set_priority(idle_thread, IDLE_PRIORITY);
     set_current(idle_task);
     idle_task->state = TASK_RUNNING;
+    run_queues[0].curr = idle_task;
+}
+
+/**
+ * sched_init_secondary - Turn the boot context of a secondary core into a task
+ *
+ * The core then runs `idle` on its boot stack, so it needs no idle thread.
+ */
+void sched_init_secondary(unsigned int cpu) {
+    struct ThreadTask *idle_task = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
+    if (idle_task == NULL) {
+        uart_puts("Failed to allocate memory for idle task!\n");
+        return;
+    }
+    memset(idle_task, 0, sizeof(struct ThreadTask));
+
+    idle_task->cpu = cpu;
+    idle_task->state = TASK_RUNNING;
+    idle_task->cpu_context.ttbr0 = (unsigned long)kernel_pgd;
+    set_current(idle_task);
+    run_queues[cpu].curr = idle_task;
+}
+
+unsigned int alloc_pid() {
+    return atomic_inc_return(&next_pid) - 1;
+}
+
+// Spread new tasks over the online cores in turn
+unsigned int sched_pick_cpu() {
+    return (unsigned int)(atomic_inc_return(&next_cpu) - 1) % nr_cpus_online;
+}
+
+// Put a new task on the ready queue of `task->cpu`
+void add_ready_task(struct ThreadTask *task) {
+    struct RunQueue *rq = &run_queues[task->cpu];
+    int local = (task->cpu == get_cpu_id());
+    unsigned long flags = spin_lock_irqsave(&rq->lock);
+    enqueue_ready(rq, task);
+    if (local && rq->curr != NULL) update_tick(rq, rq->curr);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    // The core may be sleeping without a tick
+    if (!local) smp_send_ipi(task->cpu, IPI_RESCHEDULE);
+}
+
+/**
+ * wake_up_task - Make a blocked task ready again
+ *
+ * A task that set `TASK_BLOCKED` but did not reach `schedule` yet is just
+ * put back to running, `schedule` then keeps it on the core.
+ */
+void wake_up_task(struct ThreadTask *task) {
+    struct RunQueue *rq = &run_queues[task->cpu];
+    int local = (task->cpu == get_cpu_id());
+    int queued = 0;
+
+    unsigned long flags = spin_lock_irqsave(&rq->lock);
+    if (task->state == TASK_BLOCKED) {
+        if (task->queue == &wait_queue) {
+            spin_lock(&wait_lock);
+            rm_thread_task(task);
+            spin_unlock(&wait_lock);
+            task->state = TASK_READY;
+            enqueue_ready(rq, task);
+            if (local && rq->curr != NULL) update_tick(rq, rq->curr);
+            queued = 1;
+        }
+        else {
+            task->state = TASK_RUNNING;
+        }
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (queued && !local) smp_send_ipi(task->cpu, IPI_RESCHEDULE);
+}
+
+/**
+ * prepare_to_wait - Mark the current task as sleeping on `wq`
+ *
+ * The task only sleeps once it calls `schedule`. A wakeup that comes
+ * before then just keeps it running, so the condition can be checked
+ * after this without losing an event.
+ */
+void prepare_to_wait(struct WaitQueueHead *wq) {
+    struct ThreadTask *curr = get_current();
+    unsigned long flags = spin_lock_irqsave(&wq->lock);
+    if (curr->wait_head == NULL) {
+        curr->wait_next = wq->head;
+        wq->head = curr;
+        curr->wait_head = wq;
+    }
+    curr->state = TASK_BLOCKED;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Unlink `task` from `wq` if it is still on it, called with `wq->lock` held
+static void wait_head_del(struct WaitQueueHead *wq, struct ThreadTask *task) {
+    if (task->wait_head != wq) return;  // Already taken off by `wake_up`
+    struct ThreadTask **link = &wq->head;
+    while (*link != task) link = &(*link)->wait_next;
+    *link = task->wait_next;
+    task->wait_next = NULL;
+    task->wait_head = NULL;
+}
+
+// Leave `wq` after `prepare_to_wait`, whether the task slept or not
+void finish_wait(struct WaitQueueHead *wq) {
+    struct ThreadTask *curr = get_current();
+    unsigned long flags = spin_lock_irqsave(&wq->lock);
+    wait_head_del(wq, curr);
+    curr->state = TASK_RUNNING;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Wake every task sleeping on `wq`, callable from interrupt context
+void wake_up(struct WaitQueueHead *wq) {
+    unsigned long flags = spin_lock_irqsave(&wq->lock);
+    struct ThreadTask *task = wq->head;
+    wq->head = NULL;
+    while (task != NULL) {
+        struct ThreadTask *next = task->wait_next;
+        task->wait_next = NULL;
+        wake_up_task(task);
+        // Cleared last: `kill_zombies` locks `wq` while this is set, so it cannot free the task under us
+        __atomic_store_n(&task->wait_head, NULL, __ATOMIC_RELEASE);
+        task = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Ask for a `schedule` when this core leaves the current interrupt
+void set_need_resched() {
+    need_resched[get_cpu_id()] = 1;
+}
+
+/**
+ * sched_irq_exit - Preempt the interrupted task if an interrupt asked for it
+ *
+ * Called by `irq_exit` with IRQs masked, once the softirqs ran. A task
+ * between `prepare_to_wait` and its `schedule` is left alone: preempting it
+ * would put it to sleep before it checked its condition.
+ */
+void sched_irq_exit() {
+    unsigned int cpu = get_cpu_id();
+    struct ThreadTask *curr = get_current();
+    if (!need_resched[cpu] || (curr != NULL && curr->state == TASK_BLOCKED)) return;
+    need_resched[cpu] = 0;
+    schedule();
+}
+
+// Change the priority of a task, moving it to the matching ready queue if it is waiting on one
+void sched_set_priority(struct ThreadTask *task, long priority) {
+    struct RunQueue *rq = &run_queues[task->cpu];
+    unsigned long flags = spin_lock_irqsave(&rq->lock);
+    if (task->state == TASK_READY && task->queue != NULL) {
+        dequeue_task(rq, task);
+        task->priority = priority;
+        enqueue_ready(rq, task);
+    }
+    else {
+        task->priority = priority;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
 struct ThreadTask* thread_create(void (*callback)(void)) {
+    return thread_create_on(callback, sched_pick_cpu());
+}
+
+struct ThreadTask* thread_create_on(void (*callback)(void), unsigned int cpu) {
     // Allocate memory for the task
     struct ThreadTask *task = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
     if (task == NULL) {
         uart_puts("Failed to allocate memory for task!\n");
-        return -1;
+        return NULL;
     }
+    memset(task, 0, sizeof(struct ThreadTask));
 
     // Initialize the task
-    task->id = thread_cnt++;
+    task->id = alloc_pid();
+    task->cpu = cpu;
     task->state = TASK_READY;
     task->counter = DEFAULT_PRIORITY;
     task->priority = DEFAULT_PRIORITY;
@@ -104,15 +328,19 @@ struct ThreadTask* thread_create(void (*callback)(void)) {
     if (task->kernel_stack == NULL) {
         uart_puts("Failed to allocate memory for task stack!\n");
         free(task);
-        return -1;
+        return NULL;
     }
     task->user_stack = alloc(THREAD_STACK_SIZE);
     if (task->user_stack == NULL) {
         uart_puts("Failed to allocate memory for task stack!\n");
         free(task->kernel_stack);
         free(task);
-        return -1;
+        return NULL;
     }
+    task->pgd = NULL;
+    task->asid = 0;
+    task->vma_list = NULL;
+    task->brk = 0;
 
     // Initialize signal handling
     task->pending_sig = 0;
@@ -138,79 +366,156 @@ struct ThreadTask* thread_create(void (*callback)(void)) {
     task->cpu_context.lr = (unsigned long)callback; // Set the entry point of the task
     task->cpu_context.sp = (unsigned long)task->user_stack + THREAD_STACK_SIZE;
     task->cpu_context.fp = task->cpu_context.sp;
+    task->cpu_context.ttbr0 = (unsigned long)kernel_pgd;
 
     // Add the task to the ready queue
-    add_thread_task(&ready_queue, task);
+    pid_hash_add(task);
+    add_ready_task(task);
 
     return task;
 }
 
-struct ThreadTask* get_thread_task_by_id(int pid) {
-    struct ThreadTask *current = ready_queue;
-    while (current != NULL) {
-        if (current->id == pid) {
-            return current;
-        }
-        current = current->next;
+/**
+ * thread_create_user_space - Give a task its own address space
+ *
+ * The task keeps running kernel code, only its stack moves to the demand-paged
+ * stack area below `USER_STACK_TOP`, and it gets an empty heap.
+ */
+int thread_create_user_space(struct ThreadTask *task) {
+    unsigned long *pgd = pgd_alloc();
+    if (pgd == NULL) return -1;
+
+    if (vm_init_user_space(task, USER_CODE_BASE) != 0) {
+        uart_puts("Failed to reserve user stack!\n");
+        pgd_free(pgd);
+        return -1;
     }
 
-    current = wait_queue;
-    while (current != NULL) {
-        if (current->id == pid) {
-            return current;
-        }
-        current = current->next;
+    free(task->user_stack);
+    task->pgd = pgd;
+    task->asid = 0;
+    task->user_stack = NULL;
+    task->cpu_context.sp = USER_STACK_TOP;
+    task->cpu_context.fp = USER_STACK_TOP;
+    return 0;
+}
+
+// Load the address space of `task` on this core, used before a direct `eret` into a new task
+void switch_mm(struct ThreadTask *task) {
+    task->cpu_context.ttbr0 = get_ttbr0(task->pgd, &task->asid);
+    set_ttbr0(task->cpu_context.ttbr0);
+}
+
+/**
+ * get_thread_task_by_id - Find a live task and pin it
+ *
+ * On success `pid_hash_lock` is left read held: a zombie leaves the hash
+ * before it is freed, so the task stays valid until `put_thread_task`. The
+ * caller may take a run queue lock meanwhile, but must not sleep or call
+ * `schedule`. Returns NULL with the lock dropped if there is no such task.
+ */
+struct ThreadTask* get_thread_task_by_id(int pid, unsigned long *flags) {
+    *flags = read_lock_irqsave(&pid_hash_lock);
+    struct ThreadTask *task = pid_hash[(unsigned int)pid % PID_HASH_SIZE];
+    while (task != NULL && (task->id != pid || task->state == TASK_EXITED)) {
+        task = task->hash_next;
     }
-    
-    return NULL;
+    if (task == NULL) read_unlock_irqrestore(&pid_hash_lock, *flags);
+    return task;
+}
+
+// Unpin a task returned by `get_thread_task_by_id`
+void put_thread_task(unsigned long flags) {
+    read_unlock_irqrestore(&pid_hash_lock, flags);
 }
 
 void _exit() {
     struct ThreadTask *curr = get_current();
     if (curr == NULL) return;
 
-    rm_thread_task(&ready_queue, curr);
-    rm_thread_task(&wait_queue, curr);
-
+    struct RunQueue *rq = &run_queues[curr->cpu];
+    unsigned long flags = spin_lock_irqsave(&rq->lock);
+    spin_lock(&wait_lock);
+    dequeue_task(rq, curr);
+    spin_unlock(&wait_lock);
     curr->state = TASK_EXITED;
+    spin_unlock_irqrestore(&rq->lock, flags);
 
-    schedule();  // Switch to the next task
+    schedule();  // Switch to the next task, which puts this one on the zombie queue
 }
 
 int _kill(unsigned int pid) {
-    struct ThreadTask *task = get_thread_task_by_id(pid);
+    unsigned long flags;
+    struct ThreadTask *task = get_thread_task_by_id(pid, &flags);
     if (task == NULL) {
-        uart_puts("[WARN] _kill: no running task with pid ");
-        uart_puts(itoa(pid));
-        uart_puts("\r\n");
+        kprintf("[WARN] _kill: no running task with pid %u\r\n", pid);
         return -1;
     }
 
-    rm_thread_task(&ready_queue, task);
-    rm_thread_task(&wait_queue, task);
+    struct RunQueue *rq = &run_queues[task->cpu];
+    spin_lock(&rq->lock);
+    if (task->state == TASK_EXITED) {  // Lost the race against another kill or `_exit`
+        spin_unlock(&rq->lock);
+        put_thread_task(flags);
+        return 0;
+    }
 
     task->state = TASK_EXITED;
+    if (rq->curr == task) {
+        // Running, `schedule` on its core moves it to the zombie queue
+        int self = (task == get_current());
+        spin_unlock(&rq->lock);
+        put_thread_task(flags);
+        if (self) schedule();
+        return 0;
+    }
 
-    struct ThreadTask *curr = get_current();
-    if (curr == task) schedule();
-    else add_thread_task(&zombie_queue, task);
+    spin_lock(&wait_lock);
+    dequeue_task(rq, task);
+    spin_unlock(&wait_lock);
+    add_thread_task(&rq->zombie_queue, task);
+    spin_unlock(&rq->lock);
+    put_thread_task(flags);
 
     return 0;
 }
 
+/**
+ * schedule - Switch to the best ready task of this core
+ *
+ * The highest priority ready task runs. A running task is only preempted by
+ * one of the same or a higher priority, and goes to the tail of its queue so
+ * tasks of equal priority take turns.
+ */
 void schedule() {
     disable_irq_el1();
     timer_disable_irq();
 
+    struct RunQueue *rq = &run_queues[get_cpu_id()];
+    spin_lock(&rq->lock);
+
     struct ThreadTask *prev = get_current();
     if (prev == NULL) {
-        ready_queue->state = TASK_RUNNING;
-        set_current(ready_queue);
+        struct ThreadTask *first = pick_next_ready(rq);
+        if (first == NULL) {
+            spin_unlock(&rq->lock);
+            return;
+        }
+        dequeue_task(rq, first);
+        first->state = TASK_RUNNING;
+        set_current(first);
+        rq->curr = first;
+        spin_unlock(&rq->lock);
     }
     else {
-        struct ThreadTask *next = ready_queue;
+        // A task entered with a direct `eret` is still on its ready queue
+        if ((prev->state == TASK_RUNNING || prev->state == TASK_BLOCKED) && prev->queue != NULL) dequeue_task(rq, prev);
+
+        struct ThreadTask *next = pick_next_ready(rq);
 
-        if (next == NULL || next == prev) {
+        if (next == NULL || (prev->state == TASK_RUNNING && next->priority < prev->priority)) {
+            update_tick(rq, prev);
+            spin_unlock(&rq->lock);
             enable_irq_el1();
             timer_enable_irq();
             return;
@@ -218,27 +523,41 @@ void schedule() {
 
         if (prev->state == TASK_RUNNING) {
             prev->state = TASK_READY;
-            add_thread_task(&ready_queue, prev);
+            enqueue_ready(rq, prev);
         }
         else if (prev->state == TASK_BLOCKED) {
+            spin_lock(&wait_lock);
             add_thread_task(&wait_queue, prev);
+            spin_unlock(&wait_lock);
         }
         else if (prev->state == TASK_EXITED) {
-            add_thread_task(&zombie_queue, prev);
+            add_thread_task(&rq->zombie_queue, prev);
         }
         else if (prev->state == TASK_READY);
         else {
             uart_puts("Invalid thread state!\n");
+            spin_unlock(&rq->lock);
             enable_irq_el1();
             timer_enable_irq();
             return;
         }
 
-        // print_queue(ready_queue);
-
         // Switch to the next task
+        next = pick_next_ready(rq);
+        dequeue_task(rq, next);
         next->state = TASK_RUNNING;
-        next = pop_thread_task(&ready_queue);
+        rq->curr = next;
+        update_tick(rq, next);
+        if (next == prev) {  // The only task of the highest priority
+            spin_unlock(&rq->lock);
+            enable_irq_el1();
+            timer_enable_irq();
+            return;
+        }
+        next->cpu_context.ttbr0 = get_ttbr0(next->pgd, &next->asid);
+
+        // Only this core picks from `rq`, so `prev` is safe until the switch saves it
+        spin_unlock(&rq->lock);
 
         // enable_irq_el1();
         timer_enable_irq();
@@ -252,18 +571,52 @@ void schedule() {
 }
 
 void kill_zombies() {
-    struct ThreadTask *zombie = pop_thread_task(&zombie_queue);
-    while (zombie != NULL) {
+    struct RunQueue *rq = &run_queues[get_cpu_id()];
+
+    while (1) {
+        // Freeing takes the allocator locks, so only hold the queue lock to pop
+        unsigned long flags = spin_lock_irqsave(&rq->lock);
+        struct ThreadTask *zombie = pop_thread_task(&rq->zombie_queue);
+        spin_unlock_irqrestore(&rq->lock, flags);
+        if (zombie == NULL) break;
+
+        pid_hash_del(zombie);
+
+        // A task killed while it slept is still on its wait queue, `wake_up` must not see it freed
+        struct WaitQueueHead *wq = __atomic_load_n(&zombie->wait_head, __ATOMIC_ACQUIRE);
+        if (wq != NULL) {
+            unsigned long wq_flags = spin_lock_irqsave(&wq->lock);
+            wait_head_del(wq, zombie);
+            spin_unlock_irqrestore(&wq->lock, wq_flags);
+        }
+
         free(zombie->kernel_stack);
         free(zombie->user_stack);
+        pgd_free(zombie->pgd);
+        vma_free_list(&zombie->vma_list);
         free(zombie);
-        zombie = pop_thread_task(&zombie_queue);
     }
 }
 
+/**
+ * idle - Body of the lowest priority task of a core
+ *
+ * Only runs when nothing else can, so after reaping zombies the core sleeps
+ * in `wfi` until an interrupt (its next timer event or an IPI) makes work.
+ * IRQs stay masked from the check to the `wfi`, a pending IRQ still wakes
+ * the core, so no wakeup is lost in between.
+ */
 void idle() {
+    struct RunQueue *rq = &run_queues[get_cpu_id()];
+
     while (1) {
         kill_zombies();
         schedule();
+
+        disable_irq_el1();
+        if (rq->bitmap == 0 && rq->zombie_queue.head == NULL) {
+            asm volatile("wfi");
+        }
+        enable_irq_el1();
     }
-}
\ No newline at end of file
+}
@@ -1,4 +1,7 @@
 #include "shell.h"
+#include "vdso.h"
+#include "irq.h"
+#include "pl011.h"
 
 void cmd_help_msg() {
     uart_puts("help       :print this help menu\r\n");
@@ -10,6 +13,12 @@ void cmd_help_msg() {
     uart_puts("test_async :test async UART\r\n");
     uart_puts("test_alloc :test memory allocation\r\n");
     uart_puts("setTimeout : set a timeout and print a msg\r\n");
+    uart_puts("settime    :set the wall clock (seconds since the epoch)\r\n");
+    uart_puts("irqstat    :print the interrupt counters\r\n");
+    uart_puts("sysstat    :print the syscall counters and latency histograms\r\n");
+    uart_puts("baud       :print or set the baud rate of /dev/pl011\r\n");
+    uart_puts("buddyinfo  :print the free pages of each order\r\n");
+    uart_puts("slabinfo   :print the kmalloc caches\r\n");
     uart_puts("memAlloc   :allocate memory\r\n");
     uart_puts("reboot     :reboot the system\r\n");
     return;
@@ -173,6 +182,34 @@ void shell() {
             
             set_timeout(msg, num_sec);
         }
+        else if (strcmp(cmd_name, "settime") == 0) {
+            if (cmd.argc != 1) {
+                uart_puts("Usage: settime <sec>\r\n");
+                continue;
+            }
+            vdso_set_realtime((unsigned long long)atoi(cmd.args[0]), 0);
+        }
+        else if (strcmp(cmd_name, "irqstat") == 0) {
+            print_irq_stats();
+        }
+        else if (strcmp(cmd_name, "sysstat") == 0) {
+            print_syscall_stats();
+        }
+        else if (strcmp(cmd_name, "baud") == 0) {
+            if (cmd.argc == 1 && pl011_set_baud((unsigned int)atoi(cmd.args[0])) != 0) {
+                uart_puts("Unsupported baud rate\r\n");
+                continue;
+            }
+            uart_puts("PL011 baud rate: ");
+            uart_puts(itoa(pl011_get_baud()));
+            uart_puts("\r\n");
+        }
+        else if (strcmp(cmd_name, "buddyinfo") == 0) {
+            print_buddy_stats();
+        }
+        else if (strcmp(cmd_name, "slabinfo") == 0) {
+            print_slab_stats();
+        }
         else if (strcmp(cmd_name, "memAlloc") == 0) {
             char num_mem[6];
             uart_puts("Allocate memory: ");
@@ -1,4 +1,5 @@
 #include "signal.h"
+#include "klog.h"
 
 void check_pending_signals(struct ThreadTask *task, struct TrapFrame *trapframe) {
     if (task->pending_sig == 0) {
@@ -19,32 +20,29 @@ void sighander_user_wrapper(void (*handler)()) {
 }
 
 void handle_signal(struct ThreadTask *task, int sig, struct TrapFrame *trapframe) {
-    uart_puts("[INFO] handle_signal: handling signal ");
-    uart_puts(itoa(sig));
-    uart_puts(" in pid ");
-    uart_puts(itoa(task->id));
-    uart_puts("\r\n");
+    klog_info("handle_signal: handling signal %d in pid %d", sig, task->id);
     
     if (sig < 0 || sig >= SIG_NUM) {
-        uart_puts("[WARN] handle_signal: invalid signal number\r\n");
+        klog_warn("handle_signal: invalid signal number");
         return;
     }
     if (task->sig_handlers[sig] == NULL) {
-        uart_puts("[WARN] handle_signal: no handler for signal\r\n");
+        klog_warn("handle_signal: no handler for signal %d", sig);
         return;
     }
     
     if (task->sig_handlers[sig] == default_handler || task->sig_handlers[sig] == default_sigkill_handler) {
         // Default handler, can be run in kernel mode
-        uart_puts("[INFO] handle_signal: using default handler\r\n");
+        klog_debug("handle_signal: using default handler");
         task->sig_handlers[sig](sig);
     }
     else {
         // Custom handler, switch to user mode
-        uart_puts("[INFO] handle_signal: using custom handler\r\n");
+        klog_debug("handle_signal: using custom handler");
         memcpy(&task->sig_frame, trapframe, sizeof(struct TrapFrame));
 
-        task->cpu_context.sp = alloc(THREAD_STACK_SIZE) + THREAD_STACK_SIZE;
+        // The handler runs at EL0, so its stack is the interrupted user stack
+        task->cpu_context.sp = trapframe->sp_el0 & ~0xFUL;
         task->cpu_context.fp = task->cpu_context.sp;
         task->cpu_context.lr = sighander_user_wrapper;
 
@@ -68,8 +66,5 @@ void default_sigkill_handler(int sig) {
 }
 
 void default_handler(int sig) {
-    uart_puts("[INFO] default_handler called\r\n");
-    uart_puts("Signal: ");
-    uart_hex(sig);
-    uart_puts("\r\n");
+    klog_info("default_handler: signal %d", sig);
 }
@@ -0,0 +1,79 @@
+#include "smp.h"
+#include "sched.h"
+#include "timer.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "kprintf.h"
+
+extern void secondary_start(void);
+
+unsigned char cpu_stacks[NR_CPUS - 1][CPU_STACK_SIZE] __attribute__((aligned(16)));
+volatile unsigned int nr_cpus_online = 1;
+static spinlock_t online_lock = SPINLOCK_INIT;
+
+/**
+ * smp_init - Release the secondary cores parked in the firmware spin table
+ *
+ * The cores start with the MMU and caches off, so everything they read before
+ * `mmu_init_secondary` has to be in RAM: the release addresses and their stacks
+ * are cleaned out of the data cache first. Waits up to a second for the cores.
+ */
+void smp_init() {
+    request_irq(IRQ_LOCAL_MBOX0, smp_ipi_handler, "IPI", NULL);
+    smp_ipi_init();
+    dcache_clean_inval_range(cpu_stacks, sizeof(cpu_stacks));
+
+    for (unsigned long cpu = 1; cpu < NR_CPUS; cpu++) {
+        volatile unsigned long *release = (volatile unsigned long *)(SPIN_TABLE_BASE + cpu * 8);
+        *release = (unsigned long)secondary_start;
+        dcache_clean_inval_range((void*)release, sizeof(unsigned long));
+    }
+    asm volatile("dsb sy\nsev" ::: "memory");
+
+    unsigned long long deadline = get_tick() + get_freq();
+    while (nr_cpus_online < NR_CPUS && get_tick() < deadline);
+
+    kprintf("[SMP] %u cores online\r\n", nr_cpus_online);
+}
+
+/**
+ * secondary_main - C entry of a secondary core, called by `secondary_start`
+ *
+ * Runs with the MMU on and `sp` on the core's `cpu_stacks` entry, which stays
+ * its exception stack while idle. The boot context becomes the idle task.
+ */
+void secondary_main(unsigned long cpu) {
+    sched_init_secondary(cpu);
+    timer_init_secondary();
+    smp_ipi_init();
+
+    spin_lock(&online_lock);
+    nr_cpus_online++;
+    spin_unlock(&online_lock);
+
+    enable_irq_el1();
+    idle();
+}
+
+// Route mailbox 0 of this core to its IRQ line
+void smp_ipi_init() {
+    unsigned int cpu = get_cpu_id();
+    *CORE_MBOX0_RDCLR(cpu) = 0xffffffff;
+    *CORE_MBOX_IRQ_CTRL(cpu) = 1;
+}
+
+void smp_send_ipi(unsigned int cpu, unsigned int ipi) {
+    asm volatile("dsb ishst" ::: "memory");  // The data the IPI is about must be visible first
+    *CORE_MBOX0_SET(cpu) = ipi;
+}
+
+void smp_ipi_handler(unsigned int irq, void *dev) {
+    unsigned int cpu = get_cpu_id();
+    unsigned int ipis = *CORE_MBOX0_RDCLR(cpu);
+    *CORE_MBOX0_RDCLR(cpu) = ipis;
+
+    if (ipis & IPI_RESCHEDULE) {
+        set_need_resched();  // Switched on the way out, see `irq_exit`
+    }
+}
@@ -0,0 +1,97 @@
+#include "softirq.h"
+#include "sched.h"
+#include "timer.h"
+
+static softirq_action_t softirq_vec[NR_SOFTIRQS];
+static volatile unsigned int softirq_pending[NR_CPUS];  // Only touched by its own core, with IRQs masked
+static int in_softirq[NR_CPUS];                         // The core is running its softirqs
+static struct ThreadTask *ksoftirqd_tasks[NR_CPUS];
+
+void open_softirq(unsigned int nr, softirq_action_t action) {
+    if (nr >= NR_SOFTIRQS) return;
+    softirq_vec[nr] = action;
+}
+
+// Mark softirq `nr` pending on this core, it runs at the next interrupt exit
+void raise_softirq(unsigned int nr) {
+    unsigned long flags = local_irq_save();
+    softirq_pending[get_cpu_id()] |= 1U << nr;
+    local_irq_restore(flags);
+}
+
+/**
+ * do_softirq - Run the pending softirqs of `cpu`
+ *
+ * Called with IRQs masked, they are enabled while the actions run. Softirqs
+ * raised meanwhile are picked up in the next round, until the budget runs
+ * out and `ksoftirqd` takes over.
+ */
+static void do_softirq(unsigned int cpu) {
+    unsigned long long deadline = get_tick() + (get_freq() >> SOFTIRQ_BUDGET_SHIFT);
+    int restart = SOFTIRQ_MAX_RESTART;
+
+    in_softirq[cpu] = 1;
+    unsigned int pending = softirq_pending[cpu];
+    while (pending != 0) {
+        softirq_pending[cpu] = 0;
+        enable_irq_el1();
+
+        while (pending != 0) {
+            unsigned int nr = __builtin_ctz(pending);
+            pending &= ~(1U << nr);
+            if (softirq_vec[nr] != NULL) softirq_vec[nr]();
+        }
+
+        disable_irq_el1();
+        pending = softirq_pending[cpu];
+        if (pending != 0 && (--restart == 0 || get_tick() >= deadline)) {
+            if (ksoftirqd_tasks[cpu] != NULL) wake_up_task(ksoftirqd_tasks[cpu]);
+            break;
+        }
+    }
+    in_softirq[cpu] = 0;
+}
+
+/**
+ * irq_exit - Last step of `irq_entry`, called with IRQs masked
+ *
+ * Runs the softirqs, then preempts the interrupted task if an interrupt
+ * asked for it. Nothing is done in an interrupt that hit the softirqs of
+ * this core, they go on once it returns.
+ */
+void irq_exit() {
+    unsigned int cpu = get_cpu_id();
+    if (in_softirq[cpu]) return;
+
+    if (softirq_pending[cpu] != 0) do_softirq(cpu);
+    sched_irq_exit();
+}
+
+// Runs the softirqs left over under load, sleeps while there are none
+static void ksoftirqd() {
+    unsigned int cpu = get_cpu_id();
+    struct ThreadTask *self = get_current();
+
+    while (1) {
+        disable_irq_el1();
+        if (softirq_pending[cpu] == 0) {
+            self->state = TASK_BLOCKED;  // IRQs stay masked until parked, no wakeup is lost
+            schedule();
+            enable_irq_el1();
+            continue;
+        }
+        do_softirq(cpu);
+        enable_irq_el1();
+        schedule();  // Let the other tasks run between rounds
+    }
+}
+
+// Create one `ksoftirqd` per core, on queues of cores that may not be online yet
+void softirq_init() {
+    for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) {
+        ksoftirqd_tasks[cpu] = thread_create_on(ksoftirqd, cpu);
+        if (ksoftirqd_tasks[cpu] == NULL) {
+            uart_puts("[WARN] softirq_init: failed to create ksoftirqd\r\n");
+        }
+    }
+}
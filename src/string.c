@@ -1,12 +1,6 @@
 #include "string.h"
-
-int strcmp (const char *s1, const char *s2) {
-    while (*s1 && *s2 && *s1 == *s2) {
-        s1++;
-        s2++;
-    }
-    return *s1 - *s2;
-}
+#include "smp.h"
+#include "spinlock.h"
 
 /**
  * strtok() is a function that splits a string into tokens based on a delimiter.
@@ -30,36 +24,96 @@ char *strtok(char *str, char delim) {
     return ret;
 }
 
-unsigned int strlen(const char *s) {
-    unsigned int len = 0;
-    while (*s++) len++;
-    return len;
-}
-
 char* strdup(const char *s) {
-    unsigned int len = strlen(s);
+    size_t len = strlen(s);
     char *dup = (char*)alloc(len + 1);
     if (dup == NULL) return NULL;
-    for (unsigned int i = 0; i < len; i++) {
-        dup[i] = s[i];
-    }
-    dup[len] = '\0';
+    memcpy(dup, s, len + 1);
     return dup;
 }
 
+// q0 - q31 of the interrupted context, while the core is in a SIMD section
+static unsigned char neon_save_area[NR_CPUS][32 * 16] __attribute__((aligned(16)));
 
-void *memset(void *s, int c, unsigned int n) {
-    unsigned char *p = s;
-    while (n--) {
-        *p++ = (unsigned char)c;
-    }
-    return s;
+/**
+ * kernel_neon_begin - Let the kernel use the FP/SIMD registers
+ *
+ * They hold the state of the user task, which the kernel does not save on
+ * a switch, so they are saved to a per-core area here. IRQs stay masked
+ * until `kernel_neon_end`, so nothing else on the core can get in between.
+ * Keep the section short, and only touch kernel memory in it: a page fault
+ * would run with IRQs masked.
+ */
+static unsigned long kernel_neon_begin() {
+    unsigned long flags = local_irq_save();
+    unsigned char *area = neon_save_area[get_cpu_id()];
+    asm volatile(
+        "stp q0, q1, [%0, #32 * 0]\n"
+        "stp q2, q3, [%0, #32 * 1]\n"
+        "stp q4, q5, [%0, #32 * 2]\n"
+        "stp q6, q7, [%0, #32 * 3]\n"
+        "stp q8, q9, [%0, #32 * 4]\n"
+        "stp q10, q11, [%0, #32 * 5]\n"
+        "stp q12, q13, [%0, #32 * 6]\n"
+        "stp q14, q15, [%0, #32 * 7]\n"
+        "stp q16, q17, [%0, #32 * 8]\n"
+        "stp q18, q19, [%0, #32 * 9]\n"
+        "stp q20, q21, [%0, #32 * 10]\n"
+        "stp q22, q23, [%0, #32 * 11]\n"
+        "stp q24, q25, [%0, #32 * 12]\n"
+        "stp q26, q27, [%0, #32 * 13]\n"
+        "stp q28, q29, [%0, #32 * 14]\n"
+        "stp q30, q31, [%0, #32 * 15]\n"
+        : : "r"(area) : "memory"
+    );
+    return flags;
+}
+
+static void kernel_neon_end(unsigned long flags) {
+    unsigned char *area = neon_save_area[get_cpu_id()];
+    asm volatile(
+        "ldp q0, q1, [%0, #32 * 0]\n"
+        "ldp q2, q3, [%0, #32 * 1]\n"
+        "ldp q4, q5, [%0, #32 * 2]\n"
+        "ldp q6, q7, [%0, #32 * 3]\n"
+        "ldp q8, q9, [%0, #32 * 4]\n"
+        "ldp q10, q11, [%0, #32 * 5]\n"
+        "ldp q12, q13, [%0, #32 * 6]\n"
+        "ldp q14, q15, [%0, #32 * 7]\n"
+        "ldp q16, q17, [%0, #32 * 8]\n"
+        "ldp q18, q19, [%0, #32 * 9]\n"
+        "ldp q20, q21, [%0, #32 * 10]\n"
+        "ldp q22, q23, [%0, #32 * 11]\n"
+        "ldp q24, q25, [%0, #32 * 12]\n"
+        "ldp q26, q27, [%0, #32 * 13]\n"
+        "ldp q28, q29, [%0, #32 * 14]\n"
+        "ldp q30, q31, [%0, #32 * 15]\n"
+        : : "r"(area) : "memory"
+    );
+    local_irq_restore(flags);
 }
 
-void memcpy(void *dest, void *src, unsigned int n) {
-    unsigned char *d = dest;
-    unsigned char *s = src;
-    while (n--) {
-        *d++ = *s++;
+/**
+ * memcpy_neon - memcpy for large copies between kernel buffers
+ *
+ * Moves 128 bytes per iteration through the SIMD registers. Saving them
+ * first costs about as much as copying 512 bytes, so short copies go to
+ * `memcpy`. Long copies are split in `NEON_COPY_CHUNK` sections so IRQs
+ * are not held off for long. Not for user memory, see `kernel_neon_begin`.
+ */
+void *memcpy_neon(void *dest, const void *src, size_t n) {
+    if (n < NEON_COPY_MIN) return memcpy(dest, src, n);
+
+    char *d = dest;
+    const char *s = src;
+    size_t bulk = n & ~127UL;
+    for (size_t done = 0; done < bulk; ) {
+        size_t len = bulk - done < NEON_COPY_CHUNK ? bulk - done : NEON_COPY_CHUNK;
+        unsigned long flags = kernel_neon_begin();
+        __memcpy_neon(d + done, s + done, len);
+        kernel_neon_end(flags);
+        done += len;
     }
-}
\ No newline at end of file
+    if (bulk != n) memcpy(d + bulk, s + bulk, n - bulk);
+    return dest;
+}
@@ -0,0 +1,30 @@
+#include "string.h"
+
+/**
+ * SIMD routines of the kernel library
+ *
+ * This file is built without -mgeneral-regs-only (see the Makefile), so the
+ * compiler is free to use the FP/SIMD registers anywhere in it. Everything
+ * here must only be called between `kernel_neon_begin` and
+ * `kernel_neon_end`, through the wrappers in string.c.
+ */
+
+typedef unsigned char v16u8 __attribute__((vector_size(16), aligned(1), may_alias));
+
+/**
+ * __memcpy_neon - Copy `n` bytes, a multiple of 128, through q registers
+ *
+ * Each iteration loads eight 16-byte vectors before storing them, so that
+ * the loads of the next ones can be in flight while the stores drain.
+ */
+void __memcpy_neon(void *dest, const void *src, size_t n) {
+    v16u8 *d = dest;
+    const v16u8 *s = src;
+
+    for (; n != 0; n -= 128, d += 8, s += 8) {
+        v16u8 a0 = s[0], a1 = s[1], a2 = s[2], a3 = s[3];
+        v16u8 a4 = s[4], a5 = s[5], a6 = s[6], a7 = s[7];
+        d[0] = a0; d[1] = a1; d[2] = a2; d[3] = a3;
+        d[4] = a4; d[5] = a5; d[6] = a6; d[7] = a7;
+    }
+}
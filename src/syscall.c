@@ -1,7 +1,6 @@
 #include "syscall.h"
-
-extern struct ThreadTask *ready_queue;
-extern unsigned int thread_cnt;
+#include "klog.h"
+#include "kprintf.h"
 
 void sys_getpid(struct TrapFrame *trapframe) {
     // uart_puts("sys_getpid called\r\n");
@@ -68,9 +67,16 @@ void sys_exec(struct TrapFrame *trapframe) {
         uart_puts("[WARN] sys_exec: name is empty\r\n");
         return -1;
     }
-    _exec(name);
+    trapframe->x[0] = _exec(name, trapframe);
 }
 
+/**
+ * sys_fork - Create a child process sharing the address space copy-on-write
+ *
+ * The child does not inherit the kernel stack of the parent, it starts from
+ * `ret_from_fork` with a copy of the trapframe, so it returns to the same
+ * user context with `x0 = 0`. User pages are only copied when written.
+ */
 void sys_fork(struct TrapFrame *trapframe) {
     // uart_puts("sys_fork called\r\n");
     struct ThreadTask *parent_thread = get_current();
@@ -78,6 +84,11 @@ void sys_fork(struct TrapFrame *trapframe) {
         uart_puts("Current task is NULL\r\n");
         return;
     }
+    if (parent_thread->pgd == NULL) {
+        uart_puts("[WARN] sys_fork: kernel threads cannot fork\r\n");
+        trapframe->x[0] = -1;
+        return;
+    }
 
     // Fork a new thread
     struct ThreadTask *child_thread = (struct ThreadTask *)alloc(sizeof(struct ThreadTask));
@@ -86,8 +97,10 @@ void sys_fork(struct TrapFrame *trapframe) {
         trapframe->x[0] = -1;
         return;
     }
+    memset(child_thread, 0, sizeof(struct ThreadTask));
 
-    child_thread->id = thread_cnt++;
+    child_thread->id = alloc_pid();
+    child_thread->cpu = sched_pick_cpu();
     child_thread->state = TASK_READY;
     child_thread->counter = parent_thread->counter;
     child_thread->priority = parent_thread->priority;
@@ -99,47 +112,60 @@ void sys_fork(struct TrapFrame *trapframe) {
         trapframe->x[0] = -1;
         return;
     }
-    child_thread->user_stack = alloc(THREAD_STACK_SIZE);
-    if (child_thread->user_stack == NULL) {
-        uart_puts("Failed to allocate memory for new task user stack\r\n");
+
+    // The child sees the same pages at the same virtual addresses
+    child_thread->pgd = pgd_alloc();
+    if (child_thread->pgd == NULL || copy_user_space(child_thread->pgd, parent_thread->pgd) != 0) {
+        uart_puts("Failed to copy the address space for new task\r\n");
+        pgd_free(child_thread->pgd);
+        free(child_thread->kernel_stack);
+        free(child_thread);
+        tlb_flush_asid(parent_thread->asid);
+        trapframe->x[0] = -1;
+        return;
+    }
+    tlb_flush_asid(parent_thread->asid);  // The parent's writable pages are read-only now
+    if (vma_copy_list(&child_thread->vma_list, parent_thread->vma_list) != 0) {
+        uart_puts("Failed to copy the memory areas for new task\r\n");
+        vma_free_list(&child_thread->vma_list);  // The areas copied so far
+        pgd_free(child_thread->pgd);
         free(child_thread->kernel_stack);
         free(child_thread);
         trapframe->x[0] = -1;
         return;
     }
+    child_thread->brk = parent_thread->brk;
+    child_thread->uring = parent_thread->uring;  // Same address in the copied address space
 
     child_thread->pending_sig = parent_thread->pending_sig;
     for (int i = 0; i < SIG_NUM; i++) {
         child_thread->sig_handlers[i] = parent_thread->sig_handlers[i];
     }
+    child_thread->sig_frame = (struct TrapFrame *)alloc(sizeof(struct TrapFrame));
+    if (child_thread->sig_frame == NULL) {
+        uart_puts("Failed to allocate memory for new task signal frame\r\n");
+        vma_free_list(&child_thread->vma_list);
+        pgd_free(child_thread->pgd);
+        free(child_thread->kernel_stack);
+        free(child_thread);
+        trapframe->x[0] = -1;
+        return;
+    }
+    child_thread->cwd = parent_thread->cwd;
     child_thread->next = NULL;
 
-    memcpy(&child_thread->cpu_context, &parent_thread->cpu_context, sizeof(struct cpu_context));
-    
-    // Copy stack
-    memcpy(child_thread->user_stack, parent_thread->user_stack, THREAD_STACK_SIZE);
-    memcpy(child_thread->kernel_stack, parent_thread->kernel_stack, THREAD_STACK_SIZE);
-
-    // Set sp
-    unsigned long curr_sp;
-    asm volatile("mov %0, sp" : "=r"(curr_sp));
-    unsigned long curr_sp_offset = curr_sp - (unsigned long)parent_thread->kernel_stack;
-    child_thread->cpu_context.sp = (unsigned long)child_thread->kernel_stack + curr_sp_offset;
-    child_thread->cpu_context.fp = parent_thread->cpu_context.fp;
-
-    struct TrapFrame *child_frame = (struct TrapFrame *)(child_thread->kernel_stack + ((void*)trapframe - parent_thread->kernel_stack));
+    struct TrapFrame *child_frame = (struct TrapFrame *)(child_thread->kernel_stack + THREAD_STACK_SIZE) - 1;
     memcpy(child_frame, trapframe, sizeof(struct TrapFrame));
     child_frame->x[0] = 0;
-    child_frame->sp_el0 = (unsigned long)(child_thread->user_stack + ((void*)trapframe->sp_el0 - parent_thread->user_stack));  // Set the stack pointer to the new task's stack
-    child_thread->cpu_context.lr = &&SYSCALL_FORK_END;
 
-    add_thread_task(&ready_queue, child_thread);
+    child_thread->cpu_context.lr = (unsigned long)ret_from_fork;
+    child_thread->cpu_context.sp = (unsigned long)child_frame;
+    child_thread->cpu_context.ttbr0 = (unsigned long)kernel_pgd;  // Replaced by `schedule`
 
-    trapframe->x[0] = child_thread->id;  // return child_thread->id
+    pid_hash_add(child_thread);
+    add_ready_task(child_thread);
 
-SYSCALL_FORK_END:
-    asm volatile("nop");
-    return;
+    trapframe->x[0] = child_thread->id;  // return child_thread->id
 }
 
 void sys_exit(struct TrapFrame *trapframe) {
@@ -147,26 +173,48 @@ void sys_exit(struct TrapFrame *trapframe) {
     _exit();
 }
 
+/**
+ * sys_mbox_call - Run a mailbox request of the calling process
+ *
+ * The GPU only sees bus addresses, not the user mapping of `mbox`, so the
+ * request is copied into an aligned buffer on the kernel stack, which is
+ * identity mapped, and the response is copied back.
+ */
 void sys_mbox_call(struct TrapFrame *trapframe) {
     uart_puts("sys_mbox_call called\r\n");
     unsigned char channel = (unsigned char)trapframe->x[0];
     unsigned int *mbox = (unsigned int *)trapframe->x[1];
+    unsigned int __attribute__((aligned(16))) buf[MBOX_BUF_WORDS];
+    trapframe->x[0] = -1;
     if (mbox == NULL) {
         uart_puts("[WARN] sys_mbox_call: mbox is NULL\r\n");
-        return -1;
+        return;
     }
     if (channel > 16) {
         uart_puts("[WARN] sys_mbox_call: channel is invalid\r\n");
-        return -1;
+        return;
     }
-    
-    int ret = mailbox_call(mbox, channel);
+
+    struct VMArea *vma = vma_find(get_current()->vma_list, (unsigned long)mbox);
+    if (((unsigned long)mbox & 0x3) || vma == NULL || (unsigned long)mbox + 8 > vma->end || (vma->prot & PD_AP_RO) || (vma->flags & VMA_NOACCESS)) {
+        uart_puts("[WARN] sys_mbox_call: mbox is not writable\r\n");
+        return;
+    }
+    unsigned int size = mbox[0];
+    if (size < 8 || size > sizeof(buf) || (size & 0x3) || (unsigned long)mbox + size > vma->end) {
+        uart_puts("[WARN] sys_mbox_call: size is invalid\r\n");
+        return;
+    }
+
+    memcpy(buf, mbox, size);
+    int ret = mailbox_call(buf, channel);
+    memcpy(mbox, buf, size);
     if (ret == 0) {
         uart_puts("[WARN] sys_mbox_call: mailbox call failed\r\n");
-        return -1;
+        return;
     }
 
-    trapframe->x[0] = mbox[1];  // return mbox[1]
+    trapframe->x[0] = buf[1];  // return mbox[1]
 }
 
 void sys_kill(struct TrapFrame *trapframe) {
@@ -185,18 +233,16 @@ void sys_signal(struct TrapFrame *trapframe) {
     sighandler_t handler = (sighandler_t)trapframe->x[1];
     struct ThreadTask *curr = get_current();
     if (curr == NULL) {
-        uart_puts("[WARN] sys_signal: current task is NULL\r\n");
+        klog_warn("sys_signal: current task is NULL");
         return;
     }
     
     if (sig < 0 || sig >= SIG_NUM) {
-        uart_puts("[WARN] sys_signal: invalid signal number\r\n");
+        klog_warn("sys_signal: invalid signal number %d", sig);
         return;
     }
 
-    uart_puts("[INFO] sys_signal: setting signal handler, new handler @");
-    uart_hex((unsigned long)handler);
-    uart_puts("\r\n");
+    klog_info("sys_signal: setting signal handler, new handler @%p", handler);
     
     sighandler_t old_handler = curr->sig_handlers[sig];
     curr->sig_handlers[sig] = handler;
@@ -209,18 +255,19 @@ void sys_sigkill(struct TrapFrame *trapframe) {
     int pid = (int)trapframe->x[0];
     int sig = (int)trapframe->x[1];
 
-    struct ThreadTask *task = get_thread_task_by_id(pid);
-    if (task == NULL) {
-        uart_puts("[WARN] sys_sigkill: task not found\r\n");
+    if (sig < 0 || sig >= SIG_NUM) {
+        uart_puts("[WARN] sys_sigkill: invalid signal number\r\n");
         return;
     }
 
-    if (sig < 0 || sig >= SIG_NUM) {
-        uart_puts("[WARN] sys_sigkill: invalid signal number\r\n");
+    unsigned long flags;
+    struct ThreadTask *task = get_thread_task_by_id(pid, &flags);
+    if (task == NULL) {
+        uart_puts("[WARN] sys_sigkill: task not found\r\n");
         return;
     }
-    
-    task->pending_sig |= (1 << sig);  // Set the pending signal
+    __atomic_or_fetch(&task->pending_sig, 1U << sig, __ATOMIC_RELAXED);  // Set the pending signal
+    put_thread_task(flags);
 }
 
 void sys_sigreturn(struct TrapFrame *trapframe) {
@@ -459,6 +506,234 @@ void sys_ioctl(struct TrapFrame *trapframe) {
     }
 }
 
+void sys_brk(struct TrapFrame *trapframe) {
+    unsigned long addr = trapframe->x[0];
+    trapframe->x[0] = vm_brk(get_current(), addr);  // The new break, unchanged on failure
+}
+
+void sys_sbrk(struct TrapFrame *trapframe) {
+    long increment = (long)trapframe->x[0];
+    struct ThreadTask *curr = get_current();
+    unsigned long old_brk = curr->brk;
+
+    if (increment != 0 && vm_brk(curr, old_brk + increment) != old_brk + increment) {
+        uart_puts("[WARN] sys_sbrk: cannot move the break\r\n");
+        trapframe->x[0] = -1;
+        return;
+    }
+    trapframe->x[0] = old_brk;  // return the previous break
+}
+
+void sys_mmap(struct TrapFrame *trapframe) {
+    unsigned long addr = trapframe->x[0];
+    unsigned long len = trapframe->x[1];
+    int prot = (int)trapframe->x[2];
+    int flags = (int)trapframe->x[3];
+    int fd = (int)trapframe->x[4];
+    unsigned long offset = trapframe->x[5];
+
+    struct ThreadTask *curr = get_current();
+    struct vnode *vnode = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (fd < 0 || fd >= THREAD_MAX_FD || curr->fd_table[fd] == NULL) {
+            uart_puts("[WARN] sys_mmap: invalid file descriptor\r\n");
+            trapframe->x[0] = (unsigned long)MAP_FAILED;
+            return;
+        }
+        vnode = curr->fd_table[fd]->vnode;
+    }
+
+    trapframe->x[0] = vm_mmap(curr, addr, len, prot, flags, vnode, offset);
+    if (trapframe->x[0] == (unsigned long)MAP_FAILED) {
+        uart_puts("[WARN] sys_mmap: mmap failed\r\n");
+    }
+}
+
+void sys_munmap(struct TrapFrame *trapframe) {
+    unsigned long addr = trapframe->x[0];
+    unsigned long len = trapframe->x[1];
+    trapframe->x[0] = vm_munmap(get_current(), addr, len);
+}
+
+static const syscall_fn_t syscall_table[NR_SYSCALLS] = {
+    [SYS_GETPID_NUM]    = sys_getpid,
+    [SYS_UART_READ_NUM] = sys_uart_read,
+    [SYS_UART_WRITE_NUM]= sys_uart_write,
+    [SYS_EXEC_NUM]      = sys_exec,
+    [SYS_FORK_NUM]      = sys_fork,
+    [SYS_EXIT_NUM]      = sys_exit,
+    [SYS_MBOX_CALL_NUM] = sys_mbox_call,
+    [SYS_KILL_NUM]      = sys_kill,
+    [SYS_SIGNAL_NUM]    = sys_signal,
+    [SYS_SIGKILL_NUM]   = sys_sigkill,
+    [SYS_SIGRETURE_NUM] = sys_sigreturn,
+    [SYS_OPEN_NUM]      = sys_open,
+    [SYS_CLOSE_NUM]     = sys_close,
+    [SYS_WRITE_NUM]     = sys_write,
+    [SYS_READ_NUM]      = sys_read,
+    [SYS_MKDIR_NUM]     = sys_mkdir,
+    [SYS_MOUNT_NUM]     = sys_mount,
+    [SYS_CHDIR_NUM]     = sys_chdir,
+    [SYS_LSEEK64_NUM]   = sys_lseek64,
+    [SYS_IOCTL_NUM]     = sys_ioctl,
+    [SYS_BRK_NUM]       = sys_brk,
+    [SYS_SBRK_NUM]      = sys_sbrk,
+    [SYS_MMAP_NUM]      = sys_mmap,
+    [SYS_MUNMAP_NUM]    = sys_munmap,
+    [SYS_URING_SETUP_NUM] = sys_uring_setup,
+    [SYS_URING_ENTER_NUM] = sys_uring_enter,
+};
+
+static const char *const syscall_names[NR_SYSCALLS] = {
+    "getpid", "uart_read", "uart_write", "exec", "fork", "exit", "mbox_call", "kill",
+    "signal", "sigkill", "sigreturn", "open", "close", "write", "read", "mkdir",
+    "mount", "chdir", "lseek64", "ioctl", "brk", "sbrk", "mmap", "munmap",
+    "uring_setup", "uring_enter",
+};
+
+// Syscalls a ring may run: plain I/O, nothing that changes the control flow or the address space
+#define URING_ALLOWED   ((1UL << SYS_GETPID_NUM) | (1UL << SYS_UART_READ_NUM) | (1UL << SYS_UART_WRITE_NUM) | \
+                         (1UL << SYS_OPEN_NUM) | (1UL << SYS_CLOSE_NUM) | (1UL << SYS_WRITE_NUM) | \
+                         (1UL << SYS_READ_NUM) | (1UL << SYS_MKDIR_NUM) | (1UL << SYS_MOUNT_NUM) | \
+                         (1UL << SYS_CHDIR_NUM) | (1UL << SYS_LSEEK64_NUM) | (1UL << SYS_IOCTL_NUM))
+
+// Per core, so the counting never bounces a cache line between cores. Tasks do not migrate,
+// but a task preempted in its syscall lets others on the core count, hence the atomic adds
+static struct SyscallStat syscall_stats[NR_CPUS][NR_SYSCALLS];
+
+/**
+ * syscall_dispatch - Run syscall `syscall_num` (checked by the caller) and account for it
+ *
+ * The time spent in the handler is measured with `cntpct_el0`, it includes
+ * the time the task was blocked in it. `exit` never returns and is only
+ * counted.
+ */
+static void syscall_dispatch(unsigned long syscall_num, struct TrapFrame *trapframe) {
+    struct SyscallStat *stat = &syscall_stats[get_cpu_id()][syscall_num];
+    __atomic_add_fetch(&stat->count, 1, __ATOMIC_RELAXED);
+
+    unsigned long long start = get_tick();
+    syscall_table[syscall_num](trapframe);
+    unsigned long long ticks = get_tick() - start;
+
+    int bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+    if (bucket >= SYSCALL_HIST_BUCKETS) bucket = SYSCALL_HIST_BUCKETS - 1;
+    __atomic_add_fetch(&stat->ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat->hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Dispatch the syscall numbered by `x8` through `syscall_table`
+void syscall_entry(struct TrapFrame *trapframe) {
+    unsigned long syscall_num = trapframe->x[8];  // x8 contains the syscall number
+    if (syscall_num >= NR_SYSCALLS) {
+        kprintf("Unknown syscall number: %lu\r\n", syscall_num);
+        trapframe->x[0] = -1;
+        return;
+    }
+    syscall_dispatch(syscall_num, trapframe);
+}
+
+/**
+ * sys_uring_setup - Register the syscall ring of the calling process
+ *
+ * The ring stays in user memory, it must lie in one writable area. Its
+ * indices are reset. A new ring replaces the previous one.
+ */
+void sys_uring_setup(struct TrapFrame *trapframe) {
+    struct uring *ring = (struct uring *)trapframe->x[0];
+    struct ThreadTask *curr = get_current();
+    trapframe->x[0] = -1;
+
+    unsigned long start = (unsigned long)ring, end = start + sizeof(struct uring);
+    struct VMArea *vma = vma_find(curr->vma_list, start);
+    if ((start & 0x7) || vma == NULL || end > vma->end || (vma->prot & PD_AP_RO) || (vma->flags & VMA_NOACCESS)) {
+        return;
+    }
+
+    ring->sq_head = 0;
+    ring->sq_tail = 0;
+    ring->cq_head = 0;
+    ring->cq_tail = 0;
+    curr->uring = ring;
+    trapframe->x[0] = 0;
+}
+
+/**
+ * sys_uring_enter - Run up to `to_submit` queued syscalls of the ring
+ *
+ * Entries are copied out of the SQ before they run, so the process may
+ * reuse a slot as soon as `sq_head` passed it. Stops early when the CQ is
+ * full.
+ *
+ * @return Number of entries consumed, -1 without a ring
+ */
+void sys_uring_enter(struct TrapFrame *trapframe) {
+    unsigned int to_submit = (unsigned int)trapframe->x[0];
+    struct uring *ring = get_current()->uring;
+    if (ring == NULL) {
+        trapframe->x[0] = -1;
+        return;
+    }
+
+    unsigned int head = ring->sq_head;
+    unsigned int tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    unsigned int cq_tail = ring->cq_tail;
+    unsigned int done = 0;
+
+    while (head != tail && done < to_submit) {
+        if (cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) >= URING_CQ_ENTRIES) break;
+
+        struct uring_sqe sqe = ring->sqes[head % URING_SQ_ENTRIES];
+        head++;
+        __atomic_store_n(&ring->sq_head, head, __ATOMIC_RELEASE);
+
+        long res = -1;
+        if (sqe.opcode < NR_SYSCALLS && (URING_ALLOWED & (1UL << sqe.opcode))) {
+            struct TrapFrame frame;
+            memset(&frame, 0, sizeof(frame));
+            for (int i = 0; i < 4; i++) frame.x[i] = sqe.args[i];
+            frame.x[8] = sqe.opcode;
+            syscall_dispatch(sqe.opcode, &frame);
+            res = frame.x[0];
+        }
+
+        struct uring_cqe *cqe = &ring->cqes[cq_tail % URING_CQ_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->res = res;
+        cq_tail++;
+        __atomic_store_n(&ring->cq_tail, cq_tail, __ATOMIC_RELEASE);
+        done++;
+    }
+
+    trapframe->x[0] = done;
+}
+
+// Print the counters of every syscall that was called, summed over the cores
+void print_syscall_stats() {
+    kprintf("Syscall statistics (unit: %llu ticks per us)\r\n", get_freq() / 1000000);
+
+    for (int nr = 0; nr < NR_SYSCALLS; nr++) {
+        struct SyscallStat sum;
+        memset(&sum, 0, sizeof(sum));
+        for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+            struct SyscallStat *stat = &syscall_stats[cpu][nr];
+            sum.count += stat->count;
+            sum.ticks += stat->ticks;
+            for (int b = 0; b < SYSCALL_HIST_BUCKETS; b++) sum.hist[b] += stat->hist[b];
+        }
+        if (sum.count == 0) continue;
+
+        kprintf("%s: calls %lu, total ticks %llu\r\n", syscall_names[nr], sum.count, sum.ticks);
+        char line[KPRINTF_BUF_SIZE];
+        int len = ksnprintf(line, sizeof(line), "    log2 ticks:");
+        for (int b = 0; b < SYSCALL_HIST_BUCKETS; b++) {
+            if (sum.hist[b] == 0) continue;
+            len += ksnprintf(line + len, sizeof(line) - len, " [%d] %lu", b, sum.hist[b]);
+        }
+        kprintf("%s\r\n", line);
+    }
+}
+
 /* Wrapper function for syscall */
 int get_pid() {
     int ret;
@@ -719,4 +994,74 @@ int ioctl(int fd, unsigned long request, void *argp) {
         : "r"(fd), "r"(request), "r"(argp)
     );
     return ret;
-}
\ No newline at end of file
+}
+
+int brk(void *addr) {
+    unsigned long ret;
+    asm volatile(
+        "mov x8, 20 \n"
+        "mov x0, %1 \n"
+        "svc 0      \n"
+        "mov %0, x0 \n"
+        : "=r"(ret)
+        : "r"(addr)
+    );
+    return ret == (unsigned long)addr ? 0 : -1;
+}
+
+void* sbrk(long increment) {
+    void *ret;
+    asm volatile(
+        "mov x8, 21 \n"
+        "mov x0, %1 \n"
+        "svc 0      \n"
+        "mov %0, x0 \n"
+        : "=r"(ret)
+        : "r"(increment)
+    );
+    return ret;
+}
+
+void* mmap(void *addr, unsigned long len, int prot, int flags, int fd, long offset) {
+    register unsigned long x0 asm("x0") = (unsigned long)addr;
+    register unsigned long x1 asm("x1") = len;
+    register unsigned long x2 asm("x2") = prot;
+    register unsigned long x3 asm("x3") = flags;
+    register unsigned long x4 asm("x4") = fd;
+    register unsigned long x5 asm("x5") = offset;
+    asm volatile("mov x8, 22\nsvc 0" : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3), "r"(x4), "r"(x5) : "x8", "memory");
+    return (void *)x0;
+}
+
+int munmap(void *addr, unsigned long len) {
+    register unsigned long x0 asm("x0") = (unsigned long)addr;
+    register unsigned long x1 asm("x1") = len;
+    asm volatile("mov x8, 23\nsvc 0" : "+r"(x0) : "r"(x1) : "x8", "memory");
+    return (int)x0;
+}
+
+int uring_setup(struct uring *ring) {
+    int ret;
+    asm volatile(
+        "mov x8, 24 \n"
+        "mov x0, %1 \n"
+        "svc 0      \n"
+        "mov %0, x0 \n"
+        : "=r"(ret)
+        : "r"(ring)
+    );
+    return ret;
+}
+
+int uring_enter(unsigned int to_submit) {
+    int ret;
+    asm volatile(
+        "mov x8, 25 \n"
+        "mov x0, %1 \n"
+        "svc 0      \n"
+        "mov %0, x0 \n"
+        : "=r"(ret)
+        : "r"((unsigned long)to_submit)
+    );
+    return ret;
+}
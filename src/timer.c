@@ -1,17 +1,43 @@
 #include "timer.h"
+#include "irq.h"
+#include "softirq.h"
+#include "kprintf.h"
 
 #define TIMER_MSG_SIZE 64
 
-struct Timer {
-    struct Timer* prev;
-    struct Timer* next;
+/**
+ * Hierarchical timing wheel
+ *   One per core. A wheel tick (jiffy) is `freq >> WHEEL_JIFFY_SHIFT` counter
+ *   ticks (about 1ms). Level `l` has 64 slots of 64^l jiffies each, a timer goes
+ *   to the lowest level whose range covers its delay. When level 0 wraps, the
+ *   current slot of the next level is cascaded down. Insert and cancel are
+ *   O(1): a slot is a doubly linked list and a bitmap per level tracks the
+ *   non-empty slots, which also gives the next expiry for the dynamic tick.
+ */
+#define WHEEL_JIFFY_SHIFT   10
+#define WHEEL_LEVELS        4
+#define WHEEL_BITS          6
+#define WHEEL_SIZE          (1 << WHEEL_BITS)
+#define WHEEL_MASK          (WHEEL_SIZE - 1)
+#define WHEEL_MAX_DELAY     ((1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1)  // In jiffies, about 4.6 hours
+
+struct TimerBase {
+    spinlock_t lock;
+    unsigned long long clk;                     // Next jiffy to process
+    unsigned long pending[WHEEL_LEVELS];        // Bit `i` is set while `slots[level][i]` is not empty
+    struct Timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+// Timer armed by `add_timer`, owns a copy of the message and is freed once it fired
+struct MsgTimer {
+    struct Timer timer;
     timer_callback callback;
     char msg[TIMER_MSG_SIZE];
-    unsigned long long expiration;  // Unit: tick
 };
 
-static struct Timer* timer_head = NULL;
-static int need_schedule = 0;
+static struct TimerBase timer_bases[NR_CPUS];
+static unsigned long long jiffy_ticks;           // Counter ticks per jiffy
+static struct Timer sched_ticks[NR_CPUS];        // Scheduler tick of each core, pending while ticking
 
 void timer_enable_irq() {
     // uart_puts("Enabling timer IRQ @");
@@ -19,7 +45,7 @@ void timer_enable_irq() {
     // uart_puts("\r\n");
 
     asm volatile("msr cntp_ctl_el0, %0"::"r"(1));
-    *CORE0_TIMER_IRQ_CTRL = (1 << 1);
+    *CORE_TIMER_IRQ_CTRL(get_cpu_id()) = (1 << 1);
 }
 
 void timer_disable_irq() {
@@ -28,7 +54,7 @@ void timer_disable_irq() {
     // uart_puts("\r\n");
 
     asm volatile("msr cntp_ctl_el0, %0"::"r"(0));
-    *CORE0_TIMER_IRQ_CTRL &= ~(1 << 1);
+    *CORE_TIMER_IRQ_CTRL(get_cpu_id()) &= ~(1 << 1);
 }
 
 void set_timer_irq(unsigned long long tick) {
@@ -40,89 +66,287 @@ void print_msg(char* msg) {
     unsigned long long curr_tick = get_tick();
     unsigned long long freq = get_freq();
 
-    uart_puts("Timer expired: ");
-    uart_puts(msg);
-    uart_puts(" at time: ");
-    uart_hex(curr_tick / freq);
-    uart_puts(" sec.\r\n");
+    kprintf("Timer expired: %s at time: %llu sec.\r\n", msg, curr_tick / freq);
 }
 
 void print_uptime(char* _) {
     unsigned long long curr_tick = get_tick();
     unsigned long long freq = get_freq();
 
-    uart_puts("Uptime: ");
-    uart_hex(curr_tick / freq);
-    uart_puts(" sec.\r\n");
+    kprintf("Uptime: %llu sec.\r\n", curr_tick / freq);
 
     add_timer(print_uptime, NULL, 2 * freq);
 }
 
-void keep_schedule(char* _) {
-    add_timer(keep_schedule, NULL, get_freq() >> 8);
-    need_schedule = 1;
+static unsigned long long tick_to_jiffy(unsigned long long tick) {
+    return (tick + jiffy_ticks - 1) / jiffy_ticks;  // Round up, never fire early
 }
 
-void timer_init() {
-    timer_enable_irq();
+// Link `timer` into the slot of its expiry, called with the lock of `base` held
+static void enqueue_timer(struct TimerBase *base, struct Timer *timer) {
+    unsigned long long expires = tick_to_jiffy(timer->expiration);
+    if (expires < base->clk) expires = base->clk;  // Already due, fire on the next run
+    unsigned long long delta = expires - base->clk;
+    if (delta > WHEEL_MAX_DELAY) {
+        expires = base->clk + WHEEL_MAX_DELAY;
+        delta = WHEEL_MAX_DELAY;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_BITS))) {
+        level++;
+    }
+    int idx = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+
+    struct Timer **slot = &base->slots[level][idx];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) (*slot)->prev = timer;
+    *slot = timer;
+    base->pending[level] |= 1UL << idx;
+
+    timer->slot = level * WHEEL_SIZE + idx;
+    timer->base = base;
+}
+
+// Unlink a pending `timer`, called with the lock of its base held
+static void detach_timer(struct TimerBase *base, struct Timer *timer) {
+    int level = timer->slot / WHEEL_SIZE, idx = timer->slot % WHEEL_SIZE;
+
+    if (timer->prev != NULL) timer->prev->next = timer->next;
+    else base->slots[level][idx] = timer->next;
+    if (timer->next != NULL) timer->next->prev = timer->prev;
+    if (base->slots[level][idx] == NULL) base->pending[level] &= ~(1UL << idx);
+
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->slot = -1;
+}
+
+// Lock the base `timer` is pending on, NULL if it is not pending
+static struct TimerBase* lock_timer_base(struct Timer *timer, unsigned long *flags) {
+    while (1) {
+        struct TimerBase *base = timer->base;
+        if (base == NULL) return NULL;
+        *flags = spin_lock_irqsave(&base->lock);
+        if (timer->base == base) return base;
+        spin_unlock_irqrestore(&base->lock, *flags);  // Moved meanwhile, retry
+    }
+}
+
+// Move the timers of the current slot of `level` down, they now fit a lower level
+static void cascade(struct TimerBase *base, int level) {
+    int idx = (base->clk >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    struct Timer *timer = base->slots[level][idx];
+    base->slots[level][idx] = NULL;
+    base->pending[level] &= ~(1UL << idx);
+
+    while (timer != NULL) {
+        struct Timer *next = timer->next;
+        enqueue_timer(base, timer);
+        timer = next;
+    }
+}
+
+/**
+ * run_timers - Fire the expired timers of this core
+ *
+ * Walks the jiffies up to now, skipping runs of empty level 0 slots. The
+ * callbacks run without the base lock, so they may re-arm or delete timers.
+ */
+static void run_timers() {
+    struct TimerBase *base = &timer_bases[get_cpu_id()];
+    unsigned long long now = get_tick() / jiffy_ticks;
+
+    unsigned long flags = spin_lock_irqsave(&base->lock);
+    while (base->clk <= now) {
+        int idx = base->clk & WHEEL_MASK;
+
+        // Level 0 wrapped, pull the timers that are now within reach
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (((base->clk >> ((level - 1) * WHEEL_BITS)) & WHEEL_MASK) != 0) break;
+            cascade(base, level);
+        }
+
+        while (base->slots[0][idx] != NULL) {
+            struct Timer *timer = base->slots[0][idx];
+            detach_timer(base, timer);
+            timer->base = NULL;
+            spin_unlock_irqrestore(&base->lock, flags);
+
+            timer->callback(timer);  // May re-arm `timer`, or free it
+
+            flags = spin_lock_irqsave(&base->lock);
+        }
+
+        // Skip to the next non-empty slot of level 0, or to the next wrap
+        unsigned long rest = (idx == WHEEL_MASK) ? 0 : base->pending[0] >> (idx + 1);
+        unsigned long long skip = rest ? (unsigned long long)__builtin_ctzl(rest) + 1 : WHEEL_SIZE - idx;
+        base->clk = (base->clk + skip <= now + 1) ? base->clk + skip : now + 1;
+    }
+    spin_unlock_irqrestore(&base->lock, flags);
+}
+
+// Earliest jiffy at which `base` has work, a lower bound for timers of upper levels
+static unsigned long long next_timer_jiffy(struct TimerBase *base) {
+    unsigned long long next = ~0ULL;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (base->pending[level] == 0) continue;
+        unsigned long long pos = base->clk >> (level * WHEEL_BITS);
+        int idx = pos & WHEEL_MASK;
+
+        // Distance to the next set bit at or after `idx`, wrapping around
+        unsigned long rotated = (base->pending[level] >> idx) | (idx ? base->pending[level] << (WHEEL_SIZE - idx) : 0);
+        unsigned long long dist = __builtin_ctzl(rotated);
+
+        unsigned long long when = (level == 0) ? base->clk + dist : (pos + (dist ? dist : WHEEL_SIZE)) << (level * WHEEL_BITS);
+        if (when < next) next = when;
+    }
+    return next;
+}
+
+/**
+ * Dynamic tick
+ *   The timer of a core is armed for its next event only: the next timer of
+ *   its wheel, including the scheduler tick which `schedule` arms while other
+ *   tasks compete for the core. With none, the compare value is the end of
+ *   time and an idle core sleeps in `wfi` until an interrupt.
+ */
+void timer_program_next() {
+    struct TimerBase *base = &timer_bases[get_cpu_id()];
+    unsigned long flags = spin_lock_irqsave(&base->lock);
+    unsigned long long next = next_timer_jiffy(base);
+    unsigned long long cval = (next == ~0ULL) ? ~0ULL : next * jiffy_ticks;
+    asm volatile("msr cntp_cval_el0, %0" : : "r"(cval));
+    spin_unlock_irqrestore(&base->lock, flags);
+}
+
+void timer_setup(struct Timer *timer, void (*callback)(struct Timer *timer)) {
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->callback = callback;
+    timer->expiration = 0;
+    timer->slot = -1;
+    timer->base = NULL;
+}
+
+/**
+ * mod_timer - Arm `timer` to fire at counter tick `expiration`
+ *
+ * A pending timer is moved, so this also re-arms. The timer goes to the
+ * wheel of the calling core, whose callback then runs on this core.
+ */
+void mod_timer(struct Timer *timer, unsigned long long expiration) {
+    unsigned long flags;
+    struct TimerBase *base = lock_timer_base(timer, &flags);
+    if (base != NULL) {
+        detach_timer(base, timer);
+        timer->base = NULL;
+        spin_unlock_irqrestore(&base->lock, flags);
+    }
+
+    base = &timer_bases[get_cpu_id()];
+    flags = spin_lock_irqsave(&base->lock);
+    timer->expiration = expiration;
+    enqueue_timer(base, timer);
+    spin_unlock_irqrestore(&base->lock, flags);
+
+    timer_program_next();
+}
+
+// Cancel `timer`, returns 1 if it was pending. Does not wait for a running callback
+int del_timer(struct Timer *timer) {
+    unsigned long flags;
+    struct TimerBase *base = lock_timer_base(timer, &flags);
+    if (base == NULL) return 0;
+
+    detach_timer(base, timer);
+    timer->base = NULL;
+    spin_unlock_irqrestore(&base->lock, flags);
+
+    if (base == &timer_bases[get_cpu_id()]) timer_program_next();
+    return 1;
+}
+
+int timer_pending(struct Timer *timer) {
+    return timer->base != NULL;
+}
+
+static void sched_tick_callback(struct Timer *timer) {
+    mod_timer(timer, get_tick() + (get_freq() >> SCHED_TICK_SHIFT));
+    set_need_resched();
+}
+
+// Turn the periodic scheduler tick of this core on or off
+void timer_set_tick(int on) {
+    struct Timer *tick = &sched_ticks[get_cpu_id()];
+    if (!on) {
+        del_timer(tick);
+    }
+    else if (!timer_pending(tick)) {
+        mod_timer(tick, get_tick() + (get_freq() >> SCHED_TICK_SHIFT));
+    }
+}
+
+// Silence the timer until the softirq has run the wheel and re-armed it
+static void timer_irq_handler(unsigned int irq, void *dev) {
+    asm volatile("msr cntp_cval_el0, %0" : : "r"(~0ULL));
+    raise_softirq(SOFTIRQ_TIMER);
+}
+
+// Per-core part of the setup, for every core
+static void timer_init_local() {
+    unsigned int cpu = get_cpu_id();
 
     unsigned long tmp;
     asm volatile("mrs %0, cntkctl_el1" : "=r"(tmp));
     tmp |= 1;
     asm volatile("msr cntkctl_el1, %0" : : "r"(tmp));
 
-    add_timer(keep_schedule, NULL, get_freq() >> 5);
+    memset(&timer_bases[cpu], 0, sizeof(struct TimerBase));
+    spin_lock_init(&timer_bases[cpu].lock);
+    timer_bases[cpu].clk = get_tick() / jiffy_ticks;
+    timer_setup(&sched_ticks[cpu], sched_tick_callback);
+
+    timer_program_next();
+    timer_enable_irq();
+}
+
+void timer_init() {
+    jiffy_ticks = get_freq() >> WHEEL_JIFFY_SHIFT;
+    open_softirq(SOFTIRQ_TIMER, core_timer_handler);
+    request_irq(IRQ_LOCAL_CNTPNS, timer_irq_handler, "timer", NULL);
+    timer_init_local();
+}
+
+void timer_init_secondary() {
+    timer_init_local();
 }
 
 void print_timer_list() {
-    struct Timer* curr = timer_head;
+    struct TimerBase *base = &timer_bases[get_cpu_id()];
+    unsigned long flags = spin_lock_irqsave(&base->lock);
     uart_puts("Timer list:\r\n");
-    while (curr != NULL) {
-        uart_puts("Expiration: ");
-        uart_hex(curr->expiration);
-        uart_puts(", Message: ");
-        uart_puts(curr->msg);
-        uart_puts("\r\n");
-        curr = curr->next;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int idx = 0; idx < WHEEL_SIZE; idx++) {
+            for (struct Timer *curr = base->slots[level][idx]; curr != NULL; curr = curr->next) {
+                kprintf("Expiration: 0x%llx, Level: %d\r\n", curr->expiration, level);
+            }
+        }
     }
+    spin_unlock_irqrestore(&base->lock, flags);
 }
 
+// Timer softirq: fire the expired timers of this core and arm the next event
 void core_timer_handler() {
-    unsigned long long curr_tick = get_tick();
-
     // uart_puts("[Timer handler] start @ ");
-    // uart_hex(curr_tick);
+    // uart_hex(get_tick());
     // uart_puts("\r\n");
 
-    timer_disable_irq();
-    enable_irq_el1();  // Can enable IRQ in advance for other interrupts
-
-    // Clear all expired timers
-    int removed = 0;
-
-    while (timer_head != NULL && timer_head->expiration <= curr_tick) {
-        struct Timer* curr = timer_head;
-        timer_head = curr->next;
-        if (curr->next) curr->next->prev = NULL;
-        removed = 1;
-
-        curr->callback(curr->msg);
-        free(curr);
-    }
+    run_timers();
 
     // Reset the timer
-    if (removed && timer_head) {
-        set_timer_irq(timer_head->expiration - curr_tick);
-        timer_enable_irq();
-    }
-    else {
-        uart_puts("No timer to reset\r\n");
-    }
-
-    if (need_schedule) {
-        need_schedule = 0;
-        schedule();
-    }
+    timer_program_next();
 }
 
 unsigned long long get_tick() {
@@ -152,52 +376,29 @@ void set_timeout(char* msg, int sec) {
     add_timer(print_msg, msg, (unsigned long long)sec * cntfrq_el0);
 }
 
+static void msg_timer_callback(struct Timer *timer) {
+    struct MsgTimer *msg_timer = container_of(timer, struct MsgTimer, timer);
+    msg_timer->callback(msg_timer->msg);
+    free(msg_timer);
+}
+
+// One-shot timer calling `callback(msg)` in `tick` ticks, for callers without a `struct Timer` of their own
 void add_timer(timer_callback callback, char* msg, unsigned long long tick) {
-    struct Timer* new_timer = (struct Timer*)alloc(sizeof(struct Timer));
+    struct MsgTimer* new_timer = (struct MsgTimer*)alloc(sizeof(struct MsgTimer));
     if (new_timer == NULL) {
         uart_puts("Failed to allocate memory for timer\r\n");
         return;
     }
 
-    unsigned long long curr_tick = get_tick();
-    memcpy(new_timer->msg, msg, strlen(msg) + 1);
-    new_timer->expiration = curr_tick + tick;
     new_timer->callback = callback;
-    
-
-    int reset = 0;
-
-    // Add the new timer to the list
-    timer_disable_irq();
-    if (timer_head == NULL) {  // List is empty
-        new_timer->prev = NULL;
-        new_timer->next = NULL;
-        timer_head = new_timer;
-        reset = 1;
-    }
-    else if (timer_head->expiration >= new_timer->expiration) {  // Insert at head
-        new_timer->next = timer_head;
-        timer_head->prev = new_timer;
-        new_timer->prev = NULL;
-        timer_head = new_timer;
-        reset = 1;
-    }
-    else {
-        struct Timer* curr = timer_head;
-        while (curr->next != NULL && curr->next->expiration < new_timer->expiration) {
-            curr = curr->next;
-        }
-        new_timer->next = curr->next;
-        new_timer->prev = curr;
-        curr->next = new_timer;
-        if (curr->next != NULL) {
-            curr->next->prev = new_timer;
-        }
+    new_timer->msg[0] = '\0';
+    if (msg != NULL) {
+        int len = strlen(msg);
+        if (len >= TIMER_MSG_SIZE) len = TIMER_MSG_SIZE - 1;
+        memcpy(new_timer->msg, msg, len);
+        new_timer->msg[len] = '\0';
     }
 
-    // Reset the timer
-    if (reset) {
-        set_timer_irq(timer_head->expiration - curr_tick);
-    }
-    timer_enable_irq();
-}
\ No newline at end of file
+    timer_setup(&new_timer->timer, msg_timer_callback);
+    mod_timer(&new_timer->timer, get_tick() + tick);
+}
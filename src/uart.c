@@ -1,4 +1,7 @@
 #include "uart.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "softirq.h"
 
 #define BUFFER_SIZE 4096
 
@@ -8,6 +11,12 @@ unsigned long rx_buffer_head = 0;       // The front of the buffer
 unsigned long rx_buffer_tail = 0;        // The index of the next character to be read
 unsigned long tx_buffer_head = 0;
 unsigned long tx_buffer_tail = 0;
+static spinlock_t rx_lock = SPINLOCK_INIT;  // Guards `rx_buffer` and its indices, taken in the IRQ handler too
+static spinlock_t tx_lock = SPINLOCK_INIT;
+static volatile unsigned int irq_masked;  // IER bits the hard IRQ handler turned off, served by `uart_softirq`
+static int irq_ready;                     // The rings are set up, reads and writes go through them
+static struct WaitQueueHead rx_wait = WAIT_QUEUE_HEAD_INIT;  // Readers waiting for `rx_buffer` to fill
+static struct WaitQueueHead tx_wait = WAIT_QUEUE_HEAD_INIT;  // Writers waiting for room in `tx_buffer`
 
 
 void delay(unsigned int cycles) {
@@ -81,8 +90,30 @@ void uart_flush_tx() {
 }
 
 
+/**
+ * uart_getc - Read one character, blocking until it arrives
+ *
+ * Polls the UART until `uart_irq_init` sets up the RX ring, then sleeps on
+ * the ring, which needs a task at EL1 with IRQs enabled. A caller that
+ * cannot sleep (no task yet, or IRQs masked) takes a character already in
+ * the ring, or else polls the UART.
+ */
 char uart_getc() {
     char ch;
+    if (irq_ready) {
+        if (get_current() != NULL && !irqs_disabled()) {
+            uart_recv(&ch, 1);
+            return ch;
+        }
+        unsigned long flags = spin_lock_irqsave(&rx_lock);
+        int got = rx_buffer_head != rx_buffer_tail;
+        if (got) {
+            ch = rx_buffer[rx_buffer_tail];
+            rx_buffer_tail = (rx_buffer_tail + 1) % BUFFER_SIZE;
+        }
+        spin_unlock_irqrestore(&rx_lock, flags);
+        if (got) return ch;
+    }
     do { asm volatile("nop"); } while (!(*AUX_MU_LSR_REG & 0x1));
     ch = (char)(*AUX_MU_IO_REG);
     return ch;
@@ -175,23 +206,23 @@ void uart_int(int d) {
 /* IRQ related */
 void uart_enable_irq() {
     *AUX_MU_IER_REG |= 0x03;        // Enable RX and TX interrupts
-    *ENABLE_IRQS_1 |= (1 << 29);    // Enable the interrupt line for the UART
+    irq_enable(IRQ_AUX);            // Enable the interrupt line for the UART
 }
 
 void uart_enable_rx_irq() {
     *AUX_MU_IER_REG |= 0x01;        // Only enable RX interrupt
-    *ENABLE_IRQS_1 |= (1 << 29);
+    irq_enable(IRQ_AUX);
 }
 
 void uart_enable_tx_irq() {
     *AUX_MU_IER_REG |= 0x02;        // Only enable TX interrupt
-    *ENABLE_IRQS_1 |= (1 << 29);
+    irq_enable(IRQ_AUX);
 }
 
 
 void uart_disable_irq() {
     *AUX_MU_IER_REG &= ~0x03;       // Disable RX and TX interrupts
-    *ENABLE_IRQS_1 &= ~(1 << 29);
+    irq_disable(IRQ_AUX);
 }
 
 void uart_disable_rx_irq() {
@@ -203,53 +234,151 @@ void uart_disable_tx_irq() {
 }
 
 
-void uart_irq_handler() {
-    if (*AUX_MU_IIR_REG & 0x04) {  // receive interrupt
-        add_task(uart_irq_rx_handler, 0);
-        execute_task();
+/**
+ * uart_irq_handler - Hard IRQ handler of the mini UART
+ *
+ * Only masks the interrupt that fired, the buffers are served by
+ * `uart_softirq` once IRQs are enabled again.
+ */
+void uart_irq_handler(unsigned int irq, void *dev) {
+    unsigned int iir = *AUX_MU_IIR_REG;
+    unsigned int masked = 0;
+    if (iir & 0x04) masked |= 0x01;  // receive interrupt
+    if (iir & 0x02) masked |= 0x02;  // transmit interrupt
+    if (masked == 0) return;
+
+    *AUX_MU_IER_REG &= ~masked;
+    __atomic_or_fetch(&irq_masked, masked, __ATOMIC_RELAXED);
+    raise_softirq(SOFTIRQ_UART);
+}
+
+static void uart_softirq() {
+    unsigned int masked = __atomic_exchange_n(&irq_masked, 0, __ATOMIC_RELAXED);
+    if (masked & 0x01) uart_irq_rx_handler();
+    if (masked & 0x02) uart_irq_tx_handler();
+}
+
+/**
+ * uart_irq_init - Switch the UART to interrupt-driven I/O
+ *
+ * From here on received characters are collected in `rx_buffer` by the RX
+ * interrupt, and `uart_recv`/`uart_send` sleep instead of polling. The
+ * polling `uart_putc` stays usable, e.g. for messages from IRQ context.
+ */
+void uart_irq_init() {
+    rx_buffer = (char*)alloc(BUFFER_SIZE);
+    tx_buffer = (char*)alloc(BUFFER_SIZE);
+    if (rx_buffer == NULL || tx_buffer == NULL) {
+        uart_puts("[WARN] uart_irq_init: failed to allocate the buffers\r\n");
+        return;
     }
-    if (*AUX_MU_IIR_REG & 0x02) {  // transmit interrupt
-        add_task(uart_irq_tx_handler, 0);
-        execute_task();
+
+    open_softirq(SOFTIRQ_UART, uart_softirq);
+    request_irq(IRQ_AUX, uart_irq_handler, "mini UART", NULL);
+    irq_ready = 1;
+    uart_enable_rx_irq();
+}
+
+/**
+ * uart_recv - Read up to `len` characters from the RX ring
+ *
+ * Sleeps until at least one character is there, then returns what is
+ * available without waiting for more.
+ *
+ * @return Number of characters read
+ */
+int uart_recv(char *buf, unsigned int len) {
+    unsigned int n = 0;
+    if (len == 0) return 0;
+
+    while (1) {
+        prepare_to_wait(&rx_wait);
+        unsigned long flags = spin_lock_irqsave(&rx_lock);
+        while (n < len && rx_buffer_head != rx_buffer_tail) {
+            buf[n++] = rx_buffer[rx_buffer_tail];
+            rx_buffer_tail = (rx_buffer_tail + 1) % BUFFER_SIZE;
+        }
+        uart_enable_rx_irq();  // Turned off while the ring was full
+        spin_unlock_irqrestore(&rx_lock, flags);
+        if (n > 0) break;
+        schedule();
     }
+    finish_wait(&rx_wait);
+    return n;
 }
 
 /**
- * uart_irq_rx_handler - UART RX interrupt handler
+ * uart_send - Queue `len` characters in the TX ring
+ *
+ * Returns once everything is queued, sleeping while the ring is full. The
+ * TX interrupt sends them. Polls the UART before `uart_irq_init`.
+ *
+ * @return Number of characters written
+ */
+int uart_send(const char *buf, unsigned int len) {
+    if (!irq_ready) return uart_putn((char*)buf, len);
+
+    unsigned int n = 0;
+    while (1) {
+        prepare_to_wait(&tx_wait);
+        unsigned long flags = spin_lock_irqsave(&tx_lock);
+        while (n < len && (tx_buffer_head + 1) % BUFFER_SIZE != tx_buffer_tail) {
+            tx_buffer[tx_buffer_head] = buf[n++];
+            tx_buffer_head = (tx_buffer_head + 1) % BUFFER_SIZE;
+        }
+        uart_enable_tx_irq();
+        spin_unlock_irqrestore(&tx_lock, flags);
+        if (n == len) break;
+        schedule();
+    }
+    finish_wait(&tx_wait);
+    return n;
+}
+
+/**
+ * uart_irq_rx_handler - UART RX bottom half
  * 
- * This function will be triggered by the RX interrupt of the UART
- * when the RX FIFO is not empty. It will read one character from
- * the RX FIFO and store it in the RX buffer (`rx_buffer`).
+ * Runs in the UART softirq after an RX interrupt. It drains the RX FIFO
+ * into the RX buffer (`rx_buffer`) and enables the RX interrupt again,
+ * unless the buffer is full (`uart_recv` enables it once drained), and
+ * wakes up the readers.
  */
 void uart_irq_rx_handler() {
+    unsigned long flags = spin_lock_irqsave(&rx_lock);
 
-    // Check if the buffer is full
-    if ((rx_buffer_head + 1) % BUFFER_SIZE == rx_buffer_tail) {
-        uart_disable_rx_irq();
-    }
-    else {
+    while (*AUX_MU_LSR_REG & 0x01) {
+        // Check if the buffer is full
+        if ((rx_buffer_head + 1) % BUFFER_SIZE == rx_buffer_tail) {
+            spin_unlock_irqrestore(&rx_lock, flags);
+            wake_up(&rx_wait);
+            return;
+        }
         rx_buffer[rx_buffer_head] = (char)(*AUX_MU_IO_REG);
         rx_buffer_head = (rx_buffer_head + 1) % BUFFER_SIZE;
     }
+    uart_enable_rx_irq();
+    spin_unlock_irqrestore(&rx_lock, flags);
+    wake_up(&rx_wait);
 }
 
 
 /**
- * uart_irq_tx_handler - UART TX interrupt handler
+ * uart_irq_tx_handler - UART TX bottom half
  * 
- * This function will be triggered by the TX interrupt of the UART
- * when the TX FIFO is empty. It will send one character from the
- * TX buffer (`tx_buffer`) to the TX FIFO.
+ * Runs in the UART softirq after a TX interrupt. It fills the TX FIFO from
+ * the TX buffer (`tx_buffer`), enables the TX interrupt again while
+ * there is more to send, and wakes up the writers waiting for room.
  */
 void uart_irq_tx_handler() {
-    // Check if the buffer is empty
-    if (tx_buffer_head == tx_buffer_tail) {
-        uart_disable_tx_irq();
-    }
-    else {
+    unsigned long flags = spin_lock_irqsave(&tx_lock);
+
+    while (tx_buffer_head != tx_buffer_tail && (*AUX_MU_LSR_REG & 0x20)) {
         *AUX_MU_IO_REG = tx_buffer[tx_buffer_tail];
         tx_buffer_tail = (tx_buffer_tail + 1) % BUFFER_SIZE;
     }
+    if (tx_buffer_head != tx_buffer_tail) uart_enable_tx_irq();
+    spin_unlock_irqrestore(&tx_lock, flags);
+    wake_up(&tx_wait);
 }
 
 
@@ -259,14 +388,18 @@ void uart_irq_tx_handler() {
  * @return: 1 if a character was received, 0 if no character was available
  */
 int uart_async_getc(char *ch) {
+    unsigned long flags = spin_lock_irqsave(&rx_lock);
+
     // Check if the buffer is empty
     if (rx_buffer_head == rx_buffer_tail) {
         *AUX_MU_IER_REG |= 0x01;  // Enable RX interrupt
+        spin_unlock_irqrestore(&rx_lock, flags);
         return 0;
     }
 
     *ch = rx_buffer[rx_buffer_tail];
     rx_buffer_tail = (rx_buffer_tail + 1) % BUFFER_SIZE;
+    spin_unlock_irqrestore(&rx_lock, flags);
     return 1;
 }
 
@@ -277,9 +410,12 @@ int uart_async_getc(char *ch) {
  * @return: 1 if a character was added to the buffer, 0 if the buffer is full
  */
 int uart_async_putc(char ch) {
+    unsigned long flags = spin_lock_irqsave(&tx_lock);
+
     // Check if the buffer is full
     if ((tx_buffer_head + 1) % BUFFER_SIZE == tx_buffer_tail) {
         uart_enable_tx_irq();  // Buffer is full, enable TX interrupt
+        spin_unlock_irqrestore(&tx_lock, flags);
         return 0;
     }
 
@@ -294,6 +430,7 @@ int uart_async_putc(char ch) {
         tx_buffer_head = (tx_buffer_head + 1) % BUFFER_SIZE;
     }
     uart_enable_tx_irq();  // Have data to send, enable TX interrupt
+    spin_unlock_irqrestore(&tx_lock, flags);
     return 1;
 }
 
@@ -337,13 +474,13 @@ void test_uart_async() {
     int ret;
     ret = uart_async_puts("Async UART test started...\r");
     if (ret == 0) {
-        uart_disable_irq();
+        uart_disable_tx_irq();  // RX stays on, the console reads through the RX ring
         uart_puts("Async UART test failed...\r\n");
         return;
     }
     ret = uart_async_puts("Press 'q' to exit...\r");
     if (ret == 0) {
-        uart_disable_irq();
+        uart_disable_tx_irq();
         uart_puts("Async UART test failed...\r\n");
         return;
     }
@@ -354,13 +491,13 @@ void test_uart_async() {
             continue;  // No data available
         }
         if (ch == 'q') {
-            uart_disable_irq();
+            uart_disable_tx_irq();
             uart_puts("Exiting async UART test...\r\n=========================\r\n");
             break;
         }
         ret = uart_async_putc(ch);
         if (ret == 0) {
-            uart_disable_irq();
+            uart_disable_tx_irq();
             uart_puts("Async UART test failed...\r\n");
             break;
         }
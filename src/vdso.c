@@ -0,0 +1,60 @@
+#include "vdso.h"
+#include "timer.h"
+#include "mmu.h"
+
+static union {
+    struct VdsoData data;
+    char page[PAGE_SIZE];
+} vdso_page __attribute__((aligned(PAGE_SIZE)));
+static spinlock_t vdso_lock = SPINLOCK_INIT;  // Serializes the writers, readers only use `seq`
+
+// Make the page odd, readers retry until `vdso_write_end`
+static void vdso_write_begin() {
+    vdso_page.data.seq++;
+    asm volatile("dmb ishst" ::: "memory");
+}
+
+static void vdso_write_end() {
+    asm volatile("dmb ishst" ::: "memory");
+    vdso_page.data.seq++;
+}
+
+void vdso_init() {
+    vdso_write_begin();
+    vdso_page.data.freq = get_freq();
+    vdso_page.data.boot_tick = get_tick();
+    vdso_page.data.realtime_sec = 0;  // No RTC, the wall clock starts at 0 until it is set
+    vdso_page.data.realtime_nsec = 0;
+    vdso_write_end();
+}
+
+/**
+ * vdso_set_realtime - Set the wall clock to `sec`.`nsec` seconds since the epoch
+ *
+ * Only the offset of CLOCK_REALTIME to CLOCK_MONOTONIC changes, the latter
+ * never jumps.
+ */
+void vdso_set_realtime(unsigned long long sec, unsigned long long nsec) {
+    unsigned long long elapsed = get_tick() - vdso_page.data.boot_tick;
+    unsigned long long freq = vdso_page.data.freq;
+    unsigned long long up_sec = elapsed / freq;
+    unsigned long long up_nsec = (elapsed % freq) * 1000000000ULL / freq;
+
+    // realtime = now - uptime, borrowing a second for the nanoseconds if needed
+    if (nsec < up_nsec) {
+        nsec += 1000000000ULL;
+        sec--;
+    }
+
+    unsigned long flags = spin_lock_irqsave(&vdso_lock);
+    vdso_write_begin();
+    vdso_page.data.realtime_sec = sec - up_sec;
+    vdso_page.data.realtime_nsec = nsec - up_nsec;
+    vdso_write_end();
+    spin_unlock_irqrestore(&vdso_lock, flags);
+}
+
+// Physical address of the page, to map at `VDSO_DATA_ADDR`
+unsigned long vdso_data_page() {
+    return (unsigned long)&vdso_page;
+}
@@ -0,0 +1,363 @@
+#include "vm.h"
+#include "sched.h"
+#include "string.h"
+#include "vdso.h"
+
+struct VMArea* vma_add(struct VMArea **list, unsigned long start, unsigned long end, unsigned long prot, int flags) {
+    struct VMArea *vma = (struct VMArea*)alloc(sizeof(struct VMArea));
+    if (vma == NULL) {
+        uart_puts("[WARN] vma_add: failed to allocate memory\r\n");
+        return NULL;
+    }
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->flags = flags;
+    vma->vnode = NULL;
+    vma->offset = 0;
+    vma->next = *list;
+    *list = vma;
+    return vma;
+}
+
+// Find the area that contains `va`, NULL if `va` is not part of the address space
+struct VMArea* vma_find(struct VMArea *list, unsigned long va) {
+    for (struct VMArea *vma = list; vma != NULL; vma = vma->next) {
+        if (va >= vma->start && va < vma->end) return vma;
+    }
+    return NULL;
+}
+
+struct VMArea* vma_find_flags(struct VMArea *list, int flags) {
+    for (struct VMArea *vma = list; vma != NULL; vma = vma->next) {
+        if (vma->flags & flags) return vma;
+    }
+    return NULL;
+}
+
+// Back `vma` with a file, the file content cannot move while it is mapped
+void vma_set_file(struct VMArea *vma, struct vnode *vnode, unsigned long offset) {
+    vma->vnode = vnode;
+    vma->offset = offset;
+    if (vnode != NULL) atomic_inc(&vnode->map_count);
+}
+
+static void vma_free(struct VMArea *vma) {
+    if (vma->vnode != NULL) atomic_dec(&vma->vnode->map_count);
+    free(vma);
+}
+
+int vma_copy_list(struct VMArea **dst, struct VMArea *src) {
+    for (struct VMArea *vma = src; vma != NULL; vma = vma->next) {
+        struct VMArea *copy = vma_add(dst, vma->start, vma->end, vma->prot, vma->flags);
+        if (copy == NULL) {
+            vma_free_list(dst);
+            return -1;
+        }
+        vma_set_file(copy, vma->vnode, vma->offset);
+    }
+    return 0;
+}
+
+void vma_free_list(struct VMArea **list) {
+    struct VMArea *vma = *list;
+    while (vma != NULL) {
+        struct VMArea *next = vma->next;
+        vma_free(vma);
+        vma = next;
+    }
+    *list = NULL;
+}
+
+/**
+ * vm_init_user_space - Reserve the stack and an empty heap of a new address space
+ *
+ * Nothing is allocated for them here, pages are mapped on first touch. The
+ * clock data page of the kernel is reserved read-only at `VDSO_DATA_ADDR`.
+ *
+ * @param heap_start: Where `brk` starts, right after the program image
+ */
+int vm_init_user_space(struct ThreadTask *task, unsigned long heap_start) {
+    heap_start = (heap_start + PAGE_SIZE - 1) & ~(unsigned long)(PAGE_SIZE - 1);
+    if (vma_add(&task->vma_list, USER_STACK_TOP - USER_STACK_MAX_SIZE, USER_STACK_TOP, PD_USER_RW, VMA_STACK) == NULL ||
+        vma_add(&task->vma_list, heap_start, heap_start, PD_USER_RW, VMA_HEAP) == NULL ||
+        vma_add(&task->vma_list, VDSO_DATA_ADDR, VDSO_DATA_ADDR + PAGE_SIZE, PD_USER_RW | PD_AP_RO, VMA_VDSO) == NULL) {
+        vma_free_list(&task->vma_list);
+        return -1;
+    }
+    task->brk = heap_start;
+    return 0;
+}
+
+/**
+ * file_page_prot - Memory attributes for mapping the page of a file at `pa`
+ *
+ * Pages outside of the RAM belong to a device (e.g. the frame buffer in the
+ * GPU memory) and must not be cached: GPU memory is mapped normal
+ * non-cacheable (write-combining), peripherals as device memory.
+ */
+static unsigned long file_page_prot(unsigned long pa, unsigned long prot) {
+    if (pa < RAM_END) return prot;
+
+    prot &= ~(PD_ATTR(0x7) | PD_SH_INNER);
+    if (pa < GPU_MEM_END) return prot | PD_ATTR(MAIR_IDX_NORMAL_NOCACHE);
+    return prot | PD_ATTR(MAIR_IDX_DEVICE_nGnRnE) | PD_UXN;
+}
+
+/**
+ * demand_fault - Map the missing page of `vma` that contains `va`
+ *
+ * Anonymous memory gets a zeroed page. A shared file mapping maps the page of
+ * the file itself. A private file mapping maps the page of the file
+ * read-only and copy-on-write, and only copies it right away for a write.
+ */
+static int demand_fault(struct ThreadTask *task, struct VMArea *vma, unsigned long va, int is_write) {
+    if (vma->flags & VMA_VDSO) {
+        return map_page(task->pgd, va, vdso_data_page(), vma->prot | PD_NOREF);
+    }
+    if (vma->vnode == NULL) {
+        void *page = alloc(PAGE_SIZE);
+        if (page == NULL) return -1;
+        memset(page, 0, PAGE_SIZE);
+        if (map_page(task->pgd, va, (unsigned long)page, vma->prot) != 0) {
+            free(page);
+            return -1;
+        }
+        return 0;
+    }
+
+    int shared = vma->flags & VMA_SHARED;
+    int prot = (shared && !(vma->prot & PD_AP_RO)) ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *file_page = vfs_mmap(vma->vnode, vma->offset + (va - vma->start), prot);
+    if (file_page == NULL) return -1;  // Past the end of the file
+
+    unsigned long pa = (unsigned long)file_page;
+    if (shared) {
+        return map_page(task->pgd, va, pa, file_page_prot(pa, vma->prot) | PD_NOREF);
+    }
+    if (!is_write) {
+        unsigned long cow = (vma->prot & PD_AP_RO) ? 0 : PD_COW;
+        return map_page(task->pgd, va, pa, file_page_prot(pa, vma->prot) | PD_AP_RO | PD_NOREF | cow);
+    }
+
+    void *page = alloc(PAGE_SIZE);
+    if (page == NULL) return -1;
+    memcpy_neon(page, file_page, PAGE_SIZE);
+    if (map_page(task->pgd, va, (unsigned long)page, vma->prot) != 0) {
+        free(page);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * do_page_fault - Handle an instruction/data abort on a user address
+ *
+ * Translation faults inside an area are resolved by `demand_fault`, write
+ * permission faults by breaking copy-on-write sharing. Anything else (no
+ * area, a write to a read-only area, ...) is fatal for the task.
+ *
+ * @param esr: ESR_EL1 of the abort, the faulting address is read from FAR_EL1
+ * @return 0 if the access can be retried, -1 otherwise
+ */
+int do_page_fault(unsigned long esr) {
+    struct ThreadTask *curr = get_current();
+    if (curr == NULL || curr->pgd == NULL) return -1;
+
+    unsigned long far;
+    asm volatile("mrs %0, far_el1" : "=r"(far));
+    unsigned long va = far & ~(unsigned long)(PAGE_SIZE - 1);
+
+    struct VMArea *vma = vma_find(curr->vma_list, far);
+    if (vma == NULL || (vma->flags & VMA_NOACCESS)) return -1;
+
+    unsigned long ec = (esr >> ESR_EC_SHIFT) & 0x3f;
+    unsigned long fsc = esr & ESR_ISS_DFSC_MASK;
+    int is_write = (ec != ESR_EC_IABT_LOW) && (esr & ESR_ISS_WNR);
+    if (is_write && (vma->prot & PD_AP_RO)) return -1;
+
+    if ((fsc & ~0x3UL) == DFSC_TRANS_FAULT) {
+        if (ec == ESR_EC_IABT_LOW && (vma->prot & PD_UXN)) return -1;
+        return demand_fault(curr, vma, va, is_write);
+    }
+    if ((fsc & ~0x3UL) == DFSC_PERM_FAULT && is_write) {
+        return cow_fault(curr->pgd, va, curr->asid);
+    }
+    return -1;
+}
+
+/**
+ * vm_brk - Move the end of the heap of `task`
+ *
+ * Growing only extends the heap area, the pages come from `do_page_fault`.
+ * Shrinking releases the pages above the new end.
+ *
+ * @param addr: New end of the heap, 0 to query it
+ * @return The end of the heap after the call, unchanged if `addr` is invalid
+ */
+unsigned long vm_brk(struct ThreadTask *task, unsigned long addr) {
+    struct VMArea *heap = vma_find_flags(task->vma_list, VMA_HEAP);
+    if (heap == NULL || addr == 0) return task->brk;
+    if (addr < heap->start || addr > heap->start + USER_HEAP_MAX_SIZE) return task->brk;
+
+    unsigned long end = (addr + PAGE_SIZE - 1) & ~(unsigned long)(PAGE_SIZE - 1);
+    if (end > heap->end) {
+        // The heap must not run into another area
+        for (struct VMArea *vma = task->vma_list; vma != NULL; vma = vma->next) {
+            if (vma != heap && vma->start < end && vma->end > heap->end) return task->brk;
+        }
+    }
+    else if (end < heap->end) {
+        unmap_pages(task->pgd, end, heap->end - end, task->asid);
+    }
+
+    heap->end = end;
+    task->brk = addr;
+    return task->brk;
+}
+
+// Whether [start, end) overlaps any area of `list`
+static int vma_overlaps(struct VMArea *list, unsigned long start, unsigned long end) {
+    for (struct VMArea *vma = list; vma != NULL; vma = vma->next) {
+        if (vma->start < end && vma->end > start) return 1;
+    }
+    return 0;
+}
+
+/**
+ * get_unmapped_area - Find a free range of `len` bytes for `mmap`
+ *
+ * Searches downwards from below the stack area, so that the heap keeps
+ * room to grow.
+ *
+ * @return Start of the range, 0 if there is no room
+ */
+static unsigned long get_unmapped_area(struct ThreadTask *task, unsigned long len) {
+    struct VMArea *heap = vma_find_flags(task->vma_list, VMA_HEAP);
+    unsigned long floor = (heap ? heap->start : USER_SPACE_START) + USER_HEAP_MAX_SIZE;
+    unsigned long end = USER_STACK_TOP - USER_STACK_MAX_SIZE - PAGE_SIZE;  // Leave a guard page
+
+    while (end > floor && end - floor >= len) {
+        unsigned long start = end - len;
+        struct VMArea *vma = task->vma_list;
+        for (; vma != NULL; vma = vma->next) {
+            if (vma->start < end && vma->end > start) break;
+        }
+        if (vma == NULL) return start;
+        end = vma->start;
+    }
+    return 0;
+}
+
+static unsigned long prot_to_pd(int prot) {
+    unsigned long pd = PD_USER_RWX;
+    if (!(prot & PROT_WRITE)) pd |= PD_AP_RO;
+    if (!(prot & PROT_EXEC)) pd |= PD_UXN;
+    return pd;
+}
+
+/**
+ * vm_mmap - Create a new area in the address space of `task`
+ *
+ * Nothing is mapped here, the pages come from `do_page_fault`. File pages are
+ * mapped without copying them (see `vfs_mmap`).
+ *
+ * @param addr: Hint of the start address, the exact address with `MAP_FIXED`
+ * @param vnode: Backing file, ignored with `MAP_ANONYMOUS`
+ * @param offset: Page-aligned offset in the file
+ * @return Start of the area, or `MAP_FAILED`
+ */
+unsigned long vm_mmap(struct ThreadTask *task, unsigned long addr, unsigned long len, int prot, int flags, struct vnode *vnode, unsigned long offset) {
+    if (task == NULL || task->pgd == NULL || len == 0) return (unsigned long)MAP_FAILED;
+    if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) return (unsigned long)MAP_FAILED;
+    if ((addr | offset) & (PAGE_SIZE - 1)) return (unsigned long)MAP_FAILED;
+
+    len = (len + PAGE_SIZE - 1) & ~(unsigned long)(PAGE_SIZE - 1);
+    if (flags & MAP_ANONYMOUS) {
+        vnode = NULL;
+        offset = 0;
+    }
+    else if (vnode == NULL || vnode->f_ops == NULL || vnode->f_ops->mmap == NULL) {
+        return (unsigned long)MAP_FAILED;
+    }
+    else if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && vfs_mmap(vnode, offset, PROT_READ | PROT_WRITE) == NULL) {
+        return (unsigned long)MAP_FAILED;  // e.g. a read-only filesystem
+    }
+
+    if (flags & MAP_FIXED) {
+        if (addr < USER_SPACE_START || addr + len > USER_STACK_TOP || addr + len < addr) return (unsigned long)MAP_FAILED;
+        if (vm_munmap(task, addr, len) != 0) return (unsigned long)MAP_FAILED;
+    }
+    else if (addr < USER_SPACE_START || addr + len > USER_STACK_TOP || addr + len < addr ||
+             vma_overlaps(task->vma_list, addr, addr + len)) {
+        addr = get_unmapped_area(task, len);
+        if (addr == 0) return (unsigned long)MAP_FAILED;
+    }
+
+    int vma_flags = VMA_MMAP;
+    if (flags & MAP_SHARED) vma_flags |= VMA_SHARED;
+    if (prot == PROT_NONE) vma_flags |= VMA_NOACCESS;
+    unsigned long pd = prot_to_pd(prot);
+    if (flags & MAP_SHARED) pd |= PD_SHARED;
+
+    struct VMArea *vma = vma_add(&task->vma_list, addr, addr + len, pd, vma_flags);
+    if (vma == NULL) return (unsigned long)MAP_FAILED;
+    vma_set_file(vma, vnode, offset);
+    return addr;
+}
+
+/**
+ * vm_munmap - Remove the mappings of [addr, addr + len) created by `mmap`
+ *
+ * Areas are trimmed or split as needed. The stack, heap and program image
+ * cannot be unmapped; a range that touches them is rejected.
+ */
+int vm_munmap(struct ThreadTask *task, unsigned long addr, unsigned long len) {
+    if (task == NULL || (addr & (PAGE_SIZE - 1)) || len == 0) return -1;
+    unsigned long end = (addr + len + PAGE_SIZE - 1) & ~(unsigned long)(PAGE_SIZE - 1);
+    if (end < addr) return -1;
+
+    struct VMArea *split = NULL;
+    for (struct VMArea *vma = task->vma_list; vma != NULL; vma = vma->next) {
+        if (vma->start < end && vma->end > addr && !(vma->flags & VMA_MMAP)) return -1;
+        if (vma->start < addr && vma->end > end) split = vma;
+    }
+
+    // Allocate the tail of a split area first, so that a failure leaves the mapping untouched
+    struct VMArea *tail = NULL;
+    if (split != NULL && vma_add(&tail, end, split->end, split->prot, split->flags) == NULL) return -1;
+
+    struct VMArea **link = &task->vma_list;
+    while (*link != NULL) {
+        struct VMArea *vma = *link;
+        if (vma->start >= end || vma->end <= addr) {
+            link = &vma->next;
+            continue;
+        }
+
+        unsigned long start = vma->start > addr ? vma->start : addr;
+        unsigned long stop = vma->end < end ? vma->end : end;
+        unmap_pages(task->pgd, start, stop - start, task->asid);
+
+        if (start == vma->start && stop == vma->end) {  // The whole area
+            *link = vma->next;
+            vma_free(vma);
+            continue;
+        }
+        if (start == vma->start) {  // The head
+            vma->offset += stop - vma->start;
+            vma->start = stop;
+        }
+        else if (stop == vma->end) {  // The tail
+            vma->end = start;
+        }
+        else {  // The middle, split into two areas
+            tail->next = vma->next;
+            vma->next = tail;
+            vma_set_file(tail, vma->vnode, vma->offset + (stop - vma->start));
+            vma->end = start;
+        }
+        link = &vma->next;
+    }
+    return 0;
+}
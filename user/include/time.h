@@ -0,0 +1,19 @@
+#ifndef TIME_H
+#define TIME_H
+
+#include "vdso.h"  // CLOCK_REALTIME, CLOCK_MONOTONIC
+
+struct timespec {
+    long tv_sec;
+    long tv_nsec;
+};
+
+struct timeval {
+    long tv_sec;
+    long tv_usec;
+};
+
+int clock_gettime(int clock_id, struct timespec *ts);
+int gettimeofday(struct timeval *tv, void *tz);
+
+#endif /* TIME_H */
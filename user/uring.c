@@ -0,0 +1,36 @@
+#include "uring.h"
+
+int uring_setup(struct uring *ring) {
+    register unsigned long x0 asm("x0") = (unsigned long)ring;
+    asm volatile("mov x8, 24\nsvc 0" : "+r"(x0) : : "x8", "memory");
+    return (int)x0;
+}
+
+int uring_enter(unsigned int to_submit) {
+    register unsigned long x0 asm("x0") = to_submit;
+    asm volatile("mov x8, 25\nsvc 0" : "+r"(x0) : : "x8", "memory");
+    return (int)x0;
+}
+
+// Next free SQ slot, NULL if the SQ is full. It is queued by `uring_submit`
+struct uring_sqe* uring_get_sqe(struct uring *ring) {
+    unsigned int head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail - head >= URING_SQ_ENTRIES) return 0;
+    return &ring->sqes[ring->sq_tail % URING_SQ_ENTRIES];
+}
+
+// Publish the slot returned by `uring_get_sqe`
+void uring_submit(struct uring *ring) {
+    __atomic_store_n(&ring->sq_tail, ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+// Oldest completion not seen yet, NULL if there is none
+struct uring_cqe* uring_peek_cqe(struct uring *ring) {
+    if (__atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) == ring->cq_head) return 0;
+    return &ring->cqes[ring->cq_head % URING_CQ_ENTRIES];
+}
+
+// Hand the completion returned by `uring_peek_cqe` back to the kernel
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+}